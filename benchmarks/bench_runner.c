@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+// Runs every STAR workload several times through the interpreter and reports
+// statements/sec, ns/statement, peak RSS and output bytes/sec as JSON. A workload with a
+// tape of the same name (dialog.sta, dialog.tape) gets its input replayed from the tape.
+// Usage: bench_runner [--interpreter PATH] [--runs N] [--baseline FILE]
+//                     [--threshold PERCENT] workload.sta...
+
+#define MAX_WORKLOADS 64
+#define MAX_RUNS 100
+
+typedef struct {
+    const char* path;
+    char name[64];
+    char tape[1024];  // Empty when the workload reads no input
+    long long statements;
+    double seconds[MAX_RUNS];
+    double medianSeconds;
+    long peakRssKb;
+    long long outputBytes;
+    int failed;
+    double baselineNsPerStatement;  // 0 when the baseline has no entry
+    int regression;
+} Workload;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Reads the "statements: N" line every workload carries in its header comment
+static long long read_statement_count(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    char line[1024];
+    long long statements = -1;
+    while (fgets(line, sizeof(line), file)) {
+        char* found = strstr(line, "statements:");
+        if (found) {
+            statements = atoll(found + strlen("statements:"));
+            break;
+        }
+    }
+    fclose(file);
+    return statements;
+}
+
+static void workload_name(const char* path, char* name, size_t size) {
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    snprintf(name, size, "%s", base);
+    char* dot = strrchr(name, '.');
+    if (dot) *dot = '\0';
+}
+
+// Runs the interpreter once; stdout is drained through a pipe so output bytes can be counted
+static int run_once(const char* interpreter, Workload* workload, double* seconds) {
+    int pipeFds[2];
+    if (pipe(pipeFds) != 0) {
+        perror("pipe");
+        return 0;
+    }
+
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 0;
+    }
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_RDONLY);
+        dup2(devNull, STDIN_FILENO);
+        dup2(pipeFds[1], STDOUT_FILENO);
+        close(pipeFds[0]);
+        close(pipeFds[1]);
+        if (workload->tape[0]) {
+            execl(interpreter, interpreter, "--replay", workload->tape, workload->path, (char*)NULL);
+        } else {
+            execl(interpreter, interpreter, workload->path, (char*)NULL);
+        }
+        perror("execl");
+        _exit(127);
+    }
+
+    close(pipeFds[1]);
+    char buffer[65536];
+    long long outputBytes = 0;
+    ssize_t n;
+    while ((n = read(pipeFds[0], buffer, sizeof(buffer))) > 0) {
+        outputBytes += n;
+    }
+    close(pipeFds[0]);
+
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    *seconds = now_seconds() - start;
+
+    workload->outputBytes = outputBytes;
+    if (usage.ru_maxrss > workload->peakRssKb) {
+        workload->peakRssKb = usage.ru_maxrss;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Looks up "ns_per_statement" for a workload in a previous report of this runner
+static double baseline_ns_per_statement(const char* baseline, const char* name) {
+    char key[96];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+    const char* entry = strstr(baseline, key);
+    if (!entry) {
+        return 0;
+    }
+    const char* field = strstr(entry, "\"ns_per_statement\":");
+    const char* next = strstr(entry + 1, "\"name\":");
+    if (!field || (next && field > next)) {
+        return 0;
+    }
+    return atof(field + strlen("\"ns_per_statement\":"));
+}
+
+static char* read_file(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* data = malloc(size + 1);
+    if (data) {
+        data[fread(data, 1, size, file)] = '\0';
+    }
+    fclose(file);
+    return data;
+}
+
+int main(int argc, char* argv[]) {
+    const char* interpreter = "./star";
+    const char* baselinePath = NULL;
+    int runs = 5;
+    double threshold = 10.0;
+    Workload workloads[MAX_WORKLOADS];
+    int workloadCount = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--interpreter") == 0 && i + 1 < argc) {
+            interpreter = argv[++i];
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baselinePath = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            return 2;
+        } else if (workloadCount < MAX_WORKLOADS) {
+            Workload* workload = &workloads[workloadCount++];
+            memset(workload, 0, sizeof(*workload));
+            workload->path = argv[i];
+            workload_name(argv[i], workload->name, sizeof(workload->name));
+            const char* extension = strrchr(argv[i], '.');
+            int stem = extension && strcmp(extension, ".sta") == 0 ? (int)(extension - argv[i]) : (int)strlen(argv[i]);
+            snprintf(workload->tape, sizeof(workload->tape), "%.*s.tape", stem, argv[i]);
+            if (access(workload->tape, R_OK) != 0) {
+                workload->tape[0] = '\0';
+            }
+        }
+    }
+    if (runs < 1 || runs > MAX_RUNS || workloadCount == 0) {
+        fprintf(stderr, "Usage: %s [--interpreter PATH] [--runs 1-%d] [--baseline FILE] [--threshold PERCENT] workload.sta...\n",
+                argv[0], MAX_RUNS);
+        return 2;
+    }
+
+    char* baseline = baselinePath ? read_file(baselinePath) : NULL;
+    if (baselinePath && !baseline) {
+        fprintf(stderr, "Error: Could not open baseline file '%s'\n", baselinePath);
+        return 2;
+    }
+
+    int regressions = 0;
+    int failures = 0;
+    for (int w = 0; w < workloadCount; w++) {
+        Workload* workload = &workloads[w];
+        workload->statements = read_statement_count(workload->path);
+        if (workload->statements <= 0) {
+            fprintf(stderr, "Error: '%s' has no 'statements: N' header\n", workload->path);
+            workload->failed = 1;
+            failures++;
+            continue;
+        }
+
+        double warmup;
+        run_once(interpreter, workload, &warmup);
+        for (int r = 0; r < runs && !workload->failed; r++) {
+            if (!run_once(interpreter, workload, &workload->seconds[r])) {
+                fprintf(stderr, "Error: '%s' did not run successfully\n", workload->path);
+                workload->failed = 1;
+                failures++;
+            }
+        }
+        if (workload->failed) {
+            continue;
+        }
+
+        qsort(workload->seconds, runs, sizeof(double), compare_doubles);
+        workload->medianSeconds = workload->seconds[runs / 2];
+
+        if (baseline) {
+            workload->baselineNsPerStatement = baseline_ns_per_statement(baseline, workload->name);
+            double ns = workload->medianSeconds * 1e9 / workload->statements;
+            if (workload->baselineNsPerStatement > 0 &&
+                ns > workload->baselineNsPerStatement * (1.0 + threshold / 100.0)) {
+                workload->regression = 1;
+                regressions++;
+            }
+        }
+    }
+
+    printf("{\n  \"runs\": %d,\n  \"workloads\": [\n", runs);
+    for (int w = 0; w < workloadCount; w++) {
+        Workload* workload = &workloads[w];
+        printf("    {\"name\": \"%s\", ", workload->name);
+        if (workload->failed) {
+            printf("\"failed\": true}");
+        } else {
+            double seconds = workload->medianSeconds;
+            printf("\"statements\": %lld, \"median_seconds\": %.6f, \"statements_per_second\": %.0f, "
+                   "\"ns_per_statement\": %.2f, \"peak_rss_kb\": %ld, \"output_bytes\": %lld, "
+                   "\"output_bytes_per_second\": %.0f",
+                   workload->statements, seconds, workload->statements / seconds,
+                   seconds * 1e9 / workload->statements, workload->peakRssKb,
+                   workload->outputBytes, workload->outputBytes / seconds);
+            if (workload->baselineNsPerStatement > 0) {
+                printf(", \"baseline_ns_per_statement\": %.2f, \"regression\": %s",
+                       workload->baselineNsPerStatement, workload->regression ? "true" : "false");
+            }
+            printf("}");
+        }
+        printf("%s\n", w + 1 < workloadCount ? "," : "");
+    }
+    printf("  ],\n  \"regressions\": %d,\n  \"failures\": %d\n}\n", regressions, failures);
+
+    free(baseline);
+    return (regressions || failures) ? 1 : 0;
+}
@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <time.h>
+
+// Component microbenchmarks for the hot functions of main.c: the front end
+// (scan_source, lex_edit), the symbol table (find_variable/set_int_variable), the two
+// expression evaluators and number conversion. main.c is compiled into this file
+// so static helpers can be called directly.
+// Usage: microbench [--samples N] [--warmup N] [--cpu N] [--size MB]
+
+#define MAX_VARIABLES 1024
+#define main star_main
+#include "../main.c"
+#undef main
+
+typedef void (*BenchFunction)(void* arg, long iterations);
+
+static int sampleCount = 31;
+static int warmupCount = 5;
+static int firstReport = 1;
+static volatile long sink;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double* sorted, int count, double p) {
+    int index = (int)(p / 100.0 * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+// Times `iterations` calls per sample and reports ns per call; bytesPerCall > 0 adds MB/s
+static void run_bench(const char* name, BenchFunction function, void* arg, long iterations, double bytesPerCall) {
+    double* samples = malloc(sizeof(double) * sampleCount);
+
+    for (int i = 0; i < warmupCount; i++) {
+        function(arg, iterations);
+    }
+    for (int i = 0; i < sampleCount; i++) {
+        double start = now_ns();
+        function(arg, iterations);
+        samples[i] = (now_ns() - start) / iterations;
+    }
+    qsort(samples, sampleCount, sizeof(double), compare_doubles);
+
+    double median = percentile(samples, sampleCount, 50);
+    printf("%s    {\"name\": \"%s\", \"ns_per_call\": {\"min\": %.2f, \"median\": %.2f, \"p90\": %.2f, \"p99\": %.2f}",
+           firstReport ? "" : ",\n", name, samples[0], median,
+           percentile(samples, sampleCount, 90), percentile(samples, sampleCount, 99));
+    if (bytesPerCall > 0) {
+        printf(", \"mb_per_second\": %.1f", bytesPerCall / median * 1e9 / (1024.0 * 1024.0));
+    }
+    printf("}");
+    firstReport = 0;
+    free(samples);
+}
+
+// Front end: scans a whole generated source per call
+
+static void bench_scan(void* arg, long iterations) {
+    const char* source = arg;
+    for (long i = 0; i < iterations; i++) {
+        TokenStream stream;
+        scan_source(source, &stream);
+        sink = stream.tokenCount + stream.diagnosticCount;
+        free_token_stream(&stream);
+    }
+}
+
+static char* build_source(size_t size) {
+    static const char* chunk =
+        "int base, height, area, number, stepOne, stepTwo.\n"
+        "area is (base * height) / 2.\n"
+        "write \"Triangle Area: \", area.\n"
+        "loop 10 times { stepTwo is stepOne + (number / stepOne). newLine. }\n"
+        "text greeting is \"There is no place\", rest.\n"
+        "rest is greeting - \"no \".\n";
+    size_t chunkLength = strlen(chunk);
+    char* source = malloc(size + chunkLength + 1);
+    size_t length = 0;
+    while (length < size) {
+        memcpy(source + length, chunk, chunkLength);
+        length += chunkLength;
+    }
+    source[length] = '\0';
+    return source;
+}
+
+// Incremental lexing: one character typed and deleted again in the middle of the document
+
+typedef struct {
+    LexDocument* document;
+    long long offset;
+} LexEditBench;
+
+static void bench_lex_edit(void* arg, long iterations) {
+    LexEditBench* bench = arg;
+    for (long i = 0; i < iterations; i++) {
+        if (i & 1) {
+            lex_edit(bench->document, bench->offset, 1, "", 0);
+        } else {
+            lex_edit(bench->document, bench->offset, 0, "{", 1);
+        }
+    }
+    sink = bench->document->diagnosticCount;
+}
+
+// Symbol table: lookups and updates spread over every declared variable
+
+typedef struct {
+    Context* context;
+    char names[1000][24];
+    int count;
+} SymbolBench;
+
+static void bench_find_variable(void* arg, long iterations) {
+    SymbolBench* bench = arg;
+    long found = 0;
+    for (long i = 0; i < iterations; i++) {
+        found += find_variable(bench->context, bench->names[i % bench->count]) >= 0;
+    }
+    sink = found;
+}
+
+static void bench_set_int_variable(void* arg, long iterations) {
+    SymbolBench* bench = arg;
+    for (long i = 0; i < iterations; i++) {
+        set_int_variable(bench->context, bench->names[i % bench->count], 12345);
+    }
+}
+
+// Expressions: the string-walking evaluator against the AST evaluator on the same formulas
+
+typedef struct {
+    Context* context;
+    const char* text;
+    ASTNode* tree;
+    TokenStream tokens;
+} ExpressionBench;
+
+static void bench_eval_tokens(void* arg, long iterations) {
+    ExpressionBench* bench = arg;
+    long total = 0;
+    for (long i = 0; i < iterations; i++) {
+        int index = 0;
+        total += eval_expression_helper(bench->tokens.tokens, &index, bench->context);
+    }
+    sink = total;
+}
+
+static void bench_eval_tree(void* arg, long iterations) {
+    ExpressionBench* bench = arg;
+    long total = 0;
+    for (long i = 0; i < iterations; i++) {
+        total += eval_expression(bench->tree, bench->context);
+    }
+    sink = total;
+}
+
+static ASTNode* expression_node(ASTNode* left, char op, ASTNode* right) {
+    ASTNode* node = create_assign_node(left, right, op);
+    node->type = NODE_EXPRESSION;
+    return node;
+}
+
+// Number conversion: formatting and parsing of values of every digit count
+
+static const int sampleValues[8] = {7, 42, 905, 1234, 56789, 123456, 9876543, 99999999};
+
+static void bench_format_integer(void* arg, long iterations) {
+    (void)arg;
+    char buffer[MAX_INTEGER_LENGTH + 1];
+    long total = 0;
+    for (long i = 0; i < iterations; i++) {
+        total += format_integer(buffer, sampleValues[i & 7]);
+    }
+    sink = total;
+}
+
+static void bench_parse_integer(void* arg, long iterations) {
+    char (*texts)[MAX_INTEGER_LENGTH + 1] = arg;
+    long total = 0;
+    for (long i = 0; i < iterations; i++) {
+        total += parse_integer(texts[i & 7]);
+    }
+    sink = total;
+}
+
+static void bench_parse_integer_input(void* arg, long iterations) {
+    char (*texts)[MAX_INTEGER_LENGTH + 1] = arg;
+    long total = 0;
+    for (long i = 0; i < iterations; i++) {
+        int value;
+        total += parse_integer_input(texts[i & 7], &value) + value;
+    }
+    sink = total;
+}
+
+int main(int argc, char* argv[]) {
+    int cpu = -1;
+    size_t sourceSize = 4 * 1024 * 1024;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            sampleCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            warmupCount = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            sourceSize = (size_t)atoi(argv[++i]) * 1024 * 1024;
+        } else {
+            fprintf(stderr, "Usage: %s [--samples N] [--warmup N] [--cpu N] [--size MB]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (sampleCount < 1 || warmupCount < 0 || sourceSize == 0) {
+        fprintf(stderr, "Error: Invalid benchmark parameters\n");
+        return 2;
+    }
+
+    // Pin to one CPU so samples are not spread over cores with different clocks and caches
+    if (cpu < 0) {
+        cpu = sched_getcpu();
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0) {
+        perror("sched_setaffinity");
+        cpu = -1;
+    }
+
+    printf("{\n  \"cpu\": %d,\n  \"samples\": %d,\n  \"warmup\": %d,\n  \"benchmarks\": [\n", cpu, sampleCount, warmupCount);
+
+    char* source = build_source(sourceSize);
+    run_bench("scan_source", bench_scan, source, 1, (double)strlen(source));
+    LexEditBench lexEdit = {lex_open(source), (long long)strlen(source) / 2};
+    run_bench("lex_edit", bench_lex_edit, &lexEdit, 10000, 0);
+    lex_close(lexEdit.document);
+    free(source);
+
+    static const int variableCounts[] = {10, 100, 1000};
+    for (int v = 0; v < 3; v++) {
+        SymbolBench* bench = calloc(1, sizeof(SymbolBench));
+        bench->context = calloc(1, sizeof(Context));
+        bench->count = variableCounts[v];
+        for (int i = 0; i < bench->count; i++) {
+            snprintf(bench->names[i], sizeof(bench->names[i]), "variable%d", i);
+            set_int_variable(bench->context, bench->names[i], 0);
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "find_variable/%d", bench->count);
+        run_bench(name, bench_find_variable, bench, 100000, 0);
+        snprintf(name, sizeof(name), "set_int_variable/%d", bench->count);
+        run_bench(name, bench_set_int_variable, bench, 100000, 0);
+        free(bench->context);
+        free(bench);
+    }
+
+    Context* context = calloc(1, sizeof(Context));
+    set_int_variable(context, "base", 6);
+    set_int_variable(context, "height", 4);
+    set_int_variable(context, "number", 12345);
+    set_int_variable(context, "stepOne", 10);
+    ExpressionBench expressions[] = {
+        {.context = context, .text = "(base * height) / 2.",
+         .tree = expression_node(expression_node(create_var_node("base"), '*', create_var_node("height")), '/', create_int_node(2))},
+        {.context = context, .text = "stepOne + (number / stepOne).",
+         .tree = expression_node(create_var_node("stepOne"), '+',
+                                 expression_node(create_var_node("number"), '/', create_var_node("stepOne")))},
+        {.context = context, .text = "12345 * 3 / 2.",
+         .tree = expression_node(expression_node(create_int_node(12345), '*', create_int_node(3)), '/', create_int_node(2))},
+    };
+    for (int e = 0; e < 3; e++) {
+        char name[96];
+        scan_source(expressions[e].text, &expressions[e].tokens);
+        snprintf(name, sizeof(name), "eval_expression_helper/%s", expressions[e].text);
+        run_bench(name, bench_eval_tokens, &expressions[e], 100000, 0);
+        snprintf(name, sizeof(name), "eval_expression/%s", expressions[e].text);
+        run_bench(name, bench_eval_tree, &expressions[e], 100000, 0);
+        free_token_stream(&expressions[e].tokens);
+    }
+    free(context);
+
+    char numberTexts[8][MAX_INTEGER_LENGTH + 1];
+    for (int i = 0; i < 8; i++) {
+        format_integer(numberTexts[i], sampleValues[i]);
+    }
+    run_bench("format_integer", bench_format_integer, NULL, 100000, 0);
+    run_bench("parse_integer", bench_parse_integer, numberTexts, 100000, 0);
+    run_bench("parse_integer_input", bench_parse_integer_input, numberTexts, 100000, 0);
+
+    // Comment-dense source, comments are skipped by the same scan
+    static const char* commentLines =
+        "a is 1. /* one */ b is 2. /* two */ c is 3.\n"
+        "write x. /* a comment that\n"
+        "   spans several lines of text\n"
+        "   and closes here */ newLine. /* x */ /* y */\n"
+        "/* header */ int count is 5. /* trailing */\n";
+    size_t commentLength = strlen(commentLines);
+    char* comments = malloc(commentLength * 800 + 1);
+    for (int i = 0; i < 800; i++) {
+        memcpy(comments + i * commentLength, commentLines, commentLength);
+    }
+    comments[commentLength * 800] = '\0';
+    run_bench("scan_source/comments", bench_scan, comments, 10, (double)(commentLength * 800));
+    free(comments);
+
+    printf("\n  ]\n}\n");
+    return 0;
+}
@@ -1,13 +1,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <ctype.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <time.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#endif
 
+#ifndef MAX_VARIABLES  // The microbenchmarks build with a larger table
 #define MAX_VARIABLES 100
+#endif
 #define MAX_STRING_LENGTH 100
+#define MAX_TEXT_LENGTH 256
+#define MAX_INTEGER_VALUE 99999999
 #define MAX_IDENTIFIER_LENGTH 50
 #define MAX_INTEGER_LENGTH 12
 #define MAX_STACK_SIZE 100
+#define MAX_LOOP_DEPTH 64  // Deepest nesting the --threads statement analysis follows
+#define VARIABLE_MASK_WORDS ((MAX_VARIABLES + 63) / 64)
 
 typedef struct {
     char items[MAX_STACK_SIZE];
@@ -44,6 +71,724 @@ char pop(Stack *stack) {
     }
 }
 
+// Runtime statistics, dumped as JSON by --stats. Every thread counts into its own
+// Stats block without synchronisation; the blocks are summed when they are read.
+typedef enum {
+    STATEMENT_DECLARATION,
+    STATEMENT_ASSIGNMENT,
+    STATEMENT_WRITE,
+    STATEMENT_READ,
+    STATEMENT_NEWLINE,
+    STATEMENT_LOOP,
+    STATEMENT_KIND_COUNT
+} StatementKind;
+
+const char* statementKindNames[] = {
+    "declaration", "assignment", "write", "read", "newLine", "loop"
+};
+
+typedef struct Stats {
+    long long tokensLexed;
+    long long statements[STATEMENT_KIND_COUNT];
+    long long variableLookups;
+    long long lookupProbes;
+    long long mallocCalls;
+    long long mallocBytes;
+    long long textCopies;
+    long long bytesWritten;
+    long long flushes;
+    long long readCalls;
+    struct Stats* nextThread;
+} Stats;
+
+Stats mainThreadStats;
+Stats* registeredStats = &mainThreadStats;
+_Thread_local Stats* threadStats = &mainThreadStats;  // Other threads call stats_attach_thread first
+
+#define STAT_ADD(field, amount) (threadStats->field += (amount))
+
+// Registers a new block of counters; blocks stay registered for the life of the process
+Stats* stats_new_block(void) {
+    Stats* stats = calloc(1, sizeof(Stats));
+    if (stats == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    stats->nextThread = __atomic_load_n(&registeredStats, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&registeredStats, &stats->nextThread, stats, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return stats;
+}
+
+// Gives the calling thread its own counters
+void stats_attach_thread(void) {
+    threadStats = stats_new_block();
+}
+
+// Sums the counters of every thread into total, returns the number of threads
+int stats_collect(Stats* total) {
+    int threads = 0;
+    memset(total, 0, sizeof(*total));
+    for (Stats* stats = __atomic_load_n(&registeredStats, __ATOMIC_ACQUIRE); stats; stats = stats->nextThread) {
+        total->tokensLexed += stats->tokensLexed;
+        for (int kind = 0; kind < STATEMENT_KIND_COUNT; kind++) {
+            total->statements[kind] += stats->statements[kind];
+        }
+        total->variableLookups += stats->variableLookups;
+        total->lookupProbes += stats->lookupProbes;
+        total->mallocCalls += stats->mallocCalls;
+        total->mallocBytes += stats->mallocBytes;
+        total->textCopies += stats->textCopies;
+        total->bytesWritten += stats->bytesWritten;
+        total->flushes += stats->flushes;
+        total->readCalls += stats->readCalls;
+        threads++;
+    }
+    return threads;
+}
+
+// Registered with atexit by --stats, so it also runs when a script stops on an error
+void stats_report(void) {
+    Stats total;
+    int threads = stats_collect(&total);
+    long long statementTotal = 0;
+    for (int kind = 0; kind < STATEMENT_KIND_COUNT; kind++) {
+        statementTotal += total.statements[kind];
+    }
+
+    fprintf(stderr, "{\n  \"threads\": %d,\n  \"tokens_lexed\": %lld,\n", threads, total.tokensLexed);
+    fprintf(stderr, "  \"statements\": {\"total\": %lld", statementTotal);
+    for (int kind = 0; kind < STATEMENT_KIND_COUNT; kind++) {
+        fprintf(stderr, ", \"%s\": %lld", statementKindNames[kind], total.statements[kind]);
+    }
+    fprintf(stderr, "},\n");
+    fprintf(stderr, "  \"variable_lookups\": %lld,\n  \"average_probe_length\": %.2f,\n",
+            total.variableLookups, total.variableLookups ? (double)total.lookupProbes / total.variableLookups : 0.0);
+    fprintf(stderr, "  \"malloc_calls\": %lld,\n  \"malloc_bytes\": %lld,\n  \"text_copies\": %lld,\n",
+            total.mallocCalls, total.mallocBytes, total.textCopies);
+    fprintf(stderr, "  \"bytes_written\": %lld,\n  \"flushes\": %lld,\n  \"read_calls\": %lld\n}\n",
+            total.bytesWritten, total.flushes, total.readCalls);
+}
+
+// malloc that counts the allocation and stops the interpreter when memory runs out
+void* allocate(size_t size) {
+    void* memory = malloc(size);
+    if (memory == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    STAT_ADD(mallocCalls, 1);
+    STAT_ADD(mallocBytes, size);
+    return memory;
+}
+
+// Grows a table by doubling, counting the allocation like allocate() does
+void* grow_table(void* table, int* capacity, size_t elementSize) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    table = realloc(table, elementSize * *capacity);
+    if (table == NULL) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    STAT_ADD(mallocCalls, 1);
+    STAT_ADD(mallocBytes, elementSize * *capacity);
+    return table;
+}
+
+_Thread_local jmp_buf* runtimeErrorTrap;  // Set while a session, a --batch record or a --fuel slice runs
+
+// Called after a runtime error has been reported. It stops the interpreter, or only the
+// session, record or scheduled instance that failed.
+_Noreturn void stop_on_error(void) {
+    if (runtimeErrorTrap) {
+        longjmp(*runtimeErrorTrap, 1);
+    }
+    exit(1);
+}
+
+#ifndef _WIN32
+// Asynchronous I/O (--async-io). A dedicated thread drains program output to stdout and
+// reads stdin ahead, talking to the interpreter through two single-producer/single-consumer
+// byte rings. The interpreter never blocks on write(2); it only waits when the output ring
+// is full or a read has no buffered line yet.
+#define IO_RING_SIZE (1 << 16)
+#define IO_WAKE_THRESHOLD (IO_RING_SIZE / 4)  // Buffered output that makes the I/O thread write
+
+typedef struct {
+    _Alignas(64) size_t head;  // Advanced by the producer only
+    _Alignas(64) size_t tail;  // Advanced by the consumer only
+    _Alignas(64) char data[IO_RING_SIZE];
+} ByteRing;
+
+typedef struct {
+    ByteRing output;  // Interpreter -> I/O thread
+    ByteRing input;   // I/O thread -> interpreter
+    int wakeFds[2];   // Pipe the I/O thread polls besides stdin
+    int ioSleeping;
+    int interpreterWaiting;
+    int inputEof;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;
+    pthread_t thread;
+} AsyncIO;
+
+AsyncIO* asyncIO = NULL;
+
+size_t ring_used(ByteRing* ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+}
+
+// Copies up to length bytes in, returns how many fit
+size_t ring_push(ByteRing* ring, const char* data, size_t length) {
+    size_t head = ring->head;
+    size_t space = IO_RING_SIZE - (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+    if (length > space) length = space;
+    size_t offset = head % IO_RING_SIZE;
+    size_t first = length < IO_RING_SIZE - offset ? length : IO_RING_SIZE - offset;
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, data + first, length - first);
+    __atomic_store_n(&ring->head, head + length, __ATOMIC_SEQ_CST);
+    return length;
+}
+
+// Returns the readable bytes that are contiguous in memory starting at the tail
+size_t ring_peek(ByteRing* ring, const char** data) {
+    size_t tail = ring->tail;
+    size_t used = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+    size_t offset = tail % IO_RING_SIZE;
+    *data = ring->data + offset;
+    return used < IO_RING_SIZE - offset ? used : IO_RING_SIZE - offset;
+}
+
+void ring_consume(ByteRing* ring, size_t length) {
+    __atomic_store_n(&ring->tail, ring->tail + length, __ATOMIC_SEQ_CST);
+}
+
+// Called by the interpreter; only costs a syscall when the I/O thread is asleep in poll
+void async_io_wake(void) {
+    if (__atomic_load_n(&asyncIO->ioSleeping, __ATOMIC_SEQ_CST)) {
+        char byte = 0;
+        ssize_t ignored = write(asyncIO->wakeFds[1], &byte, 1);
+        (void)ignored;
+    }
+}
+
+// Called by the I/O thread after it freed output space or added input
+void async_io_notify(void) {
+    if (__atomic_load_n(&asyncIO->interpreterWaiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&asyncIO->lock);
+        pthread_cond_signal(&asyncIO->progress);
+        pthread_mutex_unlock(&asyncIO->lock);
+    }
+}
+
+// Blocks the interpreter until ready() holds; the I/O thread signals after every step
+void async_io_wait(int (*ready)(void)) {
+    async_io_wake();
+    pthread_mutex_lock(&asyncIO->lock);
+    __atomic_store_n(&asyncIO->interpreterWaiting, 1, __ATOMIC_SEQ_CST);
+    while (!ready()) {
+        pthread_cond_wait(&asyncIO->progress, &asyncIO->lock);
+    }
+    __atomic_store_n(&asyncIO->interpreterWaiting, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&asyncIO->lock);
+}
+
+int async_output_has_space(void) {
+    return ring_used(&asyncIO->output) < IO_RING_SIZE;
+}
+
+int async_input_available(void) {
+    return ring_used(&asyncIO->input) > 0 || __atomic_load_n(&asyncIO->inputEof, __ATOMIC_SEQ_CST);
+}
+
+int async_output_drained(void) {
+    return ring_used(&asyncIO->output) == 0;
+}
+
+void* async_io_thread(void* arg) {
+    (void)arg;
+    stats_attach_thread();
+
+    for (;;) {
+        const char* data;
+        size_t length = ring_peek(&asyncIO->output, &data);
+        if (length > 0) {
+            ssize_t written = write(STDOUT_FILENO, data, length);
+            if (written < 0 && errno != EINTR) {
+                written = length;  // stdout is gone, drop the output instead of spinning
+            }
+            if (written > 0) {
+                ring_consume(&asyncIO->output, written);
+                async_io_notify();
+            }
+            continue;  // Output always goes before input, so prompts show before we read
+        }
+        if (__atomic_load_n(&asyncIO->stopping, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+
+        struct pollfd fds[2] = {{asyncIO->wakeFds[0], POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+        int watchInput = !__atomic_load_n(&asyncIO->inputEof, __ATOMIC_SEQ_CST) &&
+                         ring_used(&asyncIO->input) < IO_RING_SIZE;
+
+        __atomic_store_n(&asyncIO->ioSleeping, 1, __ATOMIC_SEQ_CST);
+        if (ring_used(&asyncIO->output) == 0 && !__atomic_load_n(&asyncIO->stopping, __ATOMIC_SEQ_CST)) {
+            poll(fds, watchInput ? 2 : 1, -1);
+        }
+        __atomic_store_n(&asyncIO->ioSleeping, 0, __ATOMIC_SEQ_CST);
+
+        if (fds[0].revents & POLLIN) {
+            char drain[64];
+            ssize_t ignored = read(asyncIO->wakeFds[0], drain, sizeof(drain));
+            (void)ignored;
+        }
+        if (watchInput && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+            ByteRing* ring = &asyncIO->input;
+            size_t head = ring->head;
+            size_t offset = head % IO_RING_SIZE;
+            size_t space = IO_RING_SIZE - ring_used(ring);
+            if (space > IO_RING_SIZE - offset) space = IO_RING_SIZE - offset;
+            ssize_t got = read(STDIN_FILENO, ring->data + offset, space);
+            if (got > 0) {
+                __atomic_store_n(&ring->head, head + got, __ATOMIC_SEQ_CST);
+            } else if (got == 0 || errno != EINTR) {
+                __atomic_store_n(&asyncIO->inputEof, 1, __ATOMIC_SEQ_CST);
+            }
+            async_io_notify();
+        }
+    }
+    return NULL;
+}
+
+// Registered with atexit: everything the script wrote reaches stdout even when it stops on an error
+void async_io_shutdown(void) {
+    __atomic_store_n(&asyncIO->stopping, 1, __ATOMIC_SEQ_CST);
+    char byte = 0;
+    ssize_t ignored = write(asyncIO->wakeFds[1], &byte, 1);
+    (void)ignored;
+    pthread_join(asyncIO->thread, NULL);
+}
+
+void async_io_start(void) {
+    asyncIO = calloc(1, sizeof(AsyncIO));
+    if (asyncIO == NULL || pipe(asyncIO->wakeFds) != 0) {
+        fprintf(stderr, "Error: Could not set up asynchronous I/O\n");
+        exit(1);
+    }
+    fcntl(asyncIO->wakeFds[0], F_SETFL, O_NONBLOCK);
+    fcntl(asyncIO->wakeFds[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&asyncIO->lock, NULL);
+    pthread_cond_init(&asyncIO->progress, NULL);
+    fflush(stdout);
+    if (pthread_create(&asyncIO->thread, NULL, async_io_thread, NULL) != 0) {
+        fprintf(stderr, "Error: Could not start the I/O thread\n");
+        exit(1);
+    }
+    atexit(async_io_shutdown);
+}
+#endif
+
+// Output of a parallel loop worker, written out in iteration order by the calling thread
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} OutputBuffer;
+
+_Thread_local OutputBuffer* outputCapture;  // Set on loop workers and server threads
+const char* batchInput;  // Rest of the record a scalar --batch run reads its input from
+int batch_read_line(char* buffer, int size);
+
+#ifdef __linux__
+typedef struct Session Session;
+_Thread_local Session* currentSession;  // Set while a server thread runs a session
+int session_read_line(char* buffer, int size);
+#endif
+
+void emit_output(const char* data, size_t length);
+
+// Input tapes (--record FILE, --replay FILE). --record writes every line a read consumes to
+// a tape, with how long the read waited for it, and ends the tape with the size and checksum
+// of the output. --replay feeds the lines back from memory, writes no prompts and checks the
+// output against the tape, so a recorded interactive session reruns as a deterministic
+// benchmark. Prompts are left out of the checksum in both modes. Numbers are LEB128 varints:
+//   "STARTAPE", then the token hash of the script as 8 little-endian bytes
+//   'R' wait length bytes      a line a read consumed, without its newline
+//   'E' wait                   a read found the end of the input
+//   'X' reads bytes checksum   the end of the run; checksum is 8 little-endian bytes
+// A wait is in microseconds.
+#define TAPE_MAGIC "STARTAPE"
+
+typedef struct {
+    const char* path;
+    int replaying;
+    int active;
+    int finished;
+    FILE* file;           // Recording
+    unsigned char* data;  // Replaying: the whole tape
+    size_t length;
+    size_t position;
+    int skipOutput;       // Set while a prompt is written
+    long long reads;
+    unsigned long long outputBytes;
+    unsigned long long checksum;  // FNV-1a of the output
+    double waitSeconds;   // Time the reads of the recorded session waited for input
+    double startTime;
+} Tape;
+
+Tape tape;
+
+double tape_clock(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void tape_hash_output(const char* data, size_t length) {
+    if (tape.skipOutput) {
+        return;
+    }
+    unsigned long long hash = tape.checksum;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    tape.checksum = hash;
+    tape.outputBytes += length;
+}
+
+void tape_write_number(unsigned long long value) {
+    while (value >= 0x80) {
+        fputc((int)(value & 0x7F) | 0x80, tape.file);
+        value >>= 7;
+    }
+    fputc((int)value, tape.file);
+}
+
+void tape_write_word(unsigned long long value) {
+    for (int i = 0; i < 8; i++) {
+        fputc((int)(value >> (8 * i)) & 0xFF, tape.file);
+    }
+}
+
+// Returns 0 when the tape ends inside the number
+int tape_read_number(unsigned long long* value) {
+    *value = 0;
+    for (int shift = 0; tape.position < tape.length && shift < 64; shift += 7) {
+        unsigned char byte = tape.data[tape.position++];
+        *value |= (unsigned long long)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int tape_read_word(unsigned long long* value) {
+    if (tape.length - tape.position < 8) {
+        return 0;
+    }
+    *value = 0;
+    for (int i = 0; i < 8; i++) {
+        *value |= (unsigned long long)tape.data[tape.position++] << (8 * i);
+    }
+    return 1;
+}
+
+void tape_exit(void);
+
+// Creates the tape of tape.path, or loads it for replay; scriptHash is hash_tokens of the script
+void tape_open(unsigned long long scriptHash) {
+    tape.checksum = 14695981039346656037ULL;
+    if (!tape.replaying) {
+        tape.file = fopen(tape.path, "wb");
+        if (tape.file == NULL) {
+            fprintf(stderr, "Error: Could not create tape '%s'\n", tape.path);
+            exit(1);
+        }
+        fwrite(TAPE_MAGIC, 1, 8, tape.file);
+        tape_write_word(scriptHash);
+    } else {
+        FILE* file = fopen(tape.path, "rb");
+        if (file == NULL) {
+            fprintf(stderr, "Error: Could not open tape '%s'\n", tape.path);
+            exit(1);
+        }
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        tape.data = allocate(size > 0 ? size : 1);
+        tape.length = size > 0 ? fread(tape.data, 1, size, file) : 0;
+        fclose(file);
+        unsigned long long recordedHash = 0;
+        if (tape.length < 8 || memcmp(tape.data, TAPE_MAGIC, 8) != 0) {
+            fprintf(stderr, "Error: '%s' is not a tape\n", tape.path);
+            exit(1);
+        }
+        tape.position = 8;
+        if (!tape_read_word(&recordedHash) || recordedHash != scriptHash) {
+            fprintf(stderr, "Error: Tape '%s' was recorded from a different script\n", tape.path);
+            exit(1);
+        }
+    }
+    tape.active = 1;
+    tape.startTime = tape_clock();
+    atexit(tape_exit);  // A runtime error ends the run with exit()
+}
+
+void tape_record(const char* line, int found, double waitSeconds) {
+    unsigned long long wait = (unsigned long long)(waitSeconds * 1e6);
+    fputc(found ? 'R' : 'E', tape.file);
+    tape_write_number(wait);
+    if (found) {
+        size_t length = strlen(line);
+        tape_write_number(length);
+        fwrite(line, 1, length, tape.file);
+    }
+    tape.reads++;
+    tape.waitSeconds += wait / 1e6;  // As a replay adds it up
+}
+
+// The next recorded line, like read_input_line; -1 when the tape has no more reads
+int tape_replay(char* buffer, int size) {
+    unsigned long long wait, length;
+    if (tape.position >= tape.length || (tape.data[tape.position] != 'R' && tape.data[tape.position] != 'E')) {
+        return -1;
+    }
+    int found = tape.data[tape.position++] == 'R';
+    if (!tape_read_number(&wait) || (found && (!tape_read_number(&length) || length >= (unsigned long long)size ||
+                                               length > tape.length - tape.position))) {
+        tape.position = tape.length;  // A damaged tape, end it here
+        return -1;
+    }
+    buffer[0] = '\0';
+    if (found) {
+        memcpy(buffer, tape.data + tape.position, length);
+        buffer[length] = '\0';
+        tape.position += length;
+    }
+    tape.reads++;
+    tape.waitSeconds += wait / 1e6;
+    return found;
+}
+
+// Ends the tape: a recording gets its end record, a replay is checked against it.
+// Returns 0 when the replay does not match the recording.
+int tape_finish(void) {
+    if (!tape.active || tape.finished) {
+        return 1;
+    }
+    tape.finished = 1;
+    double runSeconds = tape_clock() - tape.startTime;
+    if (!tape.replaying) {
+        fputc('X', tape.file);
+        tape_write_number(tape.reads);
+        tape_write_number(tape.outputBytes);
+        tape_write_word(tape.checksum);
+        fclose(tape.file);
+        fprintf(stderr, "[record] %s: %lld reads, %llu output bytes, run %.6fs of which %.6fs waiting for input\n",
+                tape.path, tape.reads, tape.outputBytes, runSeconds, tape.waitSeconds);
+        return 1;
+    }
+
+    unsigned long long reads, bytes, checksum;
+    int matches = 0;
+    if (tape.position < tape.length && tape.data[tape.position] != 'X') {
+        fprintf(stderr, "Error: The script read only %lld of the lines on tape '%s'\n", tape.reads, tape.path);
+    } else if (tape.position >= tape.length || (tape.position++, !tape_read_number(&reads)) ||
+               !tape_read_number(&bytes) || !tape_read_word(&checksum)) {
+        fprintf(stderr, "Error: Tape '%s' has no end record\n", tape.path);
+    } else if (bytes != tape.outputBytes || checksum != tape.checksum) {
+        fprintf(stderr, "Error: Output differs from tape '%s': %llu bytes with checksum %016llx, recorded %llu bytes with checksum %016llx\n",
+                tape.path, tape.outputBytes, tape.checksum, bytes, checksum);
+    } else {
+        matches = 1;
+        fprintf(stderr, "[replay] %s: %lld reads, %llu output bytes match the recording, run %.6fs (recorded %.6fs waiting for input)\n",
+                tape.path, tape.reads, tape.outputBytes, runSeconds, tape.waitSeconds);
+    }
+    free(tape.data);
+    return matches;
+}
+
+void tape_exit(void) {
+    tape_finish();
+}
+
+// Makes room for length more bytes
+void reserve_output(OutputBuffer* buffer, size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        while (buffer->length + length > buffer->capacity) {
+            buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+        }
+        buffer->data = realloc(buffer->data, buffer->capacity);
+        if (buffer->data == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            exit(1);
+        }
+        STAT_ADD(mallocCalls, 1);
+        STAT_ADD(mallocBytes, buffer->capacity);
+    }
+}
+
+void append_output(OutputBuffer* buffer, const char* data, size_t length) {
+    reserve_output(buffer, length);
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+// Appends times more copies of the bytes from start on, each round copying everything so far
+void repeat_output(OutputBuffer* buffer, size_t start, long long times) {
+    size_t length = buffer->length - start;
+    size_t total = length * (times + 1);
+    reserve_output(buffer, total - length);
+    for (size_t done = length; done < total;) {
+        size_t copy = done < total - done ? done : total - done;
+        memcpy(buffer->data + start + done, buffer->data + start, copy);
+        done += copy;
+    }
+    buffer->length = start + total;
+}
+
+// All program output goes through write_output and flush_output so it can be counted
+void write_output(const char* data, size_t length) {
+    STAT_ADD(bytesWritten, length);
+    if (outputCapture) {
+        append_output(outputCapture, data, length);
+        return;
+    }
+    emit_output(data, length);
+}
+
+// Writes to stdout or the output ring without counting the bytes again
+void emit_output(const char* data, size_t length) {
+    if (tape.active) {
+        tape_hash_output(data, length);
+    }
+#ifndef _WIN32
+    if (asyncIO) {
+        while (length > 0) {
+            size_t pushed = ring_push(&asyncIO->output, data, length);
+            data += pushed;
+            length -= pushed;
+            if (length > 0) {
+                async_io_wait(async_output_has_space);
+            }
+        }
+        if (ring_used(&asyncIO->output) >= IO_WAKE_THRESHOLD) {
+            async_io_wake();
+        }
+        return;
+    }
+#endif
+    fwrite(data, 1, length, stdout);
+}
+
+void flush_output(void) {
+    STAT_ADD(flushes, 1);
+#ifndef _WIN32
+    if (asyncIO) {
+        async_io_wake();  // The I/O thread writes everything buffered before it looks at input
+        return;
+    }
+#endif
+    fflush(stdout);
+}
+
+#define REPEAT_CHUNK_BYTES 65536
+#define REPEAT_VECTORS 64  // Chunks per writev
+
+// emit_output of times copies of a block. The copies are laid out once in a chunk of about
+// REPEAT_CHUNK_BYTES; on stdout every writev then hands the kernel the same chunk several times.
+void emit_repeated(const char* block, size_t length, long long times) {
+    if (length == 0 || times <= 0) {
+        return;
+    }
+    long long copies = length < REPEAT_CHUNK_BYTES ? REPEAT_CHUNK_BYTES / length : 1;
+    if (copies > times) {
+        copies = times;
+    }
+    OutputBuffer chunk = {0};
+    append_output(&chunk, block, length);
+    repeat_output(&chunk, 0, copies - 1);
+    long long chunks = times / copies;
+
+#ifndef _WIN32
+    if (!asyncIO) {
+        struct iovec vectors[REPEAT_VECTORS];
+        for (int i = 0; i < REPEAT_VECTORS; i++) {
+            vectors[i].iov_base = chunk.data;
+            vectors[i].iov_len = chunk.length;
+        }
+        for (long long c = 0; tape.active && c < chunks; c++) {
+            tape_hash_output(chunk.data, chunk.length);
+        }
+        fflush(stdout);
+        while (chunks > 0) {
+            ssize_t written = writev(STDOUT_FILENO, vectors, chunks < REPEAT_VECTORS ? (int)chunks : REPEAT_VECTORS);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                // Like fwrite, a failing stdout loses the output. The chunks are hashed already,
+                // so none is left for emit_output below.
+                chunks = 0;
+                break;
+            }
+            chunks -= written / chunk.length;
+            size_t partial = written % chunk.length;
+            if (partial > 0) {
+                fwrite(chunk.data + partial, 1, chunk.length - partial, stdout);
+                fflush(stdout);
+                chunks--;
+            }
+        }
+    }
+#endif
+    for (; chunks > 0; chunks--) {
+        emit_output(chunk.data, chunk.length);
+    }
+    emit_output(chunk.data, (size_t)(times % copies) * length);
+    free(chunk.data);
+}
+
+// Reads one input line like fgets, returns 0 at end of input
+int read_input_line(char* buffer, int size) {
+    STAT_ADD(readCalls, 1);
+    if (batchInput) {
+        return batch_read_line(buffer, size);
+    }
+#ifdef __linux__
+    if (currentSession) {
+        return session_read_line(buffer, size);
+    }
+#endif
+#ifndef _WIN32
+    if (asyncIO) {
+        int length = 0;
+        while (length < size - 1) {
+            const char* data;
+            size_t available = ring_peek(&asyncIO->input, &data);
+            if (available == 0) {
+                if (__atomic_load_n(&asyncIO->inputEof, __ATOMIC_SEQ_CST)) break;
+                async_io_wait(async_input_available);
+                continue;
+            }
+            size_t take = 0;
+            while (take < available && length < size - 1) {
+                buffer[length++] = data[take++];
+                if (buffer[length - 1] == '\n') break;
+            }
+            ring_consume(&asyncIO->input, take);
+            async_io_wake();  // The ring may have been full, so stdin was not being watched
+            if (buffer[length - 1] == '\n') break;
+        }
+        buffer[length] = '\0';
+        return length > 0;
+    }
+#endif
+    return fgets(buffer, size, stdin) != NULL;
+}
+
 typedef enum {
     TOKEN_IDENTIFIER,
     TOKEN_KEYWORD,
@@ -56,15 +801,38 @@ typedef enum {
     TOKEN_RIGHT_CURLY_BRACKET,
     TOKEN_LEFT_PAREN,
     TOKEN_RIGHT_PAREN,
+    TOKEN_END_OF_FILE,
     TOKEN_ERROR
 } TokenType;
 
-// Represents a token in the code, with type and value
+// Represents a token in the code, with type and value. The value is NUL-terminated text in
+// the lexeme pool of its TokenStream; a string token holds its contents without the quotes.
 typedef struct {
     TokenType type;
-    char value[MAX_STRING_LENGTH + 1];
+    int line;
+    int offset;  // Position in the source
+    int number;  // Value of an integer token
+    const char* value;
 } Token;
 
+// A lexical error, found while scanning
+typedef struct {
+    int line;
+    int column;
+    const char* message;
+} Diagnostic;
+
+// The scanned program: its tokens, ending with TOKEN_END_OF_FILE, and all lexical errors
+typedef struct {
+    Token* tokens;
+    int tokenCount;
+    int tokenCapacity;
+    char* lexemes;
+    Diagnostic* diagnostics;
+    int diagnosticCount;
+    int diagnosticCapacity;
+} TokenStream;
+
 typedef enum {
     NODE_INT,
     NODE_STRING,
@@ -99,11 +867,7 @@ typedef struct ASTNode {
 } ASTNode;
 
 ASTNode* create_loop_node(ASTNode* condition, ASTNode* body) {
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (node == NULL) {
-        fprintf(stderr, "Memory allocation error\n");
-        exit(1);
-    }
+    ASTNode* node = (ASTNode*)allocate(sizeof(ASTNode));
     node->type = NODE_LOOP;
     node->data.loop.condition = condition;
     node->data.loop.body = body;
@@ -112,11 +876,7 @@ ASTNode* create_loop_node(ASTNode* condition, ASTNode* body) {
 }
 
 ASTNode* create_int_node(int value) {
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (node == NULL) {
-        fprintf(stderr, "Memory allocation error\n");
-        exit(1);
-    }
+    ASTNode* node = (ASTNode*)allocate(sizeof(ASTNode));
     node->type = NODE_INT;
     node->data.intValue = value;
     node->next = NULL;
@@ -124,11 +884,7 @@ ASTNode* create_int_node(int value) {
 }
 
 ASTNode* create_string_node(const char* value) {
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (node == NULL) {
-        fprintf(stderr, "Memory allocation error\n");
-        exit(1);
-    }
+    ASTNode* node = (ASTNode*)allocate(sizeof(ASTNode));
     node->type = NODE_STRING;
     strcpy(node->data.stringValue, value);
     node->next = NULL;
@@ -136,11 +892,7 @@ ASTNode* create_string_node(const char* value) {
 }
 
 ASTNode* create_var_node(const char* name) {
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (node == NULL) {
-        fprintf(stderr, "Memory allocation error\n");
-        exit(1);
-    }
+    ASTNode* node = (ASTNode*)allocate(sizeof(ASTNode));
     node->type = NODE_VAR;
     strcpy(node->data.varName, name);
     node->next = NULL;
@@ -148,11 +900,7 @@ ASTNode* create_var_node(const char* name) {
 }
 
 ASTNode* create_assign_node(ASTNode* left, ASTNode* right, char op) {
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (node == NULL) {
-        fprintf(stderr, "Memory allocation error\n");
-        exit(1);
-    }
+    ASTNode* node = (ASTNode*)allocate(sizeof(ASTNode));
     node->type = NODE_ASSIGN;
     node->data.assign.left = left;
     node->data.assign.right = right;
@@ -162,11 +910,7 @@ ASTNode* create_assign_node(ASTNode* left, ASTNode* right, char op) {
 }
 
 ASTNode* create_block_node(ASTNode* statements) {
-    ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
-    if (node == NULL) {
-        fprintf(stderr, "Memory allocation error\n");
-        exit(1);
-    }
+    ASTNode* node = (ASTNode*)allocate(sizeof(ASTNode));
     node->type = NODE_BLOCK;
     node->data.block = statements;
     node->next = NULL;
@@ -175,20 +919,33 @@ ASTNode* create_block_node(ASTNode* statements) {
 
 typedef struct {
     int intValue;
-    char stringValue[MAX_STRING_LENGTH + 1];
+    char stringValue[MAX_TEXT_LENGTH + 1];
     int isInteger;
 } Result;
 
+// The variables of a context, stored by field. Int values, which most statements touch,
+// are a dense array; text values live in a pool reached through a per-variable handle;
+// names are only read to confirm a hash match when a name is resolved to a slot. Only the
+// first count (and textCount) entries are in use, and only those are copied.
 typedef struct {
-    char name[MAX_IDENTIFIER_LENGTH + 1];
-    char value[MAX_STRING_LENGTH + 1];
-    int isInteger;
-} Variable;
+    int count;
+    int textCount;
+    int ints[MAX_VARIABLES];
+    unsigned char isInteger[MAX_VARIABLES];
+    short textHandles[MAX_VARIABLES];  // Entry in texts, -1 until the variable first holds text
+    unsigned nameHashes[MAX_VARIABLES];
+    char names[MAX_VARIABLES][MAX_IDENTIFIER_LENGTH + 1];
+    char texts[MAX_VARIABLES][MAX_TEXT_LENGTH + 1];
+} VariableStore;
+
+// An active loop of the compiled program
+typedef struct {
+    int loop;       // Instruction index of the LOOP instruction
+    int remaining;  // Iterations left, the current one included
+} LoopFrame;
 
 typedef struct {
     Result result;
-    Variable variables[MAX_VARIABLES];
-    int variableCount;
     int loopDepth;
     int currentLine;
     const char* fileName;
@@ -196,7 +953,14 @@ typedef struct {
     int errorCount;    // Toplam hata sayısı
     char lastErrorMessage[256];  // Son hata mesajı
     int loopCount;  // Loop sayısını takip etmek için ekledik
+    long long statementCount;  // Executed statements, loop statements included
+    long long backEdges;  // END_LOOP jumps back into the body, see context_fuel
+    int pc;  // Next instruction of the compiled program
+    LoopFrame* loopStack;  // loopDepth entries are in use, owned by this context
+    int loopCapacity;
+    unsigned long long dirtyVariables[VARIABLE_MASK_WORDS];  // Changed since the last checkpoint
     // Diğer context bilgileri burada olabilir
+    VariableStore variables;  // Last, so a copy can stop after the entries in use
 } Context;
 
 typedef struct {
@@ -206,21 +970,26 @@ typedef struct {
     ASTNode* increment;
 } ForLoopNode;
 
-Variable variables[MAX_VARIABLES];
-int variableCount = 0;
-
 // Function prototypes
-Token getNextToken(const char* line, int* index);
-void set_variable(Context* context, const char* name, const char* value, int isInteger);
-Variable* get_variable(Context* context, const char* name);
-void execute_line(const char* line, Context* context);
-int evaluate_expression(const char* expression, Context* context);
-void handle_write(const char* line, int* index, Context* context);
-void handle_loop(const char* line, int* index, Context* context);
+void scan_source(const char* source, TokenStream* stream);
+Token next_token(const Token* tokens, int* index);
+int find_variable(Context* context, const char* name);
+void set_int_variable(Context* context, const char* name, int value);
+void set_text_variable(Context* context, const char* name, const char* text);
+int execute_statement(const Token* tokens, int* index, Context* context);
+int check_integer(int value, Context* context);
+int divide(int dividend, int divisor, Context* context);
+int format_integer(char* buffer, int value);
+int parse_integer(const char* text);
+void handle_assignment(const char* varName, const Token* tokens, int* index, Context* context);
+void evaluate_text_expression(const Token* tokens, int* index, Context* context, char* out);
+void handle_read(const Token* tokens, int* index, Context* context);
+void handle_write(const Token* tokens, int* index, Context* context);
+int loop_count(const Token* tokens, int* index, Context* context);
 int eval_condition(ASTNode* node, Context* context);
 int eval_expression(ASTNode* node, Context* context);
 void eval(ASTNode* node, Context* context);
-int eval_expression_helper(const char** expr, Context* context);
+int eval_expression_helper(const Token* tokens, int* index, Context* context);
 
 const char operators[] = {'+', '-', '*', '/'};
 
@@ -244,931 +1013,5806 @@ int is_keyword(const char* identifier) {
     return 0;
 }
 
-// Function to remove comments and update is_comment_open flag
-int strip_comments(char* line, int* is_comment_open) {
-    char* comment_start = strstr(line, "/*");
-    char* comment_end = strstr(line, "*/");
+// Number conversion. Integers are at most 8 digits, so formatting works on digit pairs
+// from a lookup table and parsing handles the common case with one 8-byte word.
+static const char digitPairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
 
-    // If a comment is already open and there is no closing, clear the line
-    if (*is_comment_open) {
-        if (comment_end) {
-            memmove(line, comment_end + 2, strlen(comment_end + 2) + 1);
-            *is_comment_open = 0;
-        } else {
-            line[0] = '\0';
-            return 0;
-        }
-    }
+// Writes value as decimal digits without a terminator, returns the number of characters.
+// Negative values never reach here (check_integer clamps them) but are still handled.
+int format_integer_digits(char* buffer, int value) {
+    char digits[MAX_INTEGER_LENGTH];
+    char* end = digits + sizeof(digits);
+    char* p = end;
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
 
-    // Check new comment start and end in line
-    while (comment_start) {
-        if (comment_end && comment_end > comment_start) {
-            memmove(comment_start, comment_end + 2, strlen(comment_end + 2) + 1);
-            comment_start = strstr(comment_start, "/*");
-        } else {
-            *is_comment_open = 1;
-            line[comment_start - line] = '\0';
-            break;
-        }
+    while (magnitude >= 100) {
+        unsigned int pair = (magnitude % 100) * 2;
+        magnitude /= 100;
+        *--p = digitPairs[pair + 1];
+        *--p = digitPairs[pair];
+    }
+    if (magnitude >= 10) {
+        *--p = digitPairs[magnitude * 2 + 1];
+        *--p = digitPairs[magnitude * 2];
+    } else {
+        *--p = (char)('0' + magnitude);
+    }
+    if (value < 0) {
+        *--p = '-';
     }
 
-    return 1;  // Comments are disabled or absent
+    int length = (int)(end - p);
+    memcpy(buffer, p, length);
+    return length;
 }
 
-// Handles identifier tokens, checking if they are keywords or regular identifiers
-void handle_identifier(FILE* outputFile, const char* start, int length) {
-    char identifier[MAX_IDENTIFIER_LENGTH + 1];
-    strncpy(identifier, start, length);
-    identifier[length] = '\0';
+// Same as format_integer_digits, with a terminating '\0'
+int format_integer(char* buffer, int value) {
+    int length = format_integer_digits(buffer, value);
+    buffer[length] = '\0';
+    return length;
+}
 
-    if (!isalpha(identifier[0])) {
-        fprintf(outputFile, "Error: Invalid identifier.\n");
-    }
+void write_integer(int value) {
+    char buffer[MAX_INTEGER_LENGTH];
+    write_output(buffer, format_integer_digits(buffer, value));
 }
 
-// Handles integer tokens
-void handle_integer(FILE* outputFile, const char* start, int length) {
-    char integer[MAX_INTEGER_LENGTH + 1];
-    strncpy(integer, start, length);
-    integer[length] = '\0';
+// Converts up to 8 ASCII digits; the word holds them right aligned behind '0' padding
+static int parse_eight_digits(const char* text, int length) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    char padded[8] = {'0', '0', '0', '0', '0', '0', '0', '0'};
+    memcpy(padded + 8 - length, text, length);
+    unsigned long long word;
+    memcpy(&word, padded, 8);
+    word -= 0x3030303030303030ULL;
+    word = (word * 10) + (word >> 8);  // Pairs of digits
+    word = (((word & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+            (((word >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    return (int)word;
+#else
+    int value = 0;
+    for (int i = 0; i < length; i++) {
+        value = value * 10 + (text[i] - '0');
+    }
+    return value;
+#endif
 }
 
-// Handles string tokens, checks for unclosed or invalid strings
-void handle_string(FILE* outputFile, const char* start, int length) {
-    char string[MAX_STRING_LENGTH + 1];
-    strncpy(string, start, length);
-    string[length] = '\0';
+// Parses the leading digits of a stored integer or integer token. Values with more than
+// 9 digits saturate to MAX_INTEGER_VALUE + 1 so check_integer reports them as too large.
+int parse_integer(const char* text) {
+    int length = 0;
+    while (length < 10 && isdigit((unsigned char)text[length])) length++;
+
+    if (length <= 8) {
+        return length ? parse_eight_digits(text, length) : 0;
+    }
+    if (length == 9) {
+        return parse_eight_digits(text, 8) * 10 + (text[8] - '0');
+    }
+    return MAX_INTEGER_VALUE + 1;
 }
 
-// Adds or updates a variable
-void set_variable(Context* context, const char* name, const char* value, int isInteger) {
-    for (int i = 0; i < context->variableCount; i++) {
-        if (strcmp(context->variables[i].name, name) == 0) {
-            strcpy(context->variables[i].value, value);
-            context->variables[i].isInteger = isInteger;
-            return;
-        }
+// Validates user input for an int variable: 1 to 8 digits, surrounding blanks allowed.
+// Returns 0 and stores 0 when the input is not a valid STAR integer.
+int parse_integer_input(const char* text, int* value) {
+    while (isspace((unsigned char)*text)) text++;
+    int length = 0;
+    while (length < 9 && isdigit((unsigned char)text[length])) length++;
+
+    const char* rest = text + length;
+    while (isspace((unsigned char)*rest)) rest++;
+
+    if (length == 0 || length > 8 || *rest != '\0') {
+        *value = 0;
+        return 0;
     }
+    *value = parse_eight_digits(text, length);
+    return 1;
+}
 
-    if (context->variableCount < MAX_VARIABLES) {
-        strcpy(context->variables[context->variableCount].name, name);
-        strcpy(context->variables[context->variableCount].value, value);
-        context->variables[context->variableCount].isInteger = isInteger;
-        context->variableCount++;
-    } else {
-        fprintf(stderr, "Error: Too many variables defined\n");
-        context->errorCount++;
-        strcpy(context->lastErrorMessage, "Too many variables defined");
-        exit(1);
+unsigned name_hash(const char* name) {
+    unsigned hash = 2166136261u;  // FNV-1a
+    for (; *name; name++) {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
     }
+    return hash;
 }
 
-Variable* get_variable(Context* context, const char* name) {
-    for (int i = 0; i < context->variableCount; i++) {
-        if (strcmp(context->variables[i].name, name) == 0) {
-            return &context->variables[i];
+// Returns the slot of a variable, or -1 if it has not been declared
+int find_variable(Context* context, const char* name) {
+    VariableStore* store = &context->variables;
+    unsigned hash = name_hash(name);
+    STAT_ADD(variableLookups, 1);
+    for (int i = 0; i < store->count; i++) {
+        if (store->nameHashes[i] == hash && strcmp(store->names[i], name) == 0) {
+            STAT_ADD(lookupProbes, i + 1);
+            return i;
         }
     }
-    return NULL;
+    STAT_ADD(lookupProbes, store->count);
+    return -1;
 }
 
-// Function prototype for getNextToken
-Token getNextToken(const char* line, int* index);
+// Returns the slot of a variable, adding it if it does not exist, and gives it the type
+int define_variable(Context* context, const char* name, int isInteger) {
+    VariableStore* store = &context->variables;
+    int slot = find_variable(context, name);
+    if (slot < 0) {
+        if (store->count == MAX_VARIABLES) {
+            fprintf(stderr, "Error: Too many variables defined\n");
+            context->errorCount++;
+            strcpy(context->lastErrorMessage, "Too many variables defined");
+            stop_on_error();
+        }
+        slot = store->count++;
+        strcpy(store->names[slot], name);
+        store->nameHashes[slot] = name_hash(name);
+        store->textHandles[slot] = -1;
+    }
+    store->isInteger[slot] = isInteger;
+    context->dirtyVariables[slot / 64] |= 1ULL << (slot % 64);
+    if (!isInteger && store->textHandles[slot] < 0) {
+        store->textHandles[slot] = store->textCount++;
+    }
+    return slot;
+}
 
-// Executes a single line of STAR code
-void execute_line(const char* line, Context* context) {
-    int index = 0;
-    Token token = getNextToken(line, &index);
+void set_int(Context* context, int slot, int value) {
+    context->variables.ints[slot] = value;
+    context->dirtyVariables[slot / 64] |= 1ULL << (slot % 64);
+}
 
-    if (token.type == TOKEN_KEYWORD && strcmp(token.value, "loop") == 0) {
-        handle_loop(line, &index, context);
-    } else if (token.type == TOKEN_KEYWORD && strcmp(token.value, "write") == 0) {
-        handle_write(line, &index, context);
+// The slot has to hold text, see define_variable
+void set_text(Context* context, int slot, const char* text) {
+    STAT_ADD(textCopies, 1);
+    strcpy(context->variables.texts[context->variables.textHandles[slot]], text);
+    context->dirtyVariables[slot / 64] |= 1ULL << (slot % 64);
+}
+
+const char* variable_text(Context* context, int slot) {
+    return context->variables.texts[context->variables.textHandles[slot]];
+}
+
+void set_int_variable(Context* context, const char* name, int value) {
+    set_int(context, define_variable(context, name, 1), value);
+}
+
+void set_text_variable(Context* context, const char* name, const char* text) {
+    set_text(context, define_variable(context, name, 0), text);
+}
+
+// Copies slot of one store into another, text included
+void copy_variable(VariableStore* target, const VariableStore* source, int slot) {
+    target->ints[slot] = source->ints[slot];
+    target->isInteger[slot] = source->isInteger[slot];
+    target->textHandles[slot] = source->textHandles[slot];
+    target->nameHashes[slot] = source->nameHashes[slot];
+    strcpy(target->names[slot], source->names[slot]);
+    if (source->textHandles[slot] >= 0) {
+        strcpy(target->texts[source->textHandles[slot]], source->texts[source->textHandles[slot]]);
     }
+}
 
-    if (token.type == TOKEN_KEYWORD && (strcmp(token.value, "int") == 0 || strcmp(token.value, "text") == 0)) {
-        char varType[6];
-        strcpy(varType, token.value);
+// Copies the entries of a store that are in use
+void copy_variables(VariableStore* target, const VariableStore* source) {
+    target->count = source->count;
+    target->textCount = source->textCount;
+    memcpy(target->ints, source->ints, sizeof(int) * source->count);
+    memcpy(target->isInteger, source->isInteger, source->count);
+    memcpy(target->textHandles, source->textHandles, sizeof(short) * source->count);
+    memcpy(target->nameHashes, source->nameHashes, sizeof(unsigned) * source->count);
+    memcpy(target->names, source->names, sizeof(target->names[0]) * source->count);
+    memcpy(target->texts, source->texts, sizeof(target->texts[0]) * source->textCount);
+}
+
+// Makes room for count loop frames
+void reserve_loop_frames(Context* context, int count) {
+    while (context->loopCapacity < count) {
+        context->loopStack = grow_table(context->loopStack, &context->loopCapacity, sizeof(LoopFrame));
+    }
+}
+
+// Context assignment without the unused part of the variable store. The target keeps its own
+// loop stack, which receives a copy of the active frames.
+void copy_context(Context* target, const Context* source) {
+    LoopFrame* loopStack = target->loopStack;
+    int loopCapacity = target->loopCapacity;
+    memcpy(target, source, offsetof(Context, variables));
+    target->loopStack = loopStack;
+    target->loopCapacity = loopCapacity;
+    reserve_loop_frames(target, source->loopDepth);
+    memcpy(target->loopStack, source->loopStack, sizeof(LoopFrame) * source->loopDepth);
+    copy_variables(&target->variables, &source->variables);
+}
+
+// Returns the token at index and moves past it; the end of the program is never passed
+Token next_token(const Token* tokens, int* index) {
+    Token token = tokens[*index];
+    if (token.type != TOKEN_END_OF_FILE) (*index)++;
+    return token;
+}
+
+// Executes the statement starting at token index, returns 0 once the code is exhausted
+int execute_statement(const Token* tokens, int* index, Context* context) {
+    Token token = next_token(tokens, index);
+
+    if (token.type == TOKEN_END_OF_FILE) {
+        return 0;
+    }
+    if (token.type == TOKEN_END_OF_LINE) {
+        return 1;  // A lone '.' is an empty statement
+    }
 
-        while ((token = getNextToken(line, &index)).type != TOKEN_END_OF_LINE) {
+    context->statementCount++;
+
+    if (token.type == TOKEN_KEYWORD && strcmp(token.value, "loop") == 0) {
+        // Well-formed loops are compiled into LOOP instructions, this one reports its error
+        STAT_ADD(statements[STATEMENT_LOOP], 1);
+        loop_count(tokens, index, context);
+        fprintf(stderr, "Error: Malformed loop statement\n");
+        context->errorCount++;
+        strcpy(context->lastErrorMessage, "Malformed loop statement");
+        stop_on_error();
+    } else if (token.type == TOKEN_KEYWORD && (strcmp(token.value, "int") == 0 || strcmp(token.value, "text") == 0)) {
+        STAT_ADD(statements[STATEMENT_DECLARATION], 1);
+        int isInteger = token.value[0] == 'i';
+        int slot = -1;
+
+        while ((token = next_token(tokens, index)).type != TOKEN_END_OF_LINE && token.type != TOKEN_END_OF_FILE) {
             if (token.type == TOKEN_IDENTIFIER) {
-                set_variable(context, token.value, varType[0] == 'i' ? "0" : "", varType[0] == 'i');
+                slot = define_variable(context, token.value, isInteger);
+                if (isInteger) {
+                    set_int(context, slot, 0);
+                } else {
+                    set_text(context, slot, "");
+                }
             } else if (token.type == TOKEN_COMMA) {
                 continue;
-            } else if (token.type == TOKEN_KEYWORD && strcmp(token.value, "is") == 0) {
-                token = getNextToken(line, &index);
-                if (token.type == TOKEN_INTEGER || token.type == TOKEN_STRING) {
-                    set_variable(context, token.value, token.value, token.type == TOKEN_INTEGER);
+            } else if (token.type == TOKEN_KEYWORD && strcmp(token.value, "is") == 0 && slot >= 0) {
+                token = next_token(tokens, index);
+                if (isInteger && token.type == TOKEN_INTEGER) {
+                    set_int(context, slot, check_integer(token.number, context));
+                } else if (!isInteger && token.type == TOKEN_STRING) {
+                    set_text(context, slot, token.value);
                 } else {
                     fprintf(stderr, "Error: Expected integer or string value after 'is', found '%s'\n", token.value);
                     context->errorCount++;
                     strcpy(context->lastErrorMessage, "Expected integer or string value after 'is'");
-                    exit(1);
+                    stop_on_error();
                 }
             } else {
                 fprintf(stderr, "Error: Expected identifier after 'int' or 'text'\n");
                 context->errorCount++;
                 strcpy(context->lastErrorMessage, "Expected identifier after 'int' or 'text'");
-                exit(1);
+                stop_on_error();
             }
         }
-        return;
     } else if (token.type == TOKEN_IDENTIFIER) {
-        char varName[MAX_IDENTIFIER_LENGTH + 1] = {0};
-        strcpy(varName, token.value);
-        token = getNextToken(line, &index);
+        const char* varName = token.value;
+        token = next_token(tokens, index);
         if (token.type == TOKEN_KEYWORD && strcmp(token.value, "is") == 0) {
-            char expr[MAX_STRING_LENGTH + 1] = {0};
-            strncpy(expr, line + index, strlen(line) - index);
-            int result = evaluate_expression(expr, context);
-            char resultStr[MAX_INTEGER_LENGTH + 1];
-            sprintf(resultStr, "%d", result);
-            set_variable(context, varName, resultStr, 1);
+            STAT_ADD(statements[STATEMENT_ASSIGNMENT], 1);
+            handle_assignment(varName, tokens, index, context);
         } else if (token.type == TOKEN_STRING) {
-            set_variable(context, varName, token.value, 0);
+            set_text_variable(context, varName, token.value);
         } else {
             fprintf(stderr, "Error: Expected 'is' or string after identifier\n");
             context->errorCount++;
             strcpy(context->lastErrorMessage, "Expected 'is' or string after identifier");
-            exit(1);
+            stop_on_error();
         }
     } else if (token.type == TOKEN_KEYWORD && strcmp(token.value, "write") == 0) {
-        handle_write(line, &index, context);
+        STAT_ADD(statements[STATEMENT_WRITE], 1);
+        handle_write(tokens, index, context);
     } else if (token.type == TOKEN_KEYWORD && strcmp(token.value, "read") == 0) {
-        token = getNextToken(line, &index);
-        if (token.type == TOKEN_STRING) {
-            printf("%s", token.value);
-        }
-        token = getNextToken(line, &index);
-        if (token.type == TOKEN_IDENTIFIER) {
-            char input[MAX_STRING_LENGTH + 1];
-            fgets(input, sizeof(input), stdin);
-            input[strcspn(input, "\n")] = '\0';
-            set_variable(context, token.value, input, 0);
-        } else {
-            fprintf(stderr, "Error: Expected identifier after 'read'\n");
+        STAT_ADD(statements[STATEMENT_READ], 1);
+        handle_read(tokens, index, context);
+    } else if (token.type == TOKEN_KEYWORD && strcmp(token.value, "newLine") == 0) {
+        STAT_ADD(statements[STATEMENT_NEWLINE], 1);
+        write_output("\n", 1);
+        token = next_token(tokens, index);
+        if (token.type != TOKEN_END_OF_LINE) {
+            fprintf(stderr, "Error: Expected '.' after 'newLine'\n");
             context->errorCount++;
-            strcpy(context->lastErrorMessage, "Expected identifier after 'read'");
-            exit(1);
+            strcpy(context->lastErrorMessage, "Expected '.' after 'newLine'");
+            stop_on_error();
         }
-    } else if (token.type == TOKEN_KEYWORD && strcmp(token.value, "newLine") == 0) {
-        printf("\n");
     } else {
-        if (strlen(line) == 0 || strcmp(line, "\n") == 0) {
-            return;
-        }
         fprintf(stderr, "Error: Unrecognized statement '%s'\n", token.value);
         context->errorCount++;
         strcpy(context->lastErrorMessage, "Unrecognized statement");
-        exit(1);
+        stop_on_error();
     }
+    return 1;
 }
 
-int evaluate_expression(const char* expression, Context* context) {
-    const char* expr = expression;
-    return eval_expression_helper(&expr, context);
-}
+// Set on threads that run statements ahead of time (see run_segment). Overflow and division
+// by zero there only set speculationFailed, the statements are run again serially.
+_Thread_local int speculative;
+_Thread_local int speculationFailed;
 
-// Retrieves the next token from the line of code
-Token getNextToken(const char* line, int* index) {
-    Token token;
-    token.type = TOKEN_ERROR;
-    token.value[0] = '\0';
-
-    while (isspace(line[*index])) (*index)++;
-
-    if (line[*index] == '\0') {
-        token.type = TOKEN_END_OF_LINE;
-    } else if (isalpha(line[*index])) {
-        int start = *index;
-        while (isalnum(line[*index]) || line[*index] == '_') (*index)++;
-        int length = *index - start;
-        if (length > MAX_IDENTIFIER_LENGTH) {
-            fprintf(stderr, "Error: Identifier too long.\n");
-        } else {
-            strncpy(token.value, line + start, length);
-            token.value[length] = '\0';
-            token.type = is_keyword(token.value) ? TOKEN_KEYWORD : TOKEN_IDENTIFIER;
-        }
-    } else if (isdigit(line[*index])) {
-        int start = *index;
-        while (isdigit(line[*index])) (*index)++;
-        int length = *index - start;
-        if (length > MAX_INTEGER_LENGTH) {
-            fprintf(stderr, "Error: Integer too long.\n");
-        } else {
-            strncpy(token.value, line + start, length);
-            token.value[length] = '\0';
-            token.type = TOKEN_INTEGER;
-        }
-    } else if (line[*index] == '"') {  // Handle string literals
-        int start = ++(*index);
-        int string_length = 0;
-        while (line[*index] != '"' && line[*index] != '\0') {
-            string_length++;
-            if (string_length > MAX_STRING_LENGTH) {
-                fprintf(stderr, "Error: String too long.\n");
-                while (line[*index] != '"' && line[*index] != '\0') (*index)++;
-                break;
-            }
-            (*index)++;
+// Applies STAR integer rules: negative values become zero, values above 8 digits are an error
+int check_integer(int value, Context* context) {
+    if (value < 0) {
+        return 0;
+    }
+    if (value > MAX_INTEGER_VALUE) {
+        if (speculative) {
+            speculationFailed = 1;
+            return 0;
         }
-        if (string_length <= MAX_STRING_LENGTH) {
-            int length = *index - start;
-            strncpy(token.value, line + start, length);
-            token.value[length] = '\0';
-            token.type = TOKEN_STRING;
+        fprintf(stderr, "Error: Integer value %d exceeds the maximum of %d\n", value, MAX_INTEGER_VALUE);
+        context->errorCount++;
+        strcpy(context->lastErrorMessage, "Integer overflow");
+        stop_on_error();
+    }
+    return value;
+}
+
+int divide(int dividend, int divisor, Context* context) {
+    if (divisor == 0) {
+        if (speculative) {
+            speculationFailed = 1;
+            return 0;
         }
-        if (line[*index] == '"') (*index)++;
-    } else if (is_operator(line[*index])) {
-        token.value[0] = line[*index];
-        token.value[1] = '\0';
-        token.type = TOKEN_OPERATOR;
-        (*index)++;
+        fprintf(stderr, "Error: Division by zero\n");
+        context->errorCount++;
+        strcpy(context->lastErrorMessage, "Division by zero");
+        stop_on_error();
+    }
+    return dividend / divisor;
+}
+
+// Handles "name is <expression>." for both int and text variables
+void handle_assignment(const char* varName, const Token* tokens, int* index, Context* context) {
+    int slot = find_variable(context, varName);
+    if (slot < 0) {
+        fprintf(stderr, "Error: Undefined variable '%s'\n", varName);
+        context->errorCount++;
+        strcpy(context->lastErrorMessage, "Undefined variable");
+        stop_on_error();
+    }
+
+    if (context->variables.isInteger[slot]) {
+        int result = eval_expression_helper(tokens, index, context);
+        set_int(context, slot, check_integer(result, context));
     } else {
-        switch (line[*index]) {
-            case '.':
-                token.type = TOKEN_END_OF_LINE;
-                token.value[0] = '.';
-                token.value[1] = '\0';
-                (*index)++;
-                break;
-            case ',':
-                token.type = TOKEN_COMMA;
-                token.value[0] = ',';
-                token.value[1] = '\0';
-                (*index)++;
-                break;
-            case '{':
-                token.type = TOKEN_LEFT_CURLY_BRACKET;
-                token.value[0] = '{';
-                token.value[1] = '\0';
-                (*index)++;
-                break;
-            case '}':
-                token.type = TOKEN_RIGHT_CURLY_BRACKET;
-                token.value[0] = '}';
-                token.value[1] = '\0';
-                (*index)++;
-                break;
-            case '(':
-                token.type = TOKEN_LEFT_PAREN;
-                token.value[0] = '(';
-                token.value[1] = '\0';
-                (*index)++;
-                break;
-            case ')':
-                token.type = TOKEN_RIGHT_PAREN;
-                token.value[0] = ')';
-                token.value[1] = '\0';
-                (*index)++;
-                break;
-            default:
-                fprintf(stderr, "Error: Unrecognized token '%c'.\n", line[*index]);
-                token.type = TOKEN_ERROR;
-                (*index)++;
-                break;
-        }
+        char text[MAX_TEXT_LENGTH + 1];
+        evaluate_text_expression(tokens, index, context, text);
+        set_text(context, slot, text);
     }
+}
 
-    return token;
+// Copies the value of a text operand (string constant or text variable) into out
+void get_text_operand(Token token, Context* context, char* out) {
+    STAT_ADD(textCopies, 1);
+    if (token.type == TOKEN_STRING) {
+        strcpy(out, token.value);
+        return;
+    }
+    if (token.type == TOKEN_IDENTIFIER) {
+        int slot = find_variable(context, token.value);
+        if (slot >= 0 && !context->variables.isInteger[slot]) {
+            strcpy(out, variable_text(context, slot));
+            return;
+        }
+        fprintf(stderr, "Error: Variable '%s' is not a text\n", token.value);
+        context->errorCount++;
+        strcpy(context->lastErrorMessage, "Variable is not a text");
+        stop_on_error();
+    }
+    fprintf(stderr, "Error: Expected text value, found '%s'\n", token.value);
+    context->errorCount++;
+    strcpy(context->lastErrorMessage, "Expected text value");
+    stop_on_error();
 }
 
-// Handles write statements
-void handle_write(const char* line, int* index, Context* context) {
-    Token token;
-    while ((token = getNextToken(line, index)).type != TOKEN_END_OF_LINE) {
-        if (token.type == TOKEN_IDENTIFIER) {
-            Variable* var = get_variable(context, token.value);
-            if (var) {
-                printf("%s", var->value);
-            } else {
-                fprintf(stderr, "Error: Undefined variable '%s'\n", token.value);
-                exit(1);
+// Evaluates "operand [+|- operand]." on texts; + concatenates, - removes the first occurrence
+void evaluate_text_expression(const Token* tokens, int* index, Context* context, char* out) {
+    get_text_operand(next_token(tokens, index), context, out);
+
+    Token token = next_token(tokens, index);
+    if (token.type == TOKEN_OPERATOR && (token.value[0] == '+' || token.value[0] == '-')) {
+        char op = token.value[0];
+        char rhs[MAX_TEXT_LENGTH + 1];
+        get_text_operand(next_token(tokens, index), context, rhs);
+
+        if (op == '+') {
+            size_t length = strlen(out);
+            strncat(out, rhs, MAX_TEXT_LENGTH - length);  // Longer results are truncated to 256
+        } else if (rhs[0] != '\0') {
+            char* found = strstr(out, rhs);
+            if (found) {
+                memmove(found, found + strlen(rhs), strlen(found + strlen(rhs)) + 1);
             }
-        } else if (token.type == TOKEN_STRING || token.type == TOKEN_INTEGER) {
-            printf("%s", token.value);
-        } else if (token.type == TOKEN_COMMA) {
-            printf(" ");
         }
+        token = next_token(tokens, index);
+    }
+
+    if (token.type != TOKEN_END_OF_LINE) {
+        fprintf(stderr, "Error: Unexpected '%s' in text expression\n", token.value);
+        context->errorCount++;
+        strcpy(context->lastErrorMessage, "Unexpected token in text expression");
+        stop_on_error();
     }
-    printf("\n");
 }
 
-// Handles loop statements
-void eval_loop(ASTNode* node, Context* context) {
-    while (eval_condition(node->data.loop.condition, context)) {
-        eval(node->data.loop.body, context);
+_Thread_local int readPromptShown;  // A server session already sent the prompt of this read
+
+// Skips the prompt of a read statement, writing it when show is set; returns the variable token
+Token read_prompt(const Token* tokens, int* index, Context* context, int show) {
+    Token token = next_token(tokens, index);
+    if (token.type == TOKEN_STRING) {
+        if (show) {
+            write_output(token.value, strlen(token.value));
+        }
+        token = next_token(tokens, index);
+    } else if (token.type == TOKEN_IDENTIFIER) {
+        TokenType next = tokens[*index].type;
+        if (next == TOKEN_COMMA || next == TOKEN_IDENTIFIER) {
+            if (show) {
+                char prompt[MAX_TEXT_LENGTH + 1];
+                get_text_operand(token, context, prompt);
+                write_output(prompt, strlen(prompt));
+            }
+            token = next_token(tokens, index);
+        }
     }
+    if (token.type == TOKEN_COMMA) {
+        token = next_token(tokens, index);
+    }
+    return token;
 }
 
-int eval_condition(ASTNode* node, Context* context) {
-    if (node->type == NODE_INT) {
-        return node->data.intValue != 0;
+// Handles read statements: read ["prompt" | promptVar] [,] varName.
+void handle_read(const Token* tokens, int* index, Context* context) {
+    tape.skipOutput = 1;  // Prompts are not part of the recorded output
+    Token token = read_prompt(tokens, index, context, !readPromptShown && !tape.replaying);
+    tape.skipOutput = 0;
+    readPromptShown = 0;
+
+    int slot = token.type == TOKEN_IDENTIFIER ? find_variable(context, token.value) : -1;
+    if (slot < 0) {
+        fprintf(stderr, "Error: Expected identifier after 'read'\n");
+        context->errorCount++;
+        strcpy(context->lastErrorMessage, "Expected identifier after 'read'");
+        stop_on_error();
     }
 
-    if (node->type == NODE_VAR) {
-        Variable* var = get_variable(context, node->data.varName);
-        if (var) {
-            if (var->isInteger) {
-                return atoi(var->value) != 0;
-            } else {
-                fprintf(stderr, "Error: Variable '%s' is not an integer\n", node->data.varName);
-                context->errorCount++;
-                strcpy(context->lastErrorMessage, "Variable is not an integer");
-                exit(1);
-            }
-        } else {
-            fprintf(stderr, "Error: Undefined variable '%s'\n", node->data.varName);
+    char input[MAX_TEXT_LENGTH + 1];
+    if (tape.replaying) {
+        if (tape_replay(input, sizeof(input)) < 0) {
+            fprintf(stderr, "Error: Tape '%s' has no more input for this read\n", tape.path);
+            tape.finished = 1;  // Nothing left to check the output against
             context->errorCount++;
-            strcpy(context->lastErrorMessage, "Undefined variable");
-            exit(1);
+            strcpy(context->lastErrorMessage, "Tape has no more input");
+            stop_on_error();
+        }
+    } else {
+        flush_output();  // The prompt has to be visible before we block on input
+        double start = tape.active ? tape_clock() : 0;
+        int found = read_input_line(input, sizeof(input));
+        if (!found) {
+            input[0] = '\0';
+        }
+        input[strcspn(input, "\n")] = '\0';
+        if (tape.active) {
+            tape_record(input, found, tape_clock() - start);
         }
     }
 
-    if (node->type == NODE_EXPRESSION) {
-        int leftValue = eval_expression(node->data.assign.left, context);
-        int rightValue = eval_expression(node->data.assign.right, context);
-        switch (node->data.assign.op) {
-            case '>':
-                return leftValue > rightValue;
-            case '<':
-                return leftValue < rightValue;
-            case '>=':
-                return leftValue >= rightValue;
-            case '<=':
-                return leftValue <= rightValue;
-            case '==':
-                return leftValue == rightValue;
-            case '!=':
-                return leftValue != rightValue;
-            default:
-                fprintf(stderr, "Error: Unknown operator '%c' in condition\n", node->data.assign.op);
-                context->errorCount++;
-                strcpy(context->lastErrorMessage, "Unknown operator in condition");
-                exit(1);
+    if (context->variables.isInteger[slot]) {
+        int value;
+        if (!parse_integer_input(input, &value)) {
+            fprintf(stderr, "Warning: '%s' is not a valid integer, '%s' is set to 0\n", input, token.value);
         }
+        set_int(context, slot, value);
+    } else {
+        set_text(context, slot, input);
     }
 
-    fprintf(stderr, "Error: Invalid node type in condition\n");
-    context->errorCount++;
-    strcpy(context->lastErrorMessage, "Invalid node type in condition");
-    exit(1);
+    token = next_token(tokens, index);
+    if (token.type != TOKEN_END_OF_LINE) {
+        fprintf(stderr, "Error: Expected '.' after read statement\n");
+        context->errorCount++;
+        strcpy(context->lastErrorMessage, "Expected '.' after read statement");
+        stop_on_error();
+    }
 }
 
-int eval_expression_helper(const char** expr, Context* context) {
-    int result = 0;
-    int sign = 1;
-    int current_value = 0;
-    int operand_set = 0;
-    char current_operator = '+';
+// Records a lexical error; the column is counted from the start of its line
+void add_diagnostic(TokenStream* stream, int line, int column, const char* message) {
+    if (stream->diagnosticCount == stream->diagnosticCapacity) {
+        stream->diagnostics = grow_table(stream->diagnostics, &stream->diagnosticCapacity, sizeof(Diagnostic));
+    }
+    Diagnostic* diagnostic = &stream->diagnostics[stream->diagnosticCount++];
+    diagnostic->line = line;
+    diagnostic->column = column;
+    diagnostic->message = message;
+}
 
-    while (**expr) {
-        if (isspace(**expr)) {
-            (*expr)++;
-            continue;
-        }
+// The front end: scans the whole source once, skipping comments, and produces the token
+// stream the compiler and the executor work on together with every lexical error found.
+// A malformed token becomes TOKEN_ERROR and scanning goes on, so all errors are reported.
+void scan_source(const char* source, TokenStream* stream) {
+    static const char punctuationChars[] = ".,{}()+-*/";
+    static const char* punctuation[] = {".", ",", "{", "}", "(", ")", "+", "-", "*", "/"};
+    static const TokenType punctuationTypes[] = {
+        TOKEN_END_OF_LINE, TOKEN_COMMA, TOKEN_LEFT_CURLY_BRACKET, TOKEN_RIGHT_CURLY_BRACKET,
+        TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN, TOKEN_OPERATOR, TOKEN_OPERATOR, TOKEN_OPERATOR, TOKEN_OPERATOR
+    };
+    size_t length = strlen(source);
+    char* lexeme = allocate(2 * length + 2);  // Each lexeme is at most its source plus a NUL
+    memset(stream, 0, sizeof(*stream));
+    stream->lexemes = lexeme;
 
-        if (isdigit(**expr)) {
-            current_value = 0;
-            while (isdigit(**expr)) {
-                current_value = current_value * 10 + (**expr - '0');
-                (*expr)++;
-            }
-            operand_set = 1;
-        } else if (isalpha(**expr)) {
-            char varName[MAX_IDENTIFIER_LENGTH + 1] = {0};
-            int len = 0;
-            while (isalnum(**expr) || **expr == '_') {
-                varName[len++] = **expr;
-                (*expr)++;
-            }
-            varName[len] = '\0';
-            Variable* var = get_variable(context, varName);
-            if (var) {
-                current_value = atoi(var->value);
-                operand_set = 1;
+    int line = 1;
+    int lineStart = 0;
+    int openBrackets = 0;
+    int i = 0;
+
+    for (;;) {
+        // Whitespace and comments
+        for (;;) {
+            if (source[i] == '\n') {
+                line++;
+                lineStart = ++i;
+            } else if (isspace(source[i])) {
+                i++;
+            } else if (source[i] == '/' && source[i + 1] == '*') {
+                int commentLine = line;
+                int commentColumn = i - lineStart + 1;
+                i += 2;
+                while (source[i] != '\0' && !(source[i] == '*' && source[i + 1] == '/')) {
+                    if (source[i] == '\n') {
+                        line++;
+                        lineStart = i + 1;
+                    }
+                    i++;
+                }
+                if (source[i] == '\0') {
+                    add_diagnostic(stream, commentLine, commentColumn, "Unclosed comment");
+                } else {
+                    i += 2;
+                }
             } else {
-                fprintf(stderr, "Error: Undefined variable '%s'\n", varName);
-                exit(1);
+                break;
             }
-        } else if (**expr == '(') {
-            (*expr)++;
-            current_value = eval_expression_helper(expr, context);
-            operand_set = 1;
-        } else if (**expr == ')') {
-            (*expr)++;
+        }
+
+        if (stream->tokenCount == stream->tokenCapacity) {
+            stream->tokens = grow_table(stream->tokens, &stream->tokenCapacity, sizeof(Token));
+        }
+        Token* token = &stream->tokens[stream->tokenCount++];
+        token->line = line;
+        token->offset = i;
+        token->number = 0;
+        int column = i - lineStart + 1;
+        int start = i;
+        STAT_ADD(tokensLexed, 1);
+
+        if (source[i] == '\0') {
+            token->type = TOKEN_END_OF_FILE;
+            token->value = "";
             break;
-        } else if (is_operator(**expr)) {
-            if (!operand_set) {
-                fprintf(stderr, "Error: Expected operand before operator '%c'\n", **expr);
-                exit(1);
+        }
+
+        if (isalpha(source[i])) {
+            while (isalnum(source[i]) || source[i] == '_') i++;
+            if (i - start > MAX_IDENTIFIER_LENGTH) {
+                add_diagnostic(stream, line, column, "Identifier too long");
+                token->type = TOKEN_ERROR;
+                token->value = "";
+                continue;
             }
-            if (current_operator == '+') {
-                result += sign * current_value;
-            } else if (current_operator == '-') {
-                result -= sign * current_value;
-            } else if (current_operator == '*') {
-                result *= current_value;
-            } else if (current_operator == '/') {
-                result /= current_value;
+            memcpy(lexeme, source + start, i - start);
+            lexeme[i - start] = '\0';
+            token->value = lexeme;
+            token->type = is_keyword(lexeme) ? TOKEN_KEYWORD : TOKEN_IDENTIFIER;
+            lexeme += i - start + 1;
+        } else if (isdigit(source[i])) {
+            while (isdigit(source[i])) i++;
+            if (i - start > MAX_INTEGER_LENGTH) {
+                add_diagnostic(stream, line, column, "Integer too long");
+                token->type = TOKEN_ERROR;
+                token->value = "";
+                continue;
             }
-            current_operator = **expr;
-            sign = (current_operator == '-') ? -1 : 1;
-            (*expr)++;
-            operand_set = 0;
-        } else if (**expr == '&' && *(*expr + 1) == '&') {
-            (*expr) += 2;
-            int rhs = eval_expression_helper(expr, context);
-            return (result != 0) && (rhs != 0);
-        } else if (**expr == '|' && *(*expr + 1) == '|') {
-            (*expr) += 2;
-            int rhs = eval_expression_helper(expr, context);
-            return (result != 0) || (rhs != 0);
-        } else if (**expr == '.') {
-            (*expr)++;
-            break;
+            memcpy(lexeme, source + start, i - start);
+            lexeme[i - start] = '\0';
+            token->value = lexeme;
+            token->number = parse_integer(lexeme);
+            token->type = TOKEN_INTEGER;
+            lexeme += i - start + 1;
+        } else if (source[i] == '"') {  // Strings end on the line they start
+            i++;
+            while (source[i] != '"' && source[i] != '\n' && source[i] != '\0') i++;
+            int stringLength = i - start - 1;
+            token->type = TOKEN_ERROR;
+            token->value = "";
+            if (source[i] != '"') {
+                add_diagnostic(stream, line, column, "Unclosed string");
+                continue;
+            }
+            i++;
+            if (stringLength > MAX_STRING_LENGTH) {
+                add_diagnostic(stream, line, column, "String too long");
+                continue;
+            }
+            memcpy(lexeme, source + start + 1, stringLength);
+            lexeme[stringLength] = '\0';
+            token->value = lexeme;
+            token->type = TOKEN_STRING;
+            lexeme += stringLength + 1;
         } else {
-            fprintf(stderr, "Error: Unexpected character '%c' in expression\n", **expr);
-            exit(1);
+            const char* found = strchr(punctuationChars, source[i]);
+            if (!found) {
+                add_diagnostic(stream, line, column, "Unrecognized token");
+                token->type = TOKEN_ERROR;
+                token->value = "";
+                i++;
+                continue;
+            }
+            token->value = punctuation[found - punctuationChars];
+            token->type = punctuationTypes[found - punctuationChars];
+            i++;
+
+            if (token->type == TOKEN_LEFT_CURLY_BRACKET) {
+                openBrackets++;
+            } else if (token->type == TOKEN_RIGHT_CURLY_BRACKET) {
+                if (openBrackets > 0) {
+                    openBrackets--;
+                } else {
+                    add_diagnostic(stream, line, column, "Unmatched right curly bracket");
+                }
+            } else if (source[start] == '-' && isdigit(source[i]) && stream->tokenCount > 1) {
+                // A minus right before a number that does not follow an operand is a negative constant
+                TokenType previous = stream->tokens[stream->tokenCount - 2].type;
+                if (previous != TOKEN_INTEGER && previous != TOKEN_IDENTIFIER && previous != TOKEN_RIGHT_PAREN) {
+                    add_diagnostic(stream, line, column, "Negative integer");
+                }
+            }
         }
     }
 
-    if (operand_set) {
-        if (current_operator == '+') {
-            result += sign * current_value;
-        } else if (current_operator == '-') {
-            result -= sign * current_value;
-        } else if (current_operator == '*') {
-            result *= current_value;
-        } else if (current_operator == '/') {
-            result /= current_value;
-        }
+    if (openBrackets > 0) {
+        add_diagnostic(stream, line, i - lineStart + 1, "Unclosed curly bracket");
     }
+}
 
-    return result;
+void free_token_stream(TokenStream* stream) {
+    free(stream->tokens);
+    free(stream->lexemes);
+    free(stream->diagnostics);
+    memset(stream, 0, sizeof(*stream));
 }
 
-void eval(ASTNode* node, Context* context) {
-    switch (node->type) {
-        case NODE_INT:
-            context->result.intValue = node->data.intValue;
-            context->result.isInteger = 1;
-            break;
-        case NODE_STRING:
-            strcpy(context->result.stringValue, node->data.stringValue);
-            context->result.isInteger = 0;
-            break;
-        case NODE_VAR: {
-            Variable* var = get_variable(context, node->data.varName);
-            if (var) {
-                if (var->isInteger) {
-                    context->result.intValue = atoi(var->value);
-                    context->result.isInteger = 1;
-                } else {
-                    strcpy(context->result.stringValue, var->value);
-                    context->result.isInteger = 0;
-                }
-            } else {
-                fprintf(stderr, "Error: Undefined variable '%s'\n", node->data.varName);
-                context->errorCount++;
-                strcpy(context->lastErrorMessage, "Undefined variable");
-                exit(1);
-            }
-            break;
-        }
-        case NODE_ASSIGN:
-            eval(node->data.assign.right, context);
-            if (context->result.isInteger) {
-                char resultStr[MAX_INTEGER_LENGTH + 1];
-                sprintf(resultStr, "%d", context->result.intValue);
-                set_variable(context, node->data.assign.left->data.varName, resultStr, 1);
-            } else {
-                set_variable(context, node->data.assign.left->data.varName, context->result.stringValue, 0);
+// Prints the lexical errors in the form of the former lexical analyzer report
+void write_diagnostics(FILE* file, const TokenStream* stream) {
+    for (int i = 0; i < stream->diagnosticCount; i++) {
+        const Diagnostic* diagnostic = &stream->diagnostics[i];
+        fprintf(file, "Error: %s (line %d, column %d).\n", diagnostic->message, diagnostic->line, diagnostic->column);
+    }
+}
+
+// Incremental lexing for editors. A LexDocument keeps the text as lines, and for every line
+// its tokens, its lexical errors and the lexer state at its end: whether a comment is open,
+// where it started, and the type of the last token, which decides whether a minus before a
+// number is a negative constant. An edit re-lexes the lines it touches and then the lines
+// after them until a line ends in the same state as before. Curly brackets are not part of
+// that state, since one '{' changes the depth of everything after it; every line instead
+// keeps its unmatched '}' and its unclosed '{'. Lines are kept in blocks, and a segment tree
+// over the blocks sums their bytes, lines, errors and brackets, so an edit finds its line and
+// the diagnostics are collected without visiting the error-free parts of the text. They are
+// the ones scan_source reports for the same text, in the same order.
+#define LEX_BLOCK_LINES 64
+
+typedef struct {
+    int inComment;
+    int commentLinesAgo;  // The comment started this many lines before the next line
+    int commentColumn;
+    TokenType last;       // Type of the last token so far, TOKEN_END_OF_FILE before the first
+} LexState;
+
+typedef struct {
+    TokenType type;
+    int column;
+    int length;
+} LexToken;
+
+typedef struct {
+    int column;
+    const char* message;
+} LexDiagnostic;
+
+typedef struct {
+    char* text;  // Without its newline, NUL-terminated
+    int length;
+    LexState end;
+    LexToken* tokens;
+    int tokenCount;
+    LexDiagnostic* diagnostics;
+    int diagnosticCount;
+    int* closes;     // Columns of the '}' that find no '{' earlier on the line
+    int closeCount;
+    int opens;       // '{' left open at the end of the line
+} LexLine;
+
+// Summary of a run of lines; closes and opens are the '}' and '{' left unmatched inside it
+typedef struct {
+    long long bytes;  // Text and newlines
+    int lines;
+    int closes;
+    int opens;
+    int diagnosticCount;
+} LexSummary;
+
+typedef struct {
+    LexLine lines[LEX_BLOCK_LINES];
+    int lineCount;
+} LexBlock;
+
+typedef struct {
+    LexBlock** blocks;
+    int blockCount;
+    int blockCapacity;
+    LexSummary* tree;  // Node 1 is the root, block i is leaf treeLeaves + i
+    int treeLeaves;
+    Diagnostic* diagnostics;  // Of the whole document, see lex_collect
+    int diagnosticCount;
+    int diagnosticCapacity;
+} LexDocument;
+
+const LexState lexStart = {0, 0, 0, TOKEN_END_OF_FILE};
+
+int lex_same_state(const LexState* a, const LexState* b) {
+    return a->inComment == b->inComment && a->last == b->last &&
+           (!a->inComment || (a->commentLinesAgo == b->commentLinesAgo && a->commentColumn == b->commentColumn));
+}
+
+void lex_add_diagnostic(LexLine* line, int* capacity, int column, const char* message) {
+    if (line->diagnosticCount == *capacity) {
+        line->diagnostics = grow_table(line->diagnostics, capacity, sizeof(LexDiagnostic));
+    }
+    line->diagnostics[line->diagnosticCount].column = column;
+    line->diagnostics[line->diagnosticCount++].message = message;
+}
+
+void lex_free_line(LexLine* line) {
+    free(line->text);
+    free(line->tokens);
+    free(line->diagnostics);
+    free(line->closes);
+}
+
+// Lexes line->text starting in state start, with the rules of scan_source
+void lex_line(LexLine* line, const LexState* start) {
+    static const char punctuationChars[] = ".,{}()+-*/";
+    static const TokenType punctuationTypes[] = {
+        TOKEN_END_OF_LINE, TOKEN_COMMA, TOKEN_LEFT_CURLY_BRACKET, TOKEN_RIGHT_CURLY_BRACKET,
+        TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN, TOKEN_OPERATOR, TOKEN_OPERATOR, TOKEN_OPERATOR, TOKEN_OPERATOR
+    };
+    const char* text = line->text;
+    int tokenCapacity = 0;
+    int diagnosticCapacity = 0;
+    int closeCapacity = 0;
+    free(line->tokens);
+    free(line->diagnostics);
+    free(line->closes);
+    line->tokens = NULL;
+    line->tokenCount = 0;
+    line->diagnostics = NULL;
+    line->diagnosticCount = 0;
+    line->closes = NULL;
+    line->closeCount = 0;
+    line->opens = 0;
+    line->end = *start;
+    if (line->end.inComment) {
+        line->end.commentLinesAgo++;
+    }
+
+    int i = 0;
+    for (;;) {
+        if (line->end.inComment) {
+            while (text[i] != '\0' && !(text[i] == '*' && text[i + 1] == '/')) i++;
+            if (text[i] == '\0') {
+                return;
             }
-            break;
-        case NODE_WRITE:
-            eval(node->data.assign.right, context);
-            if (context->result.isInteger) {
-                printf("%d", context->result.intValue);
+            i += 2;
+            line->end.inComment = 0;
+        }
+        while (isspace(text[i])) i++;
+        if (text[i] == '/' && text[i + 1] == '*') {
+            line->end = (LexState){1, 1, i + 1, line->end.last};
+            i += 2;
+            continue;
+        }
+        if (text[i] == '\0') {
+            return;
+        }
+
+        int start = i;
+        TokenType type;
+        const char* error = NULL;
+        if (isalpha(text[i])) {
+            while (isalnum(text[i]) || text[i] == '_') i++;
+            if (i - start > MAX_IDENTIFIER_LENGTH) {
+                error = "Identifier too long";
             } else {
-                printf("%s", context->result.stringValue);
+                char identifier[MAX_IDENTIFIER_LENGTH + 1];
+                memcpy(identifier, text + start, i - start);
+                identifier[i - start] = '\0';
+                type = is_keyword(identifier) ? TOKEN_KEYWORD : TOKEN_IDENTIFIER;
+            }
+        } else if (isdigit(text[i])) {
+            while (isdigit(text[i])) i++;
+            type = TOKEN_INTEGER;
+            if (i - start > MAX_INTEGER_LENGTH) error = "Integer too long";
+        } else if (text[i] == '"') {
+            i++;
+            while (text[i] != '"' && text[i] != '\0') i++;
+            type = TOKEN_STRING;
+            if (text[i] != '"') {
+                error = "Unclosed string";
+            } else if (++i - start - 2 > MAX_STRING_LENGTH) {
+                error = "String too long";
+            }
+        } else {
+            const char* found = strchr(punctuationChars, text[i]);
+            i++;
+            if (!found) {
+                error = "Unrecognized token";
+            } else {
+                type = punctuationTypes[found - punctuationChars];
+                if (type == TOKEN_LEFT_CURLY_BRACKET) {
+                    line->opens++;
+                } else if (type == TOKEN_RIGHT_CURLY_BRACKET) {
+                    if (line->opens > 0) {
+                        line->opens--;
+                    } else {
+                        if (line->closeCount == closeCapacity) {
+                            line->closes = grow_table(line->closes, &closeCapacity, sizeof(int));
+                        }
+                        line->closes[line->closeCount++] = start + 1;
+                    }
+                } else if (text[start] == '-' && isdigit(text[i]) && line->end.last != TOKEN_END_OF_FILE &&
+                           line->end.last != TOKEN_INTEGER && line->end.last != TOKEN_IDENTIFIER &&
+                           line->end.last != TOKEN_RIGHT_PAREN) {
+                    lex_add_diagnostic(line, &diagnosticCapacity, start + 1, "Negative integer");
+                }
             }
-            break;
-        case NODE_READ: {
-            char input[MAX_STRING_LENGTH + 1];
-            fgets(input, sizeof(input), stdin);
-            input[strcspn(input, "\n")] = '\0';
-            set_variable(context, node->data.varName, input, 0);
-            break;
         }
-        case NODE_NEWLINE:
-            printf("\n");
-            break;
-        case NODE_LOOP:
-            eval_loop(node, context);
-            break;
-        case NODE_BLOCK: {
-            ASTNode* stmt = node->data.block;
-            while (stmt) {
-                eval(stmt, context);
-                stmt = stmt->next;
+        if (error) {
+            type = TOKEN_ERROR;
+            lex_add_diagnostic(line, &diagnosticCapacity, start + 1, error);
+        }
+
+        if (line->tokenCount == tokenCapacity) {
+            line->tokens = grow_table(line->tokens, &tokenCapacity, sizeof(LexToken));
+        }
+        line->tokens[line->tokenCount++] = (LexToken){type, start + 1, i - start};
+        line->end.last = type;
+    }
+}
+
+// The summary of a followed by b: the '}' of b first close the '{' left open in a
+LexSummary lex_compose(LexSummary a, LexSummary b) {
+    int matched = b.closes < a.opens ? b.closes : a.opens;
+    a.bytes += b.bytes;
+    a.lines += b.lines;
+    a.closes += b.closes - matched;
+    a.opens += b.opens - matched;
+    a.diagnosticCount += b.diagnosticCount;
+    return a;
+}
+
+void lex_block_summary(LexDocument* document, int index) {
+    LexBlock* block = document->blocks[index];
+    LexSummary summary = {0};
+    for (int l = 0; l < block->lineCount; l++) {
+        LexLine* line = &block->lines[l];
+        summary = lex_compose(summary, (LexSummary){line->length + 1, 1, line->closeCount, line->opens, line->diagnosticCount});
+    }
+    document->tree[document->treeLeaves + index] = summary;
+}
+
+// Recomputes the tree nodes above the leaves of blocks from to to
+void lex_refresh_tree(LexDocument* document, int from, int to) {
+    int low = (document->treeLeaves + from) / 2;
+    int high = (document->treeLeaves + to) / 2;
+    for (; high > 0; low /= 2, high /= 2) {
+        for (int node = low; node <= high; node++) {
+            document->tree[node] = lex_compose(document->tree[2 * node], document->tree[2 * node + 1]);
+        }
+    }
+}
+
+// Inserts an empty block at index. The leaves after it move with the blocks, so only the
+// nodes above them need recomputing, see lex_refresh_tree.
+LexBlock* lex_insert_block(LexDocument* document, int index) {
+    if (document->blockCount == document->blockCapacity) {
+        document->blocks = grow_table(document->blocks, &document->blockCapacity, sizeof(LexBlock*));
+    }
+    if (document->blockCount == document->treeLeaves) {
+        int leaves = document->treeLeaves ? document->treeLeaves * 2 : 1;
+        LexSummary* tree = allocate(sizeof(LexSummary) * 2 * leaves);
+        memset(tree, 0, sizeof(LexSummary) * 2 * leaves);
+        if (document->tree) {
+            memcpy(&tree[leaves], &document->tree[document->treeLeaves], sizeof(LexSummary) * document->blockCount);
+        }
+        free(document->tree);
+        document->tree = tree;
+        document->treeLeaves = leaves;
+        lex_refresh_tree(document, 0, leaves - 1);
+    }
+    LexSummary* leaf = &document->tree[document->treeLeaves + index];
+    memmove(leaf + 1, leaf, sizeof(LexSummary) * (document->blockCount - index));
+    memset(leaf, 0, sizeof(LexSummary));
+    memmove(&document->blocks[index + 1], &document->blocks[index], sizeof(LexBlock*) * (document->blockCount - index));
+    LexBlock* block = allocate(sizeof(LexBlock));
+    block->lineCount = 0;
+    document->blocks[index] = block;
+    document->blockCount++;
+    return block;
+}
+
+void lex_remove_block(LexDocument* document, int index) {
+    free(document->blocks[index]);
+    document->blockCount--;
+    memmove(&document->blocks[index], &document->blocks[index + 1], sizeof(LexBlock*) * (document->blockCount - index));
+    LexSummary* leaf = &document->tree[document->treeLeaves + index];
+    memmove(leaf, leaf + 1, sizeof(LexSummary) * (document->blockCount - index));
+    memset(&document->tree[document->treeLeaves + document->blockCount], 0, sizeof(LexSummary));
+}
+
+// Finds the line holding document offset offset; *column becomes the offset within it
+void lex_locate(LexDocument* document, long long offset, int* block, int* line, int* column) {
+    int node = 1;
+    while (node < document->treeLeaves) {
+        node *= 2;
+        if (offset >= document->tree[node].bytes && document->tree[node + 1].lines > 0) {
+            offset -= document->tree[node++].bytes;
+        }
+    }
+    int b = node - document->treeLeaves;
+    int l = 0;
+    LexBlock* found = document->blocks[b];
+    while (l < found->lineCount - 1 && offset > found->lines[l].length) {
+        offset -= found->lines[l++].length + 1;
+    }
+    *block = b;
+    *line = l;
+    *column = (int)offset;
+}
+
+Diagnostic* lex_add_document_diagnostic(LexDocument* document, int line, int column, const char* message) {
+    if (document->diagnosticCount == document->diagnosticCapacity) {
+        document->diagnostics = grow_table(document->diagnostics, &document->diagnosticCapacity, sizeof(Diagnostic));
+    }
+    Diagnostic* diagnostic = &document->diagnostics[document->diagnosticCount++];
+    diagnostic->line = line;
+    diagnostic->column = column;
+    diagnostic->message = message;
+    return diagnostic;
+}
+
+// Adds the diagnostics of the blocks under a tree node, entered at bracket depth *depth with
+// its first line numbered *lineNumber. Nodes without errors or unmatched '}' are skipped.
+void lex_collect_node(LexDocument* document, int node, int* depth, int* lineNumber) {
+    const LexSummary* summary = &document->tree[node];
+    if (summary->diagnosticCount == 0 && summary->closes <= *depth) {
+        *depth += summary->opens - summary->closes;
+        *lineNumber += summary->lines;
+        return;
+    }
+    if (node < document->treeLeaves) {
+        lex_collect_node(document, 2 * node, depth, lineNumber);
+        lex_collect_node(document, 2 * node + 1, depth, lineNumber);
+        return;
+    }
+    LexBlock* block = document->blocks[node - document->treeLeaves];
+    for (int l = 0; l < block->lineCount; l++, (*lineNumber)++) {
+        LexLine* line = &block->lines[l];
+        int d = 0;
+        int c = *depth < line->closeCount ? *depth : line->closeCount;  // Closes that find an earlier '{'
+        while (d < line->diagnosticCount || c < line->closeCount) {
+            if (c < line->closeCount && (d == line->diagnosticCount || line->closes[c] < line->diagnostics[d].column)) {
+                lex_add_document_diagnostic(document, *lineNumber, line->closes[c++], "Unmatched right curly bracket");
+            } else {
+                lex_add_document_diagnostic(document, *lineNumber, line->diagnostics[d].column, line->diagnostics[d].message);
+                d++;
             }
-            break;
         }
-        case NODE_EXPRESSION:
-            context->result.intValue = eval_expression(node, context);
-            context->result.isInteger = 1;
+        *depth = (*depth > line->closeCount ? *depth - line->closeCount : 0) + line->opens;
+    }
+}
+
+// Rebuilds the document diagnostics; an open comment and open brackets are reported at the end
+void lex_collect(LexDocument* document) {
+    document->diagnosticCount = 0;
+    int depth = 0;
+    int lineNumber = 1;
+    lex_collect_node(document, 1, &depth, &lineNumber);
+
+    LexBlock* block = document->blocks[document->blockCount - 1];
+    LexLine* last = &block->lines[block->lineCount - 1];
+    if (last->end.inComment) {
+        lex_add_document_diagnostic(document, lineNumber - last->end.commentLinesAgo, last->end.commentColumn, "Unclosed comment");
+    }
+    if (depth > 0) {
+        lex_add_document_diagnostic(document, lineNumber - 1, last->length + 1, "Unclosed curly bracket");
+    }
+}
+
+// Sets line to a copy of length bytes of text
+void lex_set_text(LexLine* line, const char* text, int length) {
+    line->text = allocate(length + 1);
+    memcpy(line->text, text, length);
+    line->text[length] = '\0';
+    line->length = length;
+    line->tokens = NULL;
+    line->diagnostics = NULL;
+    line->closes = NULL;
+    line->end = lexStart;
+}
+
+LexDocument* lex_open(const char* source) {
+    LexDocument* document = allocate(sizeof(LexDocument));
+    memset(document, 0, sizeof(LexDocument));
+    LexState state = lexStart;
+    LexBlock* block = NULL;
+    for (;;) {
+        const char* newline = strchr(source, '\n');
+        int length = newline ? (int)(newline - source) : (int)strlen(source);
+        if (!block || block->lineCount == LEX_BLOCK_LINES) {
+            if (block) lex_block_summary(document, document->blockCount - 1);
+            block = lex_insert_block(document, document->blockCount);
+        }
+        LexLine* line = &block->lines[block->lineCount++];
+        lex_set_text(line, source, length);
+        lex_line(line, &state);
+        state = line->end;
+        if (!newline) break;
+        source = newline + 1;
+    }
+    lex_block_summary(document, document->blockCount - 1);
+    lex_refresh_tree(document, 0, document->blockCount - 1);
+    lex_collect(document);
+    return document;
+}
+
+void lex_close(LexDocument* document) {
+    for (int b = 0; b < document->blockCount; b++) {
+        for (int l = 0; l < document->blocks[b]->lineCount; l++) {
+            lex_free_line(&document->blocks[b]->lines[l]);
+        }
+        free(document->blocks[b]);
+    }
+    free(document->blocks);
+    free(document->tree);
+    free(document->diagnostics);
+    free(document);
+}
+
+// Merges block index into the block before it when both are at most half full, so a block
+// that was just split is not merged again by the next deletion. Returns 1 if merged.
+int lex_merge_blocks(LexDocument* document, int index) {
+    if (index < 1 || index >= document->blockCount) {
+        return 0;
+    }
+    LexBlock* block = document->blocks[index - 1];
+    LexBlock* next = document->blocks[index];
+    if (block->lineCount + next->lineCount > LEX_BLOCK_LINES / 2) {
+        return 0;
+    }
+    memcpy(&block->lines[block->lineCount], next->lines, sizeof(LexLine) * next->lineCount);
+    block->lineCount += next->lineCount;
+    lex_remove_block(document, index);
+    lex_block_summary(document, index - 1);
+    return 1;
+}
+
+// Replaces removed bytes at offset with the inserted text and updates the diagnostics.
+// Returns 0, leaving the document unchanged, for a range outside the text or a NUL byte.
+int lex_edit(LexDocument* document, long long offset, long long removed, const char* inserted, long long insertedLength) {
+    long long size = document->tree[1].bytes - 1;  // The last line has no newline
+    if (offset < 0 || removed < 0 || offset + removed > size || memchr(inserted, '\0', insertedLength)) {
+        return 0;
+    }
+
+    int b1, l1, c1, b2, l2, c2;
+    lex_locate(document, offset, &b1, &l1, &c1);
+    lex_locate(document, offset + removed, &b2, &l2, &c2);
+    LexLine* first = &document->blocks[b1]->lines[l1];
+    LexLine* lastRemoved = &document->blocks[b2]->lines[l2];
+    LexState oldEnd = lastRemoved->end;
+
+    // The new text of the lines from l1 to l2
+    long long length = c1 + insertedLength + (lastRemoved->length - c2);
+    char* text = allocate(length + 1);
+    memcpy(text, first->text, c1);
+    memcpy(text + c1, inserted, insertedLength);
+    memcpy(text + c1 + insertedLength, lastRemoved->text + c2, lastRemoved->length - c2);
+    text[length] = '\0';
+
+    // Remove the old lines, then insert the new ones at b1/l1, splitting full blocks
+    int touched = b1 + (b2 > b1 && document->blocks[b2]->lineCount > l2 + 1);  // Last block whose lines changed
+    int blockCount = document->blockCount;
+    for (int b = b1; b <= b2; b++) {
+        LexBlock* block = document->blocks[b];
+        int from = b == b1 ? l1 : 0;
+        int to = b == b2 ? l2 + 1 : block->lineCount;
+        for (int l = from; l < to; l++) {
+            lex_free_line(&block->lines[l]);
+        }
+        memmove(&block->lines[from], &block->lines[to], sizeof(LexLine) * (block->lineCount - to));
+        block->lineCount -= to - from;
+    }
+    int moved = 0;  // Blocks were added or removed, so the leaves after b1 moved
+    for (int b = b2; b > b1; b--) {
+        if (document->blocks[b]->lineCount == 0) {
+            lex_remove_block(document, b);
+            moved = 1;
+        }
+    }
+    int b = b1;
+    int l = l1;
+    int newLines = 0;
+    for (char* piece = text;;) {
+        char* newline = memchr(piece, '\n', length - (piece - text));
+        LexBlock* block = document->blocks[b];
+        if (block->lineCount == LEX_BLOCK_LINES) {
+            LexBlock* tail = lex_insert_block(document, b + 1);  // Takes the lines from l on
+            tail->lineCount = block->lineCount - l;
+            memcpy(tail->lines, &block->lines[l], sizeof(LexLine) * tail->lineCount);
+            block->lineCount = l;
+            touched++;
+            moved = 1;
+            if (l == LEX_BLOCK_LINES) {
+                block = tail;
+                b++;
+                l = 0;
+            }
+        }
+        memmove(&block->lines[l + 1], &block->lines[l], sizeof(LexLine) * (block->lineCount - l));
+        block->lineCount++;
+        lex_set_text(&block->lines[l++], piece, newline ? (int)(newline - piece) : (int)(length - (piece - text)));
+        newLines++;
+        if (!newline) break;
+        piece = newline + 1;
+    }
+    free(text);
+
+    // Re-lex the new lines, then the following ones until a line ends in the state it ended in before
+    LexState state = lexStart;
+    if (l1 > 0) {
+        state = document->blocks[b1]->lines[l1 - 1].end;
+    } else if (b1 > 0) {
+        LexBlock* previous = document->blocks[b1 - 1];
+        state = previous->lines[previous->lineCount - 1].end;
+    }
+    b = b1;
+    l = l1;
+    for (int relexed = 1;; relexed++) {
+        LexLine* line = &document->blocks[b]->lines[l];
+        LexState before = relexed == newLines ? oldEnd : line->end;
+        lex_line(line, &state);
+        state = line->end;
+        if (++l == document->blocks[b]->lineCount) {
+            b++;
+            l = 0;
+        }
+        if ((relexed >= newLines && lex_same_state(&state, &before)) || b == document->blockCount) {
             break;
-        default:
-            fprintf(stderr, "Error: Unknown node type %d\n", node->type);
-            context->errorCount++;
-            strcpy(context->lastErrorMessage, "Unknown node type");
-            exit(1);
+        }
+    }
+    if (l == 0) b--;
+    if (touched < b) touched = b;
+    for (int s = b1; s <= touched; s++) {
+        lex_block_summary(document, s);
+    }
+    moved |= lex_merge_blocks(document, b1 + 1);
+    moved |= lex_merge_blocks(document, b1);
+    if (moved) {
+        touched = (document->blockCount > blockCount ? document->blockCount : blockCount) - 1;
     }
+    lex_refresh_tree(document, b1 > 0 ? b1 - 1 : 0, touched);
+
+    lex_collect(document);
+    return 1;
 }
 
-int eval_expression(ASTNode* node, Context* context) {
-    switch (node->type) {
-        case NODE_INT:
-            return node->data.intValue;
-        case NODE_VAR: {
-            Variable* var = get_variable(context, node->data.varName);
-            if (var && var->isInteger) {
-                return atoi(var->value);
+// The diagnostics of the current text, in the order scan_source reports them
+int lex_diagnostics(const LexDocument* document, const Diagnostic** diagnostics) {
+    *diagnostics = document->diagnostics;
+    return document->diagnosticCount;
+}
+
+// Handles write statements
+void handle_write(const Token* tokens, int* index, Context* context) {
+    Token token;
+    while ((token = next_token(tokens, index)).type != TOKEN_END_OF_LINE && token.type != TOKEN_END_OF_FILE) {
+        if (token.type == TOKEN_IDENTIFIER) {
+            int slot = find_variable(context, token.value);
+            if (slot >= 0 && context->variables.isInteger[slot]) {
+                write_integer(context->variables.ints[slot]);
+            } else if (slot >= 0) {
+                const char* text = variable_text(context, slot);
+                write_output(text, strlen(text));
+            } else {
+                fprintf(stderr, "Error: Undefined variable '%s'\n", token.value);
+                stop_on_error();
+            }
+        } else if (token.type == TOKEN_STRING || token.type == TOKEN_INTEGER) {
+            write_output(token.value, strlen(token.value));
+        } else if (token.type == TOKEN_COMMA) {
+            write_output(" ", 1);
+        }
+    }
+}
+
+// Handles loop statements
+void eval_loop(ASTNode* node, Context* context) {
+    while (eval_condition(node->data.loop.condition, context)) {
+        eval(node->data.loop.body, context);
+    }
+}
+
+int eval_condition(ASTNode* node, Context* context) {
+    if (node->type == NODE_INT) {
+        return node->data.intValue != 0;
+    }
+
+    if (node->type == NODE_VAR) {
+        int slot = find_variable(context, node->data.varName);
+        if (slot >= 0) {
+            if (context->variables.isInteger[slot]) {
+                return context->variables.ints[slot] != 0;
             } else {
                 fprintf(stderr, "Error: Variable '%s' is not an integer\n", node->data.varName);
                 context->errorCount++;
                 strcpy(context->lastErrorMessage, "Variable is not an integer");
-                exit(1);
+                stop_on_error();
             }
+        } else {
+            fprintf(stderr, "Error: Undefined variable '%s'\n", node->data.varName);
+            context->errorCount++;
+            strcpy(context->lastErrorMessage, "Undefined variable");
+            stop_on_error();
         }
-        case NODE_EXPRESSION: {
-            int left = eval_expression(node->data.assign.left, context);
-            int right = eval_expression(node->data.assign.right, context);
-            switch (node->data.assign.op) {
-                case '+':
-                    return left + right;
-                case '-':
-                    return left - right;
-                case '*':
-                    return left * right;
-                case '/':
-                    if (right == 0) {
-                        fprintf(stderr, "Error: Division by zero\n");
-                        context->errorCount++;
-                        strcpy(context->lastErrorMessage, "Division by zero");
-                        exit(1);
-                    }
-                    return left / right;
-                default:
-                    fprintf(stderr, "Error: Unknown operator '%c'\n", node->data.assign.op);
-                    context->errorCount++;
-                    strcpy(context->lastErrorMessage, "Unknown operator in expression");
-                    exit(1);
-            }
+    }
+
+    if (node->type == NODE_EXPRESSION) {
+        int leftValue = eval_expression(node->data.assign.left, context);
+        int rightValue = eval_expression(node->data.assign.right, context);
+        switch (node->data.assign.op) {
+            case '>':
+                return leftValue > rightValue;
+            case '<':
+                return leftValue < rightValue;
+            case '>=':
+                return leftValue >= rightValue;
+            case '<=':
+                return leftValue <= rightValue;
+            case '==':
+                return leftValue == rightValue;
+            case '!=':
+                return leftValue != rightValue;
+            default:
+                fprintf(stderr, "Error: Unknown operator '%c' in condition\n", node->data.assign.op);
+                context->errorCount++;
+                strcpy(context->lastErrorMessage, "Unknown operator in condition");
+                stop_on_error();
         }
-        default:
-            fprintf(stderr, "Error: Unknown expression type %d\n", node->type);
-            context->errorCount++;
-            strcpy(context->lastErrorMessage, "Unknown expression type");
-            exit(1);
     }
+
+    fprintf(stderr, "Error: Invalid node type in condition\n");
+    context->errorCount++;
+    strcpy(context->lastErrorMessage, "Invalid node type in condition");
+    stop_on_error();
+}
+
+int eval_expression_helper(const Token* tokens, int* index, Context* context) {
+    int result = 0;
+    int current_value = 0;
+    int operand_set = 0;
+    char current_operator = '+';
+
+    for (;;) {
+        Token token = next_token(tokens, index);
+
+        if (token.type == TOKEN_INTEGER) {
+            current_value = token.number;
+            operand_set = 1;
+        } else if (token.type == TOKEN_IDENTIFIER) {
+            int slot = find_variable(context, token.value);
+            if (slot >= 0) {
+                current_value = context->variables.isInteger[slot] ? context->variables.ints[slot]
+                                                                   : parse_integer(variable_text(context, slot));
+                operand_set = 1;
+            } else {
+                fprintf(stderr, "Error: Undefined variable '%s'\n", token.value);
+                stop_on_error();
+            }
+        } else if (token.type == TOKEN_LEFT_PAREN) {
+            current_value = eval_expression_helper(tokens, index, context);
+            operand_set = 1;
+        } else if (token.type == TOKEN_RIGHT_PAREN) {
+            break;
+        } else if (token.type == TOKEN_OPERATOR) {
+            if (!operand_set) {
+                fprintf(stderr, "Error: Expected operand before operator '%c'\n", token.value[0]);
+                stop_on_error();
+            }
+            if (current_operator == '+') {
+                result += current_value;
+            } else if (current_operator == '-') {
+                result -= current_value;
+            } else if (current_operator == '*') {
+                result *= current_value;
+            } else if (current_operator == '/') {
+                result = divide(result, current_value, context);
+            }
+            current_operator = token.value[0];
+            operand_set = 0;
+        } else if (token.type == TOKEN_END_OF_LINE || token.type == TOKEN_END_OF_FILE) {
+            break;
+        } else {
+            fprintf(stderr, "Error: Unexpected '%s' in expression\n", token.value);
+            stop_on_error();
+        }
+    }
+
+    if (operand_set) {
+        if (current_operator == '+') {
+            result += current_value;
+        } else if (current_operator == '-') {
+            result -= current_value;
+        } else if (current_operator == '*') {
+            result *= current_value;
+        } else if (current_operator == '/') {
+            result = divide(result, current_value, context);
+        }
+    }
+
+    return result;
+}
+
+void eval(ASTNode* node, Context* context) {
+    switch (node->type) {
+        case NODE_INT:
+            context->result.intValue = node->data.intValue;
+            context->result.isInteger = 1;
+            break;
+        case NODE_STRING:
+            strcpy(context->result.stringValue, node->data.stringValue);
+            context->result.isInteger = 0;
+            break;
+        case NODE_VAR: {
+            int slot = find_variable(context, node->data.varName);
+            if (slot >= 0) {
+                if (context->variables.isInteger[slot]) {
+                    context->result.intValue = context->variables.ints[slot];
+                    context->result.isInteger = 1;
+                } else {
+                    strcpy(context->result.stringValue, variable_text(context, slot));
+                    context->result.isInteger = 0;
+                }
+            } else {
+                fprintf(stderr, "Error: Undefined variable '%s'\n", node->data.varName);
+                context->errorCount++;
+                strcpy(context->lastErrorMessage, "Undefined variable");
+                stop_on_error();
+            }
+            break;
+        }
+        case NODE_ASSIGN:
+            eval(node->data.assign.right, context);
+            if (context->result.isInteger) {
+                set_int_variable(context, node->data.assign.left->data.varName, context->result.intValue);
+            } else {
+                set_text_variable(context, node->data.assign.left->data.varName, context->result.stringValue);
+            }
+            break;
+        case NODE_WRITE:
+            eval(node->data.assign.right, context);
+            if (context->result.isInteger) {
+                write_integer(context->result.intValue);
+            } else {
+                write_output(context->result.stringValue, strlen(context->result.stringValue));
+            }
+            break;
+        case NODE_READ: {
+            char input[MAX_STRING_LENGTH + 1];
+            if (!read_input_line(input, sizeof(input))) {
+                input[0] = '\0';
+            }
+            input[strcspn(input, "\n")] = '\0';
+            set_text_variable(context, node->data.varName, input);
+            break;
+        }
+        case NODE_NEWLINE:
+            write_output("\n", 1);
+            break;
+        case NODE_LOOP:
+            eval_loop(node, context);
+            break;
+        case NODE_BLOCK: {
+            ASTNode* stmt = node->data.block;
+            while (stmt) {
+                eval(stmt, context);
+                stmt = stmt->next;
+            }
+            break;
+        }
+        case NODE_EXPRESSION:
+            context->result.intValue = eval_expression(node, context);
+            context->result.isInteger = 1;
+            break;
+        default:
+            fprintf(stderr, "Error: Unknown node type %d\n", node->type);
+            context->errorCount++;
+            strcpy(context->lastErrorMessage, "Unknown node type");
+            stop_on_error();
+    }
+}
+
+int eval_expression(ASTNode* node, Context* context) {
+    switch (node->type) {
+        case NODE_INT:
+            return node->data.intValue;
+        case NODE_VAR: {
+            int slot = find_variable(context, node->data.varName);
+            if (slot >= 0 && context->variables.isInteger[slot]) {
+                return context->variables.ints[slot];
+            } else {
+                fprintf(stderr, "Error: Variable '%s' is not an integer\n", node->data.varName);
+                context->errorCount++;
+                strcpy(context->lastErrorMessage, "Variable is not an integer");
+                stop_on_error();
+            }
+        }
+        case NODE_EXPRESSION: {
+            int left = eval_expression(node->data.assign.left, context);
+            int right = eval_expression(node->data.assign.right, context);
+            switch (node->data.assign.op) {
+                case '+':
+                    return left + right;
+                case '-':
+                    return left - right;
+                case '*':
+                    return left * right;
+                case '/':
+                    if (right == 0) {
+                        fprintf(stderr, "Error: Division by zero\n");
+                        context->errorCount++;
+                        strcpy(context->lastErrorMessage, "Division by zero");
+                        stop_on_error();
+                    }
+                    return left / right;
+                default:
+                    fprintf(stderr, "Error: Unknown operator '%c'\n", node->data.assign.op);
+                    context->errorCount++;
+                    strcpy(context->lastErrorMessage, "Unknown operator in expression");
+                    stop_on_error();
+            }
+        }
+        default:
+            fprintf(stderr, "Error: Unknown expression type %d\n", node->type);
+            context->errorCount++;
+            strcpy(context->lastErrorMessage, "Unknown expression type");
+            stop_on_error();
+    }
+}
+
+// Token index just past every '{' that is closed, -1 for the others. One pass with a stack
+// of open brackets, so deeply nested bodies are not rescanned for every level.
+int* match_brackets(const TokenStream* scan) {
+    int* closing = allocate(sizeof(int) * scan->tokenCount);
+    int* open = allocate(sizeof(int) * scan->tokenCount);
+    int openCount = 0;
+    for (int i = 0; i < scan->tokenCount; i++) {
+        closing[i] = -1;
+        if (scan->tokens[i].type == TOKEN_LEFT_CURLY_BRACKET) {
+            open[openCount++] = i;
+        } else if (scan->tokens[i].type == TOKEN_RIGHT_CURLY_BRACKET && openCount > 0) {
+            closing[open[--openCount]] = i + 1;
+        }
+    }
+    free(open);
+    return closing;
+}
+
+// Returns the token index just past the statement starting at index, a braced block counts
+// as one statement. Returns -1 if the statement is not terminated.
+// closing is the table of match_brackets.
+int find_statement_end(const Token* tokens, const int* closing, int index) {
+    while (tokens[index].type == TOKEN_KEYWORD && strcmp(tokens[index].value, "loop") == 0) {
+        index++;
+        for (int word = 0; word < 2; word++) {  // Skip the count and 'times'
+            TokenType type = tokens[index].type;
+            if (type == TOKEN_INTEGER || type == TOKEN_IDENTIFIER || type == TOKEN_KEYWORD) index++;
+        }
+    }
+
+    if (tokens[index].type == TOKEN_LEFT_CURLY_BRACKET) {
+        return closing[index];
+    }
+
+    while (tokens[index].type != TOKEN_END_OF_LINE && tokens[index].type != TOKEN_END_OF_FILE) index++;
+    return tokens[index].type == TOKEN_END_OF_LINE ? index + 1 : -1;
+}
+
+// Reads "<count> times" of a loop statement; the count is an integer or an int variable
+int loop_count(const Token* tokens, int* index, Context* context) {
+    Token token = next_token(tokens, index);
+    int count = 0;
+    if (token.type == TOKEN_INTEGER) {
+        count = token.number;
+    } else if (token.type == TOKEN_IDENTIFIER) {
+        int slot = find_variable(context, token.value);
+        if (slot < 0 || !context->variables.isInteger[slot]) {
+            fprintf(stderr, "Error: Loop count '%s' is not an integer variable\n", token.value);
+            stop_on_error();
+        }
+        count = context->variables.ints[slot];
+    } else {
+        fprintf(stderr, "Error: Expected integer for loop count\n");
+        stop_on_error();
+    }
+
+    token = next_token(tokens, index);
+    if (token.type != TOKEN_KEYWORD || strcmp(token.value, "times") != 0) {
+        fprintf(stderr, "Error: Expected 'times' after loop count\n");
+        stop_on_error();
+    }
+    return count;
+}
+
+// A compiled program: the source, its token stream, a flat instruction list where loops
+// become LOOP ... END_LOOP pairs, and the table of top-level statements
+typedef enum {
+    INSTRUCTION_STATEMENT,  // Any statement other than a loop, executed from its tokens
+    INSTRUCTION_READ,       // A read statement, where a server session can wait for input
+    INSTRUCTION_LOOP,       // Pushes a LoopFrame, or skips past its END_LOOP when the count is 0
+    INSTRUCTION_END_LOOP,   // Jumps back to the first body instruction while iterations remain
+    INSTRUCTION_TRAP        // An instruction with a probe attached, see trap_execute
+} InstructionKind;
+
+#define MAX_ACCUMULATORS 16
+
+// Result of the dependence analysis of a loop body, see run_parallel_loop
+typedef struct {
+    int parallel;  // Iterations are independent apart from the accumulators
+    int accumulatorCount;
+    const char* accumulators[MAX_ACCUMULATORS];  // Int variables only changed by "v is v + x."
+} LoopPlan;
+
+typedef struct {
+    InstructionKind kind;
+    int start;  // Token index of the statement, or of the loop count
+    int end;    // Token index just past the statement
+    int jump;   // LOOP: its END_LOOP, END_LOOP: its LOOP
+    LoopPlan* plan;  // LOOP: made the first time the loop runs with --threads
+    int outputOnly;  // LOOP: the body only has write and newLine statements, see materialize_loop
+    int probe;       // TRAP: its entry in Program.probes
+} Instruction;
+
+// A patched instruction, or a loop held serial because its body has probes, see attach_probe
+typedef struct {
+    int pc;
+    InstructionKind kind;  // The kind the trap replaced
+    int flags;             // PROBE_TRACE and PROBE_BREAK, 0 while only held
+    int holds;             // LOOP: probes in its body
+    int outputOnly;        // LOOP: saved while held
+    LoopPlan* plan;
+} Probe;
+
+typedef struct {
+    int start;  // Token indices
+    int end;
+    int firstInstruction;
+} Statement;
+
+typedef struct {
+    char* source;
+    TokenStream scan;
+    Instruction* code;
+    int codeCount;
+    int codeCapacity;
+    Statement* statements;
+    int statementCount;
+    int statementCapacity;
+    int loopNesting;  // Deepest loop nesting of the code, the loop frames a context needs
+    Probe* probes;
+    int probeCount;
+    int probeCapacity;
+} Program;
+
+// Reads a whole STAR file, returns NULL if it cannot be opened
+char* load_source(const char* inputFilePath) {
+    FILE* inputFile = fopen(inputFilePath, "rb");
+    if (!inputFile) {
+        return NULL;
+    }
+
+    size_t sourceLength = 0;
+    size_t sourceCapacity = 4096;
+    char* source = allocate(sourceCapacity);
+    size_t n;
+
+    while ((n = fread(source + sourceLength, 1, sourceCapacity - sourceLength - 1, inputFile)) > 0) {
+        sourceLength += n;
+        if (sourceLength + 1 == sourceCapacity) {
+            sourceCapacity *= 2;
+            source = realloc(source, sourceCapacity);
+            if (source == NULL) {
+                fprintf(stderr, "Memory allocation error\n");
+                exit(1);
+            }
+            STAT_ADD(mallocCalls, 1);
+            STAT_ADD(mallocBytes, sourceCapacity);
+        }
+    }
+    source[sourceLength] = '\0';
+
+    fclose(inputFile);
+    return source;
+}
+
+int emit_instruction(Program* program, InstructionKind kind, int start, int end) {
+    if (program->codeCount == program->codeCapacity) {
+        program->code = grow_table(program->code, &program->codeCapacity, sizeof(Instruction));
+    }
+    Instruction* instruction = &program->code[program->codeCount];
+    instruction->kind = kind;
+    instruction->start = start;
+    instruction->end = end;
+    instruction->jump = -1;
+    instruction->plan = NULL;
+    instruction->outputOnly = 0;
+    instruction->probe = -1;
+    return program->codeCount++;
+}
+
+// A loop whose body is being compiled, see compile_statement
+typedef struct {
+    int loop;    // Its LOOP instruction
+    int end;     // Token index just past the loop statement
+    int braced;  // The body is a block, otherwise a single statement
+    int outputOnly;
+} OpenLoop;
+
+// Compiles the statement at token index, returns the index just past it. Nested loops are kept
+// on a stack of open loops instead of the C stack, so nesting depth is only limited by memory.
+// A loop whose header does not parse stays a plain statement, so the error is reported when
+// it is reached.
+int compile_statement(Program* program, const int* closing, int index) {
+    const Token* tokens = program->scan.tokens;
+    OpenLoop* open = NULL;
+    int openCount = 0;
+    int openCapacity = 0;
+
+    for (;;) {
+        int end;
+        if (openCount > 0 && !open[openCount - 1].braced) {
+            end = open[openCount - 1].end;  // A body without braces ends with its loop
+        } else {
+            end = find_statement_end(tokens, closing, index);
+            if (end < 0) {
+                end = program->scan.tokenCount - 1;  // Unterminated, executing it reports the error
+            }
+        }
+        int done = end;  // Just past what was compiled last
+
+        int body = index + 1;
+        int isLoop = 0;
+        if (tokens[index].type == TOKEN_KEYWORD && strcmp(tokens[index].value, "loop") == 0) {
+            Token count = next_token(tokens, &body);
+            Token times = next_token(tokens, &body);
+            isLoop = (count.type == TOKEN_INTEGER || count.type == TOKEN_IDENTIFIER) &&
+                     times.type == TOKEN_KEYWORD && strcmp(times.value, "times") == 0 && body < end;
+        }
+
+        if (isLoop) {
+            if (openCount == openCapacity) {
+                open = grow_table(open, &openCapacity, sizeof(OpenLoop));
+            }
+            OpenLoop* loop = &open[openCount++];
+            loop->loop = emit_instruction(program, INSTRUCTION_LOOP, index + 1, end);
+            loop->end = end;
+            loop->braced = tokens[body].type == TOKEN_LEFT_CURLY_BRACKET;
+            loop->outputOnly = 1;
+            if (openCount > program->loopNesting) {
+                program->loopNesting = openCount;
+            }
+            if (!loop->braced) {
+                index = body;
+                continue;
+            }
+            done = body + 1;
+        } else {
+            int isRead = tokens[index].type == TOKEN_KEYWORD && strcmp(tokens[index].value, "read") == 0;
+            emit_instruction(program, isRead ? INSTRUCTION_READ : INSTRUCTION_STATEMENT, index, end);
+            if (openCount > 0 && !(tokens[index].type == TOKEN_KEYWORD && (strcmp(tokens[index].value, "write") == 0 ||
+                                                                           strcmp(tokens[index].value, "newLine") == 0))) {
+                open[openCount - 1].outputOnly = 0;
+            }
+        }
+
+        // Close the loops whose bodies are complete, a block runs up to its closing '}'
+        while (openCount > 0 && !(open[openCount - 1].braced && done < open[openCount - 1].end - 1)) {
+            OpenLoop* loop = &open[--openCount];
+            int endLoop = emit_instruction(program, INSTRUCTION_END_LOOP, loop->end, loop->end);
+            program->code[endLoop].jump = loop->loop;
+            program->code[loop->loop].jump = endLoop;
+            program->code[loop->loop].outputOnly = loop->outputOnly;
+            if (openCount > 0 && !loop->outputOnly) {
+                open[openCount - 1].outputOnly = 0;
+            }
+            done = loop->end;
+        }
+        if (openCount == 0) {
+            free(open);
+            return done;
+        }
+        index = done;
+    }
+}
+
+// Compiles the token stream from token index from on, appending top-level statements and their code
+void compile_program(Program* program, int from) {
+    int* closing = match_brackets(&program->scan);
+    int index = from;
+
+    while (program->scan.tokens[index].type != TOKEN_END_OF_FILE) {
+        if (program->statementCount == program->statementCapacity) {
+            program->statements = grow_table(program->statements, &program->statementCapacity, sizeof(Statement));
+        }
+        Statement* statement = &program->statements[program->statementCount++];
+        statement->start = index;
+        statement->firstInstruction = program->codeCount;
+        index = compile_statement(program, closing, index);
+        statement->end = index;
+    }
+    free(closing);
+}
+
+// Drops top-level statements from statement on, with their code
+void truncate_program(Program* program, int statement) {
+    if (statement < program->statementCount) {
+        for (int pc = program->statements[statement].firstInstruction; pc < program->codeCount; pc++) {
+            free(program->code[pc].plan);
+        }
+        program->codeCount = program->statements[statement].firstInstruction;
+        program->statementCount = statement;
+    }
+}
+
+void detach_probes(Program* program);
+
+void free_program(Program* program) {
+    detach_probes(program);
+    free(program->probes);
+    truncate_program(program, 0);
+    free(program->source);
+    free_token_stream(&program->scan);
+    free(program->code);
+    free(program->statements);
+    memset(program, 0, sizeof(*program));
+}
+
+int statement_line(Program* program, int statement) {
+    return program->scan.tokens[program->statements[statement].start].line;
+}
+
+void checkpoint_poll(Context* context);
+long long checkpointPollAt = -1;  // statementCount at which checkpoint_poll runs next, -1 when off
+_Thread_local long long sliceEnd = LLONG_MAX;  // context_fuel at which execute_program yields, see --fuel
+
+// What a slice is charged: every statement and every loop back-edge, so a loop with an
+// empty body uses fuel too
+long long context_fuel(const Context* context) {
+    return context->statementCount + context->backEdges;
+}
+#ifdef __linux__
+int session_input_ready(Program* program, Instruction* instruction, Context* context);
+#endif
+
+void execute_program(Program* program, Context* context, int end);
+
+// Tracing and breakpoints (--trace LINE, --break LINE). A probe costs nothing while it is
+// off: attaching one patches its instruction into INSTRUCTION_TRAP, the replaced kind kept
+// in Program.probes, and detaching writes the kind back. Only trapped instructions reach
+// trap_execute, which records events around the original instruction or stops at a
+// breakpoint. Loops around a probe are held serial, neither materialized nor split across
+// threads, so that every iteration passes the trap. Probes are attached and detached
+// between runs of execute_program. Events go to a ring of fixed-size records in a
+// memory-mapped file, see trace_open; a full ring overwrites its oldest events, so the
+// file keeps the most recent part of a long trace. --trace-decode prints it as text.
+#define PROBE_TRACE 1
+#define PROBE_BREAK 2
+#define MAX_PROBE_LINES 64
+#define TRACE_MAGIC 0x4543525452415453ULL  // "STARTRCE"
+#define TRACE_DEFAULT_EVENTS 65536
+
+typedef enum {
+    TRACE_STATEMENT,   // A traced instruction is about to run; token is its first token
+    TRACE_INT_WRITE,   // token names the variable, value is the new value
+    TRACE_TEXT_WRITE,  // value is the new length
+    TRACE_LOOP_ENTER,  // value is the count
+    TRACE_LOOP_EXIT,
+    TRACE_OUTPUT,      // value is the bytes the statement wrote
+    TRACE_BREAK
+} TraceEventKind;
+
+typedef struct {
+    long long statement;  // Statements executed when it happened
+    long long value;
+    int token;  // Token index, for the line and the variable name when decoding
+    int kind;
+} TraceEvent;
+
+typedef struct {
+    unsigned long long magic;
+    unsigned long long sourceHash;
+    long long capacity;  // Events the ring holds
+    long long written;   // Events ever written, the newest is at (written - 1) % capacity
+    TraceEvent events[];
+} TraceFile;
+
+// Probes and ring the command line asks for, see trace_start
+typedef struct {
+    const char* path;
+    long long events;
+    int lines[MAX_PROBE_LINES];
+    int flags[MAX_PROBE_LINES];
+    int lineCount;
+} TraceOptions;
+
+TraceOptions traceOptions;
+TraceFile* traceFile;  // NULL when no ring is open
+size_t traceFileSize;
+void (*breakpointHook)(Program* program, Context* context, int pc);
+
+void trace_event(int kind, int token, long long value, const Context* context) {
+    if (!traceFile) {
+        return;
+    }
+    TraceEvent* event = &traceFile->events[traceFile->written % traceFile->capacity];
+    event->statement = context->statementCount;
+    event->value = value;
+    event->token = token;
+    event->kind = kind;
+    traceFile->written++;
+}
+
+// The probe table entry for pc, created when create is set; -1 if there is none
+int find_probe(Program* program, int pc, int create) {
+    for (int i = 0; i < program->probeCount; i++) {
+        if (program->probes[i].pc == pc) {
+            return i;
+        }
+    }
+    if (!create) {
+        return -1;
+    }
+    if (program->probeCount == program->probeCapacity) {
+        program->probes = grow_table(program->probes, &program->probeCapacity, sizeof(Probe));
+    }
+    Probe* probe = &program->probes[program->probeCount];
+    memset(probe, 0, sizeof(*probe));
+    probe->pc = pc;
+    probe->kind = program->code[pc].kind;
+    return program->probeCount++;
+}
+
+// Holds (delta 1) or releases (delta -1) every loop whose LOOP..END_LOOP range covers pc
+void hold_loops(Program* program, int pc, int delta) {
+    for (int loop = 0; loop < program->codeCount; loop++) {
+        Instruction* instruction = &program->code[loop];
+        InstructionKind kind = instruction->kind == INSTRUCTION_TRAP ? program->probes[instruction->probe].kind
+                                                                      : instruction->kind;
+        if (kind != INSTRUCTION_LOOP || pc < loop || pc > instruction->jump) {
+            continue;
+        }
+        Probe* probe = &program->probes[find_probe(program, loop, 1)];
+        if (delta > 0 && probe->holds++ == 0) {
+            probe->outputOnly = instruction->outputOnly;
+            probe->plan = instruction->plan;
+            instruction->outputOnly = 0;
+            instruction->plan = allocate(sizeof(LoopPlan));
+            memset(instruction->plan, 0, sizeof(LoopPlan));  // Not parallel
+        } else if (delta < 0 && --probe->holds == 0) {
+            free(instruction->plan);
+            instruction->plan = probe->plan;
+            instruction->outputOnly = probe->outputOnly;
+        }
+    }
+}
+
+// Adds flags to the probe of the instruction at pc, patching it into a trap
+void attach_probe(Program* program, int pc, int flags) {
+    int index = find_probe(program, pc, 1);
+    Probe* probe = &program->probes[index];
+    if (probe->flags == 0) {
+        program->code[pc].kind = INSTRUCTION_TRAP;
+        program->code[pc].probe = index;
+        hold_loops(program, pc, 1);
+        probe = &program->probes[index];  // hold_loops may have grown the table
+    }
+    probe->flags |= flags;
+}
+
+// Removes flags from the probe at pc; the last one restores the instruction
+void detach_probe(Program* program, int pc, int flags) {
+    int index = find_probe(program, pc, 0);
+    if (index < 0 || program->probes[index].flags == 0) {
+        return;
+    }
+    Probe* probe = &program->probes[index];
+    probe->flags &= ~flags;
+    if (probe->flags == 0) {
+        program->code[pc].kind = probe->kind;
+        program->code[pc].probe = -1;
+        hold_loops(program, pc, -1);
+    }
+}
+
+void detach_probes(Program* program) {
+    for (int i = 0; i < program->probeCount; i++) {
+        detach_probe(program, program->probes[i].pc, PROBE_TRACE | PROBE_BREAK);
+    }
+    program->probeCount = 0;
+}
+
+// Attaches flags to every instruction that starts on line; a traced loop traps its whole
+// body as well. Returns the number of instructions found on the line.
+int attach_line(Program* program, int line, int flags) {
+    const Token* tokens = program->scan.tokens;
+    int found = 0;
+    for (int pc = 0; pc < program->codeCount; pc++) {
+        Instruction* instruction = &program->code[pc];
+        int probe = instruction->kind == INSTRUCTION_TRAP ? instruction->probe : -1;
+        InstructionKind kind = probe >= 0 ? program->probes[probe].kind : instruction->kind;
+        // A LOOP starts at its count token, the keyword is the token before it
+        int first = kind == INSTRUCTION_LOOP ? instruction->start - 1 : instruction->start;
+        if (kind == INSTRUCTION_END_LOOP || tokens[first].line != line) {
+            continue;
+        }
+        found++;
+        attach_probe(program, pc, flags);
+        if (kind == INSTRUCTION_LOOP && (flags & PROBE_TRACE)) {
+            for (int body = pc + 1; body <= program->code[pc].jump; body++) {
+                attach_probe(program, body, PROBE_TRACE);
+            }
+        }
+    }
+    return found;
+}
+
+// Events for the variables a statement has just written
+void trace_writes(const Token* tokens, Instruction* instruction, InstructionKind kind, Context* context) {
+    int from = instruction->start;
+    int to = instruction->end;
+    const Token* first = &tokens[from];
+    if (kind == INSTRUCTION_READ) {
+        from = to - 1;
+        while (from > instruction->start && tokens[from].type != TOKEN_IDENTIFIER) from--;
+        to = from + 1;
+    } else if (first->type == TOKEN_IDENTIFIER) {
+        to = from + 1;
+    } else if (!(first->type == TOKEN_KEYWORD && (strcmp(first->value, "int") == 0 || strcmp(first->value, "text") == 0))) {
+        return;
+    }
+    for (int i = from; i < to; i++) {
+        if (tokens[i].type != TOKEN_IDENTIFIER || (i > 0 && tokens[i - 1].type == TOKEN_KEYWORD &&
+                                                   strcmp(tokens[i - 1].value, "is") == 0)) {
+            continue;  // Not a variable, or the value of a declaration
+        }
+        int slot = find_variable(context, tokens[i].value);
+        if (slot >= 0 && context->variables.isInteger[slot]) {
+            trace_event(TRACE_INT_WRITE, i, context->variables.ints[slot], context);
+        } else if (slot >= 0) {
+            trace_event(TRACE_TEXT_WRITE, i, strlen(variable_text(context, slot)), context);
+        }
+    }
+}
+
+// Runs a trapped instruction. Statements and reads run here, with their events around them;
+// for LOOP and END_LOOP the events are recorded and 0 is returned, so that execute_program
+// runs the original kind.
+int trap_execute(Program* program, Context* context) {
+    Instruction* instruction = &program->code[context->pc];
+    Probe* probe = &program->probes[instruction->probe];
+    InstructionKind kind = probe->kind;
+    const Token* tokens = program->scan.tokens;
+    int first = kind == INSTRUCTION_LOOP ? instruction->start - 1 : instruction->start;
+
+    if (probe->flags & PROBE_BREAK) {
+        trace_event(TRACE_BREAK, first, 0, context);
+        if (breakpointHook) {
+            breakpointHook(program, context, context->pc);
+        }
+    }
+    int traced = probe->flags & PROBE_TRACE;
+    if (kind == INSTRUCTION_LOOP) {
+        if (traced) {
+            int index = instruction->start;
+            trace_event(TRACE_STATEMENT, first, 0, context);
+            trace_event(TRACE_LOOP_ENTER, first, loop_count(tokens, &index, context), context);
+        }
+        return 0;
+    }
+    if (kind == INSTRUCTION_END_LOOP) {
+        if (traced && (context->loopStack[context->loopDepth - 1].remaining <= 1 || speculationFailed)) {
+            trace_event(TRACE_LOOP_EXIT, program->code[instruction->jump].start - 1, 0, context);
+        }
+        return 0;
+    }
+#ifdef __linux__
+    if (kind == INSTRUCTION_READ && currentSession) {
+        return 0;  // The session may have to wait for input, see --serve
+    }
+#endif
+    if (traced) {
+        trace_event(TRACE_STATEMENT, first, 0, context);
+    }
+    long long bytes = threadStats->bytesWritten;
+    int index = instruction->start;
+    execute_statement(tokens, &index, context);
+    context->pc++;
+    if (traced) {
+        trace_writes(tokens, instruction, kind, context);
+        if (threadStats->bytesWritten > bytes) {
+            trace_event(TRACE_OUTPUT, first, threadStats->bytesWritten - bytes, context);
+        }
+    }
+    return 1;
+}
+
+#ifndef _WIN32
+// Parallel loops (--threads N). The first time a loop runs, its body is checked for
+// dependences between iterations: a variable read in the body before the body writes it
+// carries a value from one iteration into the next. Bodies without such variables, apart
+// from int accumulators only changed by "v is v + x.", produce the same effects in every
+// iteration. The first iteration runs on the calling thread, which also surfaces any
+// runtime error the body has. The rest are split across worker threads that write into
+// private buffers, and the buffers are written out in iteration order, so the output is
+// byte-identical to a serial run. Bodies with read, or with anything the analysis does not
+// understand, run serially.
+#define MAX_WORKER_THREADS 64
+#define PARALLEL_MIN_STATEMENTS 100000  // Work left in a loop before it is worth splitting
+#define PARALLEL_ROUND_BYTES (16 * 1024 * 1024)  // Output buffered per round of workers
+
+typedef struct {
+    const char* names[MAX_VARIABLES];
+    int count;
+} NameSet;
+
+int name_set_contains(const NameSet* set, const char* name) {
+    for (int i = 0; i < set->count; i++) {
+        if (strcmp(set->names[i], name) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns 0 when the set is full
+int name_set_add(NameSet* set, const char* name) {
+    if (name_set_contains(set, name)) {
+        return 1;
+    }
+    if (set->count == MAX_VARIABLES) {
+        return 0;
+    }
+    set->names[set->count++] = name;
+    return 1;
+}
+
+typedef struct {
+    NameSet written;
+    NameSet exposed;    // Read before the body writes them
+    NameSet operands;   // Added to accumulators
+} BodyAccesses;
+
+int note_read(BodyAccesses* accesses, const char* name) {
+    return name_set_contains(&accesses->written, name) || name_set_add(&accesses->exposed, name);
+}
+
+// Records the variables one statement of a loop body reads and writes. Returns 0 for
+// statements that rule out parallel execution.
+int analyze_statement(const Token* tokens, int start, int end, BodyAccesses* accesses, LoopPlan* plan) {
+    const Token* first = &tokens[start];
+
+    if (first->type == TOKEN_KEYWORD && (strcmp(first->value, "int") == 0 || strcmp(first->value, "text") == 0)) {
+        for (int i = start + 1; i < end; i++) {
+            if (tokens[i].type == TOKEN_IDENTIFIER && !name_set_add(&accesses->written, tokens[i].value)) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (first->type == TOKEN_KEYWORD && strcmp(first->value, "write") == 0) {
+        for (int i = start + 1; i < end; i++) {
+            if (tokens[i].type == TOKEN_IDENTIFIER && !note_read(accesses, tokens[i].value)) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (first->type == TOKEN_KEYWORD && strcmp(first->value, "newLine") == 0) {
+        return 1;
+    }
+    if (first->type != TOKEN_IDENTIFIER || end - start < 2) {
+        return 0;  // read, or a statement that is an error anyway
+    }
+    if (tokens[start + 1].type == TOKEN_STRING) {
+        return name_set_add(&accesses->written, first->value);
+    }
+    if (tokens[start + 1].type != TOKEN_KEYWORD || strcmp(tokens[start + 1].value, "is") != 0) {
+        return 0;
+    }
+
+    // "v is v + x." or "v is x + v." with x a constant or another variable
+    int rhs = start + 2;
+    if (end - rhs == 4 && tokens[rhs + 1].type == TOKEN_OPERATOR && tokens[rhs + 1].value[0] == '+' &&
+        tokens[rhs + 3].type == TOKEN_END_OF_LINE) {
+        const Token* operand = NULL;
+        if (tokens[rhs].type == TOKEN_IDENTIFIER && strcmp(tokens[rhs].value, first->value) == 0) {
+            operand = &tokens[rhs + 2];
+        } else if (tokens[rhs + 2].type == TOKEN_IDENTIFIER && strcmp(tokens[rhs + 2].value, first->value) == 0) {
+            operand = &tokens[rhs];
+        }
+        if (operand && (operand->type == TOKEN_INTEGER ||
+                        (operand->type == TOKEN_IDENTIFIER && strcmp(operand->value, first->value) != 0))) {
+            int known = 0;
+            for (int i = 0; i < plan->accumulatorCount; i++) {
+                known |= strcmp(plan->accumulators[i], first->value) == 0;
+            }
+            if (!known) {
+                if (plan->accumulatorCount == MAX_ACCUMULATORS) {
+                    return 0;
+                }
+                plan->accumulators[plan->accumulatorCount++] = first->value;
+            }
+            return operand->type == TOKEN_INTEGER ||
+                   (note_read(accesses, operand->value) && name_set_add(&accesses->operands, operand->value));
+        }
+    }
+
+    for (int i = rhs; i < end; i++) {
+        if (tokens[i].type == TOKEN_IDENTIFIER && !note_read(accesses, tokens[i].value)) {
+            return 0;
+        }
+    }
+    return name_set_add(&accesses->written, first->value);
+}
+
+// Decides whether the iterations of the loop at instruction loop can run in parallel
+LoopPlan* analyze_loop(Program* program, int loop) {
+    LoopPlan* plan = allocate(sizeof(LoopPlan));
+    memset(plan, 0, sizeof(*plan));
+    BodyAccesses* accesses = allocate(sizeof(BodyAccesses));
+    memset(accesses, 0, sizeof(*accesses));
+    const Token* tokens = program->scan.tokens;
+    int independent = 1;
+
+    for (int pc = loop + 1; independent && pc < program->code[loop].jump; pc++) {
+        Instruction* instruction = &program->code[pc];
+        if (instruction->kind == INSTRUCTION_STATEMENT) {
+            independent = analyze_statement(tokens, instruction->start, instruction->end, accesses, plan);
+        } else if (instruction->kind == INSTRUCTION_READ) {
+            independent = 0;
+        } else if (instruction->kind == INSTRUCTION_LOOP && tokens[instruction->start].type == TOKEN_IDENTIFIER) {
+            independent = note_read(accesses, tokens[instruction->start].value);
+        }
+    }
+
+    for (int i = 0; independent && i < accesses->exposed.count; i++) {
+        independent = !name_set_contains(&accesses->written, accesses->exposed.names[i]);
+    }
+    for (int i = 0; independent && i < plan->accumulatorCount; i++) {
+        const char* name = plan->accumulators[i];
+        independent = !name_set_contains(&accesses->written, name) && !name_set_contains(&accesses->exposed, name) &&
+                      !name_set_contains(&accesses->operands, name);
+    }
+    plan->parallel = independent;
+    free(accesses);
+    return plan;
+}
+
+int parallelThreads = 1;
+_Thread_local int parallelWorker;  // Set on worker threads, their loops run serially
+
+// Counters of worker thread t; parallel loops and segments never run at the same time
+Stats* worker_stats(int t) {
+    static Stats* stats[MAX_WORKER_THREADS];
+    if (!stats[t]) {
+        stats[t] = stats_new_block();
+    }
+    return stats[t];
+}
+
+typedef struct {
+    Program* program;
+    Context context;
+    int loop;
+    int iterations;
+    OutputBuffer output;
+    Stats* stats;
+    pthread_t thread;
+} LoopWorker;
+
+void* loop_worker(void* arg) {
+    LoopWorker* worker = arg;
+    threadStats = worker->stats;
+    parallelWorker = 1;
+    outputCapture = &worker->output;
+    int endLoop = worker->program->code[worker->loop].jump;
+    for (int i = 0; i < worker->iterations; i++) {
+        worker->context.pc = worker->loop + 1;
+        execute_program(worker->program, &worker->context, endLoop);
+    }
+    return NULL;
+}
+
+// Runs the loop whose frame was just pushed; context->pc is left on the next instruction
+// to execute, which is the END_LOOP when the loop falls back to serial execution
+void run_parallel_loop(Program* program, Context* context, LoopFrame* frame, LoopPlan* plan) {
+    static LoopWorker* workers;
+    int loop = frame->loop;
+    int endLoop = program->code[loop].jump;
+    int accumulators[MAX_ACCUMULATORS];  // Slots, the same in the worker copies
+    int before[MAX_ACCUMULATORS];
+
+    for (int i = 0; i < plan->accumulatorCount; i++) {
+        accumulators[i] = find_variable(context, plan->accumulators[i]);
+        if (accumulators[i] < 0 || !context->variables.isInteger[accumulators[i]]) {
+            context->pc = loop + 1;
+            return;
+        }
+        before[i] = context->variables.ints[accumulators[i]];
+    }
+
+    long long statements = context->statementCount;
+    long long bytes = threadStats->bytesWritten;
+    context->pc = loop + 1;
+    execute_program(program, context, endLoop);
+    statements = context->statementCount - statements;
+    bytes = threadStats->bytesWritten - bytes;
+
+    // Falling back leaves the END_LOOP to count the first iteration
+    long long remaining = frame->remaining - 1;
+    context->pc = endLoop;
+    if (remaining * statements < PARALLEL_MIN_STATEMENTS) {
+        return;
+    }
+    for (int i = 0; i < plan->accumulatorCount; i++) {
+        long long after = context->variables.ints[accumulators[i]];
+        if (after + remaining * (after - before[i]) > MAX_INTEGER_VALUE) {
+            return;  // Let the serial loop report the overflow where it happens
+        }
+    }
+
+    if (!workers) {
+        workers = allocate(sizeof(LoopWorker) * MAX_WORKER_THREADS);
+        memset(workers, 0, sizeof(LoopWorker) * MAX_WORKER_THREADS);
+    }
+    int threads = parallelThreads;
+    long long perRound = bytes > 0 ? PARALLEL_ROUND_BYTES / bytes : remaining;
+    if (perRound < threads) {
+        perRound = threads;
+    }
+
+    while (remaining > 0) {
+        long long round = remaining < perRound ? remaining : perRound;
+        long long statementBase = context->statementCount;
+        int started = 0;
+        for (int t = 0; t < threads; t++) {
+            LoopWorker* worker = &workers[t];
+            worker->iterations = round / threads + (t < round % threads);
+            if (worker->iterations == 0) {
+                continue;
+            }
+            worker->program = program;
+            copy_context(&worker->context, context);
+            worker->loop = loop;
+            worker->output.length = 0;
+            worker->stats = worker_stats(t);
+            if (pthread_create(&worker->thread, NULL, loop_worker, worker) != 0) {
+                fprintf(stderr, "Error: Could not start a loop worker thread\n");
+                exit(1);
+            }
+            started++;
+        }
+
+        for (int t = 0; t < started; t++) {
+            LoopWorker* worker = &workers[t];
+            pthread_join(worker->thread, NULL);
+            emit_output(worker->output.data, worker->output.length);
+            context->statementCount += worker->context.statementCount - statementBase;
+        }
+        for (int i = 0; i < plan->accumulatorCount; i++) {
+            long long base = context->variables.ints[accumulators[i]];
+            long long total = base;
+            for (int t = 0; t < started; t++) {
+                total += workers[t].context.variables.ints[accumulators[i]] - base;
+            }
+            set_int(context, accumulators[i], check_integer(total, context));
+        }
+        remaining -= round;
+    }
+
+    context->loopDepth--;
+    context->pc = endLoop + 1;
+}
+#endif
+
+// Counters an iteration added since before, added times more
+void stats_repeat(const Stats* before, long long times) {
+    for (int kind = 0; kind < STATEMENT_KIND_COUNT; kind++) {
+        STAT_ADD(statements[kind], (threadStats->statements[kind] - before->statements[kind]) * times);
+    }
+    STAT_ADD(variableLookups, (threadStats->variableLookups - before->variableLookups) * times);
+    STAT_ADD(lookupProbes, (threadStats->lookupProbes - before->lookupProbes) * times);
+    STAT_ADD(textCopies, (threadStats->textCopies - before->textCopies) * times);
+    STAT_ADD(bytesWritten, (threadStats->bytesWritten - before->bytesWritten) * times);
+}
+
+// Runs the loop whose frame was just pushed, for a body that only writes. Nothing the body reads
+// changes, so every iteration writes the same bytes: the first runs normally and reports any
+// error, the second is captured and the rest of the output is copies of it. Statement counts
+// and --stats come out as if every iteration had run.
+void materialize_loop(Program* program, Context* context, int count) {
+    int loop = context->pc;
+    int endLoop = program->code[loop].jump;
+    context->pc = loop + 1;
+    execute_program(program, context, endLoop);
+
+    OutputBuffer iteration = {0};
+    OutputBuffer* capture = outputCapture ? outputCapture : &iteration;
+    OutputBuffer* previous = outputCapture;
+    size_t start = capture->length;
+    Stats before = *threadStats;
+    long long statements = context->statementCount;
+    outputCapture = capture;
+    context->pc = loop + 1;
+    execute_program(program, context, endLoop);
+    outputCapture = previous;
+
+    long long copies = count - 2;
+    context->statementCount += (context->statementCount - statements) * copies;
+    stats_repeat(&before, copies);
+    if (capture == &iteration) {
+        emit_repeated(iteration.data, iteration.length, copies + 1);
+        free(iteration.data);
+    } else {
+        repeat_output(capture, start, copies);
+    }
+    context->loopDepth--;
+    context->pc = endLoop + 1;
+}
+
+// Runs the compiled program from context->pc until pc reaches end, or until context_fuel
+// reaches sliceEnd. The loop counters live in the context, so execution can stop at any
+// instruction boundary and continue later.
+void execute_program(Program* program, Context* context, int end) {
+    reserve_loop_frames(context, program->loopNesting);  // LOOP can push without a check
+
+    while (context->pc < end) {
+        Instruction* instruction = &program->code[context->pc];
+        InstructionKind kind = instruction->kind;
+
+    dispatch:
+        switch (kind) {
+            case INSTRUCTION_TRAP:
+                if (!trap_execute(program, context)) {
+                    kind = program->probes[instruction->probe].kind;
+                    goto dispatch;
+                }
+                break;
+            case INSTRUCTION_READ:
+#ifdef __linux__
+                if (currentSession && !session_input_ready(program, instruction, context)) {
+                    return;  // Parked until the client sends a line, see --serve
+                }
+#endif
+                // fall through
+            case INSTRUCTION_STATEMENT: {
+                int index = instruction->start;
+                execute_statement(program->scan.tokens, &index, context);
+                context->pc++;
+                break;
+            }
+            case INSTRUCTION_LOOP: {
+                context->statementCount++;
+                STAT_ADD(statements[STATEMENT_LOOP], 1);
+                int index = instruction->start;
+                int count = loop_count(program->scan.tokens, &index, context);
+                context->loopCount = count;
+                if (count <= 0) {
+                    context->pc = instruction->jump + 1;
+                    break;
+                }
+                LoopFrame* frame = &context->loopStack[context->loopDepth++];
+                frame->loop = context->pc;
+                frame->remaining = count;
+                if (context->loopDepth > context->maxLoopDepth) {
+                    context->maxLoopDepth = context->loopDepth;
+                }
+                // Slices and checkpoints need every iteration to pass through END_LOOP
+                if (instruction->outputOnly && count > 2 && sliceEnd == LLONG_MAX && checkpointPollAt < 0) {
+                    materialize_loop(program, context, count);
+                    break;
+                }
+#ifndef _WIN32
+                if (parallelThreads > 1 && count > 1 && !parallelWorker && checkpointPollAt < 0) {
+                    if (!instruction->plan) {
+                        instruction->plan = analyze_loop(program, context->pc);
+                    }
+                    if (instruction->plan->parallel) {
+                        run_parallel_loop(program, context, frame, instruction->plan);
+                        break;
+                    }
+                }
+#endif
+                context->pc++;
+                break;
+            }
+            case INSTRUCTION_END_LOOP: {
+                LoopFrame* frame = &context->loopStack[context->loopDepth - 1];
+                if (--frame->remaining > 0 && !speculationFailed) {
+                    context->backEdges++;
+                    context->pc = frame->loop + 1;
+                } else {
+                    context->loopDepth--;
+                    context->pc++;
+                }
+                break;
+            }
+        }
+
+        if (checkpointPollAt >= 0 && context->statementCount >= checkpointPollAt) {
+            checkpoint_poll(context);
+        }
+        if (context_fuel(context) >= sliceEnd) {
+            return;
+        }
+    }
+}
+
+// Returns the instruction just past top-level statement statement
+int statement_end_pc(Program* program, int statement) {
+    return statement + 1 < program->statementCount ? program->statements[statement + 1].firstInstruction
+                                                   : program->codeCount;
+}
+
+#ifndef _WIN32
+// Dataflow scheduling of top-level statements (--threads N). A segment is a run of
+// statements that can only fail through integer overflow or division by zero; read and
+// anything else end it and run serially. Within a segment, statements that share a
+// variable one of them writes are chained together. Chains touch disjoint variables, so
+// they run concurrently, each worker thread on a private copy of the context, and each
+// statement writes into its own buffer. The buffers are written out in program order and
+// the written variables copied back. If a chain does fail, the segment's results are
+// dropped and it runs again serially, so the error and the output before it come out in
+// order.
+#define MAX_SEGMENT_STATEMENTS 256
+
+typedef struct {
+    const char* name;
+    int statement;  // Within the segment
+    int write;
+} Access;
+
+// The type of every variable at some point of the segment, -1 for undeclared names
+typedef struct {
+    const char* names[MAX_VARIABLES];
+    int isInteger[MAX_VARIABLES];
+    int count;
+} TypeEnvironment;
+
+typedef struct {
+    int first;  // First statement of the segment
+    int count;
+    TypeEnvironment types;
+    Access* accesses;
+    int accessCount;
+    int accessCapacity;
+    int chain[MAX_SEGMENT_STATEMENTS];  // Union-find parent, the root identifies the chain
+    long long cost[MAX_SEGMENT_STATEMENTS];  // Estimated statements executed, summed at the root
+    int thread[MAX_SEGMENT_STATEMENTS];  // Worker of each chain root
+    OutputBuffer outputs[MAX_SEGMENT_STATEMENTS];
+} Segment;
+
+int type_of(const TypeEnvironment* types, const char* name) {
+    for (int i = types->count - 1; i >= 0; i--) {
+        if (strcmp(types->names[i], name) == 0) {
+            return types->isInteger[i];
+        }
+    }
+    return -1;
+}
+
+// Returns 0 when the variable table would overflow
+int declare_type(TypeEnvironment* types, const char* name, int isInteger) {
+    for (int i = 0; i < types->count; i++) {
+        if (strcmp(types->names[i], name) == 0) {
+            types->isInteger[i] = isInteger;
+            return 1;
+        }
+    }
+    if (types->count == MAX_VARIABLES) {
+        return 0;
+    }
+    types->names[types->count] = name;
+    types->isInteger[types->count++] = isInteger;
+    return 1;
+}
+
+void note_access(Segment* segment, int statement, const char* name, int write) {
+    if (segment->accessCount == segment->accessCapacity) {
+        segment->accesses = grow_table(segment->accesses, &segment->accessCapacity, sizeof(Access));
+    }
+    Access* access = &segment->accesses[segment->accessCount++];
+    access->name = name;
+    access->statement = statement;
+    access->write = write;
+}
+
+// Mirrors eval_expression_helper, returns 0 if evaluating the expression could fail
+int check_expression(const Token* tokens, int* index, Segment* segment, int statement) {
+    int operandSet = 0;
+    for (;;) {
+        Token token = next_token(tokens, index);
+        if (token.type == TOKEN_INTEGER) {
+            operandSet = 1;
+        } else if (token.type == TOKEN_IDENTIFIER) {
+            if (type_of(&segment->types, token.value) < 0) {
+                return 0;
+            }
+            note_access(segment, statement, token.value, 0);
+            operandSet = 1;
+        } else if (token.type == TOKEN_LEFT_PAREN) {
+            if (!check_expression(tokens, index, segment, statement)) {
+                return 0;
+            }
+            operandSet = 1;
+        } else if (token.type == TOKEN_OPERATOR) {
+            if (!operandSet) {
+                return 0;
+            }
+            operandSet = 0;
+        } else {
+            return token.type == TOKEN_RIGHT_PAREN || token.type == TOKEN_END_OF_LINE || token.type == TOKEN_END_OF_FILE;
+        }
+    }
+}
+
+// A text operand as get_text_operand takes it
+int check_text_operand(Token token, Segment* segment, int statement) {
+    if (token.type == TOKEN_STRING) {
+        return 1;
+    }
+    if (token.type == TOKEN_IDENTIFIER && type_of(&segment->types, token.value) == 0) {
+        note_access(segment, statement, token.value, 0);
+        return 1;
+    }
+    return 0;
+}
+
+// Mirrors execute_statement. Records the variables the statement reads and writes and
+// returns 0 if it reads input or could fail for any reason other than overflow or
+// division by zero. certain is 0 inside loops that may not run, where declarations are
+// not allowed because later statements could not rely on them.
+int check_statement(const Token* tokens, int index, Segment* segment, int statement, int certain) {
+    Token token = next_token(tokens, &index);
+
+    if (token.type == TOKEN_END_OF_LINE) {
+        return 1;
+    }
+    if (token.type == TOKEN_KEYWORD && (strcmp(token.value, "int") == 0 || strcmp(token.value, "text") == 0)) {
+        int isInteger = token.value[0] == 'i';
+        int declared = 0;
+        while ((token = next_token(tokens, &index)).type != TOKEN_END_OF_LINE && token.type != TOKEN_END_OF_FILE) {
+            if (token.type == TOKEN_IDENTIFIER) {
+                if (!certain || !declare_type(&segment->types, token.value, isInteger)) {
+                    return 0;
+                }
+                note_access(segment, statement, token.value, 1);
+                declared = 1;
+            } else if (token.type == TOKEN_KEYWORD && strcmp(token.value, "is") == 0 && declared) {
+                token = next_token(tokens, &index);
+                if (token.type != (isInteger ? TOKEN_INTEGER : TOKEN_STRING) || (isInteger && token.number > MAX_INTEGER_VALUE)) {
+                    return 0;
+                }
+            } else if (token.type != TOKEN_COMMA) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (token.type == TOKEN_IDENTIFIER) {
+        const char* target = token.value;
+        token = next_token(tokens, &index);
+        if (token.type == TOKEN_STRING) {
+            if (!certain || !declare_type(&segment->types, target, 0)) {
+                return 0;
+            }
+            note_access(segment, statement, target, 1);
+            return 1;
+        }
+        int isInteger = type_of(&segment->types, target);
+        if (token.type != TOKEN_KEYWORD || strcmp(token.value, "is") != 0 || isInteger < 0) {
+            return 0;
+        }
+        if (isInteger) {
+            if (!check_expression(tokens, &index, segment, statement)) {
+                return 0;
+            }
+        } else {
+            if (!check_text_operand(next_token(tokens, &index), segment, statement)) {
+                return 0;
+            }
+            token = next_token(tokens, &index);
+            if (token.type == TOKEN_OPERATOR && (token.value[0] == '+' || token.value[0] == '-')) {
+                if (!check_text_operand(next_token(tokens, &index), segment, statement)) {
+                    return 0;
+                }
+                token = next_token(tokens, &index);
+            }
+            if (token.type != TOKEN_END_OF_LINE) {
+                return 0;
+            }
+        }
+        note_access(segment, statement, target, 1);
+        return 1;
+    }
+    if (token.type == TOKEN_KEYWORD && strcmp(token.value, "write") == 0) {
+        while ((token = next_token(tokens, &index)).type != TOKEN_END_OF_LINE && token.type != TOKEN_END_OF_FILE) {
+            if (token.type == TOKEN_IDENTIFIER) {
+                if (type_of(&segment->types, token.value) < 0) {
+                    return 0;
+                }
+                note_access(segment, statement, token.value, 0);
+            }
+        }
+        return 1;
+    }
+    if (token.type == TOKEN_KEYWORD && strcmp(token.value, "newLine") == 0) {
+        return next_token(tokens, &index).type == TOKEN_END_OF_LINE;
+    }
+    return 0;
+}
+
+// Checks top-level statement statement of the program and estimates its cost
+int check_top_level_statement(Program* program, Context* context, Segment* segment, int statement) {
+    const Token* tokens = program->scan.tokens;
+    int s = statement - segment->first;
+    int certain[MAX_LOOP_DEPTH + 1] = {1};
+    long long repeat[MAX_LOOP_DEPTH + 1] = {1};
+    int depth = 0;
+    segment->cost[s] = 0;
+
+    for (int pc = program->statements[statement].firstInstruction; pc < statement_end_pc(program, statement); pc++) {
+        Instruction* instruction = &program->code[pc];
+        segment->cost[s] += repeat[depth];
+        if (instruction->kind == INSTRUCTION_STATEMENT) {
+            if (!check_statement(tokens, instruction->start, segment, s, certain[depth])) {
+                return 0;
+            }
+        } else if (instruction->kind == INSTRUCTION_READ) {
+            return 0;
+        } else if (instruction->kind == INSTRUCTION_LOOP) {
+            Token count = tokens[instruction->start];
+            long long times = count.number;
+            if (depth == MAX_LOOP_DEPTH - 1) {
+                return 0;
+            }
+            if (count.type == TOKEN_IDENTIFIER) {
+                if (type_of(&segment->types, count.value) != 1) {
+                    return 0;
+                }
+                note_access(segment, s, count.value, 0);
+                int slot = find_variable(context, count.value);
+                times = slot >= 0 && context->variables.isInteger[slot] ? context->variables.ints[slot]
+                                                                        : 1000;  // A guess once it is reassigned
+            }
+            depth++;
+            certain[depth] = certain[depth - 1] && count.type == TOKEN_INTEGER && times > 0;
+            repeat[depth] = repeat[depth - 1] * (times > 0 ? times : 1);
+        } else if (instruction->kind == INSTRUCTION_TRAP) {
+            return 0;  // Probes run serially
+        } else {
+            depth--;
+        }
+    }
+    return 1;
+}
+
+int find_chain(Segment* segment, int s) {
+    while (segment->chain[s] != s) {
+        segment->chain[s] = segment->chain[segment->chain[s]];
+        s = segment->chain[s];
+    }
+    return s;
+}
+
+// Fills segment with the statements from first on that can be scheduled, returns their count
+int plan_segment(Program* program, Context* context, Segment* segment, int first) {
+    segment->first = first;
+    segment->count = 0;
+    segment->accessCount = 0;
+    segment->types.count = 0;
+    for (int i = 0; i < context->variables.count; i++) {
+        declare_type(&segment->types, context->variables.names[i], context->variables.isInteger[i]);
+    }
+
+    while (first + segment->count < program->statementCount && segment->count < MAX_SEGMENT_STATEMENTS) {
+        TypeEnvironment before = segment->types;
+        int accesses = segment->accessCount;
+        if (!check_top_level_statement(program, context, segment, first + segment->count)) {
+            segment->types = before;
+            segment->accessCount = accesses;
+            break;
+        }
+        segment->chain[segment->count] = segment->count;
+        segment->count++;
+    }
+
+    // Statements sharing a variable that one of them writes belong to the same chain
+    for (int a = 0; a < segment->accessCount; a++) {
+        if (!segment->accesses[a].write) {
+            continue;
+        }
+        for (int b = 0; b < segment->accessCount; b++) {
+            if (strcmp(segment->accesses[a].name, segment->accesses[b].name) == 0) {
+                segment->chain[find_chain(segment, segment->accesses[b].statement)] =
+                    find_chain(segment, segment->accesses[a].statement);
+            }
+        }
+    }
+    return segment->count;
+}
+
+typedef struct {
+    Program* program;
+    Segment* segment;
+    Context context;
+    int thread;
+    Stats* stats;
+    int failed;
+    pthread_t handle;
+} SegmentWorker;
+
+void* segment_worker(void* arg) {
+    SegmentWorker* worker = arg;
+    Segment* segment = worker->segment;
+    threadStats = worker->stats;
+    parallelWorker = 1;
+    speculative = 1;
+    speculationFailed = 0;
+
+    for (int s = 0; s < segment->count && !speculationFailed; s++) {
+        if (segment->thread[find_chain(segment, s)] != worker->thread) {
+            continue;
+        }
+        int statement = segment->first + s;
+        outputCapture = &segment->outputs[s];
+        worker->context.pc = worker->program->statements[statement].firstInstruction;
+        execute_program(worker->program, &worker->context, statement_end_pc(worker->program, statement));
+    }
+    worker->failed = speculationFailed;
+    return NULL;
+}
+
+// Runs a planned segment on worker threads. Returns 0, leaving context untouched, when
+// it is not worth it or a chain failed.
+int run_segment(Program* program, Context* context, Segment* segment) {
+    static SegmentWorker* workers;
+    long long load[MAX_WORKER_THREADS] = {0};
+    int heavyChains = 0;
+
+    for (int s = 0; s < segment->count; s++) {
+        int root = find_chain(segment, s);
+        if (root != s) {
+            segment->cost[root] += segment->cost[s];
+        }
+    }
+    // Longest chains first, each to the least loaded thread
+    for (int s = 0; s < segment->count; s++) {
+        segment->thread[s] = -1;
+    }
+    for (;;) {
+        int next = -1;
+        for (int s = 0; s < segment->count; s++) {
+            if (find_chain(segment, s) == s && segment->thread[s] < 0 &&
+                (next < 0 || segment->cost[s] > segment->cost[next])) {
+                next = s;
+            }
+        }
+        if (next < 0) {
+            break;
+        }
+        int thread = 0;
+        for (int t = 1; t < parallelThreads; t++) {
+            if (load[t] < load[thread]) thread = t;
+        }
+        segment->thread[next] = thread;
+        load[thread] += segment->cost[next];
+        heavyChains += segment->cost[next] >= PARALLEL_MIN_STATEMENTS;
+    }
+    if (heavyChains < 2) {
+        return 0;
+    }
+
+    if (!workers) {
+        workers = allocate(sizeof(SegmentWorker) * MAX_WORKER_THREADS);
+        memset(workers, 0, sizeof(SegmentWorker) * MAX_WORKER_THREADS);
+    }
+    int threads = 0;
+    for (int t = 0; t < parallelThreads && load[t] > 0; t++) {
+        SegmentWorker* worker = &workers[t];
+        worker->program = program;
+        worker->segment = segment;
+        copy_context(&worker->context, context);
+        worker->thread = t;
+        worker->stats = worker_stats(t);
+        if (pthread_create(&worker->handle, NULL, segment_worker, worker) != 0) {
+            fprintf(stderr, "Error: Could not start a worker thread\n");
+            exit(1);
+        }
+        threads++;
+    }
+    int failed = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].handle, NULL);
+        failed |= workers[t].failed;
+    }
+    if (failed) {
+        for (int s = 0; s < segment->count; s++) {
+            segment->outputs[s].length = 0;
+        }
+        return 0;
+    }
+
+    for (int s = 0; s < segment->count; s++) {
+        emit_output(segment->outputs[s].data, segment->outputs[s].length);
+        segment->outputs[s].length = 0;
+    }
+    long long statements = context->statementCount;
+    for (int t = 0; t < threads; t++) {
+        context->statementCount += workers[t].context.statementCount - statements;
+        if (workers[t].context.maxLoopDepth > context->maxLoopDepth) {
+            context->maxLoopDepth = workers[t].context.maxLoopDepth;
+        }
+    }
+    for (int a = 0; a < segment->accessCount; a++) {
+        Access* access = &segment->accesses[a];
+        if (access->write) {
+            Context* source = &workers[segment->thread[find_chain(segment, access->statement)]].context;
+            int slot = find_variable(source, access->name);
+            if (source->variables.isInteger[slot]) {
+                set_int_variable(context, access->name, source->variables.ints[slot]);
+            } else {
+                set_text_variable(context, access->name, variable_text(source, slot));
+            }
+        }
+    }
+    context->pc = statement_end_pc(program, segment->first + segment->count - 1);
+    return 1;
+}
+
+// run_program with top-level statements scheduled by dataflow
+void run_program_dataflow(Program* program, Context* context, int from) {
+    static Segment* segment;
+    if (!segment) {
+        segment = allocate(sizeof(Segment));
+        memset(segment, 0, sizeof(Segment));
+    }
+
+    int i = from;
+    while (i < program->statementCount) {
+        int count = plan_segment(program, context, segment, i);
+        if (count < 2 || !run_segment(program, context, segment)) {
+            count = count ? count : 1;  // A statement that ends a segment runs on its own
+            context->pc = program->statements[i].firstInstruction;
+            execute_program(program, context, statement_end_pc(program, i + count - 1));
+        }
+        i += count;
+    }
+}
+#endif
+
+// Executes top-level statements from on; with snapshots, the context after statement i is stored at i + 1
+void run_program(Program* program, Context* context, int from, Context* snapshots, int* validSnapshots) {
+#ifndef _WIN32
+    if (parallelThreads > 1 && !snapshots && checkpointPollAt < 0) {
+        run_program_dataflow(program, context, from);
+        return;
+    }
+#endif
+    if (from < program->statementCount) {
+        context->pc = program->statements[from].firstInstruction;
+    }
+    for (int i = from; i < program->statementCount; i++) {
+        execute_program(program, context, statement_end_pc(program, i));
+        if (snapshots) {
+            copy_context(&snapshots[i + 1], context);
+            __atomic_store_n(validSnapshots, i + 2, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+// Hashes the token stream, so edits to comments and layout keep a checkpoint usable
+unsigned long long hash_tokens(const TokenStream* stream) {
+    unsigned long long hash = 14695981039346656037ULL;  // FNV-1a
+    for (int i = 0; i < stream->tokenCount; i++) {
+        hash = (hash ^ stream->tokens[i].type) * 1099511628211ULL;
+        for (const char* value = stream->tokens[i].value; *value; value++) {
+            hash = (hash ^ (unsigned char)*value) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+// Compares two scans of a program token by token
+int same_tokens(const TokenStream* a, const TokenStream* b) {
+    if (a->tokenCount != b->tokenCount) {
+        return 0;
+    }
+    for (int i = 0; i < a->tokenCount; i++) {
+        if (a->tokens[i].type != b->tokens[i].type || strcmp(a->tokens[i].value, b->tokens[i].value) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+const char* lexicalReportPath = NULL;  // --lex-report FILE
+
+// Prints the lexical errors of a scan, and writes them to the report file when one was given.
+// Returns the number of errors.
+int report_diagnostics(const TokenStream* stream) {
+    write_diagnostics(stderr, stream);
+    if (lexicalReportPath) {
+        FILE* report = fopen(lexicalReportPath, "w");
+        if (!report) {
+            fprintf(stderr, "Error: Could not open output file.\n");
+        } else {
+            write_diagnostics(report, stream);
+            fclose(report);
+        }
+    }
+    return stream->diagnosticCount;
+}
+
+// Static cost estimation (--estimate). STAR has no branches and a loop count is a literal or
+// an int variable, so the work of a script follows from its code. The estimator runs the
+// compiled program on abstract values: an int is a range of values, a text a range of
+// lengths plus its content while that is known exactly, and a read gives any value. A loop
+// body runs abstractly once per iteration until it ends in the state it started in; every
+// remaining iteration then costs the same, so the rest is multiplied out. A body that keeps
+// changing the state (a counter, an accumulator) is widened after ESTIMATE_ITERATIONS
+// iterations: the variables that changed get the full range in the direction they moved,
+// and one iteration from that state bounds all the others. A counter whose only updates in
+// the body are `v is v + N.` or `v is v - N.` is not widened to the full range: its steps
+// per iteration bound it to the values the remaining iterations can reach. Once a loop nest
+// has run ESTIMATE_BUDGET abstract statements every loop in it is widened after its next
+// iteration, and a nest that still runs past twice that is given up with no upper bound.
+// Every count comes out as a minimum and a maximum, which are equal when the estimate is exact.
+#define ESTIMATE_ITERATIONS 1024
+#define ESTIMATE_BUDGET 1000000  // Abstract statements per top-level loop
+#define ESTIMATE_UNBOUNDED LLONG_MAX
+
+typedef struct {
+    long long min;
+    long long max;  // ESTIMATE_UNBOUNDED when there is no bound
+} EstimateRange;
+
+typedef struct {
+    EstimateRange statements;  // Counted like Context.statementCount
+    EstimateRange outputBytes;
+    EstimateRange reads;
+    EstimateRange peakTextBytes;  // Largest total length of the text variables at any time
+    int mayFail;  // A runtime error may stop the script; the minimums only count what runs before it
+} Estimate;
+
+typedef struct {
+    const char* name;  // Token value, lives as long as the program
+    int isInteger;
+    int uncertain;     // Whether it exists, or its type, depends on a loop count
+    long long low;     // Int: range of the value. Text: range of the length.
+    long long high;
+    int known;         // Text: the content is exact
+    char text[MAX_TEXT_LENGTH + 1];
+} AbstractVariable;
+
+typedef struct {
+    AbstractVariable* variables;
+    int count;
+    int capacity;
+    long long textLow;  // Sum of the text lengths
+    long long textHigh;
+} AbstractState;
+
+// A counter of a widened loop, see estimate_induction
+typedef struct {
+    const char* name;
+    int exact;  // Only increments and an exact loop count: the value after the loop is known
+    long long exitLow;
+    long long exitHigh;
+} EstimateInduction;
+
+// A loop being estimated, see estimate_program
+typedef struct {
+    int loop;  // Its LOOP instruction
+    long long low;  // Range of its count
+    long long high;
+    long long done;  // Iterations estimated
+    int widened;
+    AbstractState entry;  // State the current iteration started from
+    AbstractState exit;   // Join of the states after low or more iterations
+    int exitSet;
+    Estimate iterationStart;
+    EstimateInduction* inductions;  // Counters bounded by their steps once widened
+    int inductionCount;
+    int inductionCapacity;
+} EstimateLoop;
+
+typedef struct {
+    AbstractState state;
+    Estimate cost;
+    int certain;  // No error can have stopped the script so far
+    long long work;  // Abstract statements run in the current top-level loop
+} Estimator;
+
+long long saturating_add(long long a, long long b) {
+    return a > ESTIMATE_UNBOUNDED - b ? ESTIMATE_UNBOUNDED : a + b;
+}
+
+long long saturating_multiply(long long a, long long b) {
+    return a == 0 || b == 0 ? 0 : a > ESTIMATE_UNBOUNDED / b ? ESTIMATE_UNBOUNDED : a * b;
+}
+
+void estimate_add(Estimator* estimator, EstimateRange* range, long long low, long long high) {
+    range->max = saturating_add(range->max, high);
+    if (estimator->certain) {
+        range->min = saturating_add(range->min, low);
+    }
+}
+
+void estimate_fail(Estimator* estimator) {
+    estimator->cost.mayFail = 1;
+    estimator->certain = 0;
+}
+
+int abstract_find(const AbstractState* state, const char* name) {
+    for (int i = 0; i < state->count; i++) {
+        if (strcmp(state->variables[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void abstract_text_sums(AbstractState* state) {
+    state->textLow = 0;
+    state->textHigh = 0;
+    for (int i = 0; i < state->count; i++) {
+        if (!state->variables[i].isInteger) {
+            state->textLow += state->variables[i].uncertain ? 0 : state->variables[i].low;
+            state->textHigh += state->variables[i].high;
+        }
+    }
+}
+
+void abstract_copy(AbstractState* target, const AbstractState* source) {
+    while (target->capacity < source->count) {
+        target->variables = grow_table(target->variables, &target->capacity, sizeof(AbstractVariable));
+    }
+    memcpy(target->variables, source->variables, sizeof(AbstractVariable) * source->count);
+    target->count = source->count;
+    target->textLow = source->textLow;
+    target->textHigh = source->textHigh;
+}
+
+int abstract_same_variable(const AbstractVariable* a, const AbstractVariable* b) {
+    return strcmp(a->name, b->name) == 0 && a->isInteger == b->isInteger && a->uncertain == b->uncertain &&
+           a->low == b->low && a->high == b->high && a->known == b->known && (!a->known || strcmp(a->text, b->text) == 0);
+}
+
+int abstract_same(const AbstractState* a, const AbstractState* b) {
+    if (a->count != b->count) {
+        return 0;
+    }
+    for (int i = 0; i < a->count; i++) {
+        if (!abstract_same_variable(&a->variables[i], &b->variables[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Widens a variable that moved from before to after to the full range in that direction
+void abstract_widen_variable(AbstractVariable* variable, const AbstractVariable* after) {
+    long long top = variable->isInteger ? MAX_INTEGER_VALUE : MAX_TEXT_LENGTH;
+    if (after->low < variable->low) variable->low = 0;
+    if (after->high > variable->high) variable->high = top;
+    if (variable->known && (!after->known || strcmp(variable->text, after->text) != 0)) {
+        variable->known = 0;
+        variable->low = 0;
+        variable->high = top;
+    }
+}
+
+// Makes target cover source as well. With widen, variables that differ are widened.
+void abstract_join(AbstractState* target, const AbstractState* source, int widen) {
+    for (int i = 0; i < target->count; i++) {
+        AbstractVariable* variable = &target->variables[i];
+        int found = i < source->count && strcmp(source->variables[i].name, variable->name) == 0
+                        ? i : abstract_find(source, variable->name);  // Usually at the same slot
+        if (found < 0) {
+            variable->uncertain = 1;
+            continue;
+        }
+        const AbstractVariable* other = &source->variables[found];
+        if (other->isInteger != variable->isInteger) {
+            variable->uncertain = 1;
+            variable->known = 0;
+            variable->low = 0;
+            variable->high = variable->isInteger ? MAX_INTEGER_VALUE : MAX_TEXT_LENGTH;
+            continue;
+        }
+        variable->uncertain |= other->uncertain;
+        if (widen) {
+            abstract_widen_variable(variable, other);
+            continue;
+        }
+        if (other->low < variable->low) variable->low = other->low;
+        if (other->high > variable->high) variable->high = other->high;
+        if (variable->known && (!other->known || strcmp(variable->text, other->text) != 0)) {
+            variable->known = 0;
+        }
+    }
+    for (int i = 0; i < source->count; i++) {
+        if (abstract_find(target, source->variables[i].name) < 0) {
+            if (target->count == target->capacity) {
+                target->variables = grow_table(target->variables, &target->capacity, sizeof(AbstractVariable));
+            }
+            target->variables[target->count] = source->variables[i];
+            target->variables[target->count++].uncertain = 1;
+        }
+    }
+    abstract_text_sums(target);
+}
+
+// Gives every variable its full range, for loop nests too large to follow
+void abstract_forget(AbstractState* state) {
+    for (int i = 0; i < state->count; i++) {
+        AbstractVariable* variable = &state->variables[i];
+        variable->low = 0;
+        variable->high = variable->isInteger ? MAX_INTEGER_VALUE : MAX_TEXT_LENGTH;
+        variable->known = 0;
+    }
+    abstract_text_sums(state);
+}
+
+void estimate_text_peak(Estimator* estimator) {
+    EstimateRange* peak = &estimator->cost.peakTextBytes;
+    if (estimator->state.textHigh > peak->max) peak->max = estimator->state.textHigh;
+    if (estimator->certain && estimator->state.textLow > peak->min) peak->min = estimator->state.textLow;
+}
+
+void abstract_set_int(AbstractVariable* variable, long long low, long long high) {
+    variable->low = low;
+    variable->high = high;
+}
+
+void abstract_set_text(Estimator* estimator, AbstractVariable* variable, const AbstractVariable* value) {
+    AbstractState* state = &estimator->state;
+    if (!variable->uncertain) {
+        state->textLow += value->low - variable->low;
+    }
+    state->textHigh += value->high - variable->high;
+    variable->low = value->low;
+    variable->high = value->high;
+    variable->known = value->known;
+    if (value->known) {
+        strcpy(variable->text, value->text);
+    }
+    estimate_text_peak(estimator);
+}
+
+// Like define_variable: the variable gets the type and its empty value
+AbstractVariable* abstract_define(Estimator* estimator, const char* name, int isInteger) {
+    AbstractState* state = &estimator->state;
+    int slot = abstract_find(state, name);
+    if (slot < 0) {
+        if (state->count == MAX_VARIABLES) {
+            estimate_fail(estimator);  // Too many variables defined
+            return NULL;
+        }
+        if (state->count == state->capacity) {
+            state->variables = grow_table(state->variables, &state->capacity, sizeof(AbstractVariable));
+        }
+        slot = state->count++;
+        state->variables[slot] = (AbstractVariable){.name = name, .isInteger = 1};
+    }
+    AbstractVariable* variable = &state->variables[slot];
+    if (!variable->isInteger) {
+        state->textLow -= variable->uncertain ? 0 : variable->low;
+        state->textHigh -= variable->high;
+    }
+    variable->isInteger = isInteger;
+    variable->uncertain = 0;
+    variable->low = 0;
+    variable->high = 0;
+    variable->known = 1;
+    variable->text[0] = '\0';
+    return variable;
+}
+
+// A variable a statement reads, or NULL when using it is an error
+AbstractVariable* abstract_use(Estimator* estimator, const char* name) {
+    int slot = abstract_find(&estimator->state, name);
+    if (slot < 0) {
+        estimate_fail(estimator);
+        return NULL;
+    }
+    AbstractVariable* variable = &estimator->state.variables[slot];
+    if (variable->uncertain) {
+        estimate_fail(estimator);
+    }
+    return variable;
+}
+
+int decimal_digits(long long value) {
+    int digits = 1;
+    for (; value >= 10; value /= 10) digits++;
+    return digits;
+}
+
+void estimate_arithmetic(Estimator* estimator, char op, long long* low, long long* high, long long valueLow, long long valueHigh) {
+    long long a = *low, b = *high;
+    if (op == '+') {
+        *low = a + valueLow;
+        *high = b + valueHigh;
+    } else if (op == '-') {
+        *low = a - valueHigh;
+        *high = b - valueLow;
+    } else if (op == '*' || op == '/') {
+        long long divisors[2][2] = {{valueLow, valueHigh}, {1, 0}};
+        if (op == '/') {
+            if (valueLow <= 0 && valueHigh >= 0) {
+                estimate_fail(estimator);  // Division by zero
+                divisors[0][0] = valueLow;  // Split around zero
+                divisors[0][1] = -1;
+                divisors[1][0] = 1;
+                divisors[1][1] = valueHigh;
+            }
+        }
+        int first = 1;
+        for (int part = 0; part < 2; part++) {
+            long long c = divisors[part][0], d = divisors[part][1];
+            if (c > d || (op == '*' && part == 1)) continue;
+            long long corners[4] = {a, a, b, b};
+            long long with[4] = {c, d, c, d};
+            for (int i = 0; i < 4; i++) {
+                long long value = op == '*' ? corners[i] * with[i] : corners[i] / with[i];
+                if (first || value < *low) *low = value;
+                if (first || value > *high) *high = value;
+                first = 0;
+            }
+        }
+        if (first) {
+            *low = 0;
+            *high = 0;
+        }
+    }
+    if (*low < INT_MIN || *high > INT_MAX) {
+        *low = INT_MIN;  // int arithmetic wraps around
+        *high = INT_MAX;
+    }
+}
+
+// Mirrors eval_expression_helper on value ranges
+void estimate_expression(Estimator* estimator, const Token* tokens, int* index, long long* low, long long* high) {
+    long long resultLow = 0, resultHigh = 0;
+    long long valueLow = 0, valueHigh = 0;
+    int operandSet = 0;
+    char op = '+';
+
+    for (;;) {
+        Token token = next_token(tokens, index);
+        if (token.type == TOKEN_INTEGER) {
+            valueLow = valueHigh = token.number;
+            operandSet = 1;
+        } else if (token.type == TOKEN_IDENTIFIER) {
+            AbstractVariable* variable = abstract_use(estimator, token.value);
+            valueLow = 0;
+            valueHigh = MAX_INTEGER_VALUE + 1;
+            if (variable && variable->isInteger) {
+                valueLow = variable->low;
+                valueHigh = variable->high;
+            } else if (variable && variable->known) {
+                valueLow = valueHigh = parse_integer(variable->text);
+            }
+            operandSet = 1;
+        } else if (token.type == TOKEN_LEFT_PAREN) {
+            estimate_expression(estimator, tokens, index, &valueLow, &valueHigh);
+            operandSet = 1;
+        } else if (token.type == TOKEN_RIGHT_PAREN || token.type == TOKEN_END_OF_LINE || token.type == TOKEN_END_OF_FILE) {
+            break;
+        } else if (token.type == TOKEN_OPERATOR) {
+            if (!operandSet) {
+                estimate_fail(estimator);
+            }
+            estimate_arithmetic(estimator, op, &resultLow, &resultHigh, valueLow, valueHigh);
+            op = token.value[0];
+            operandSet = 0;
+        } else {
+            estimate_fail(estimator);
+        }
+    }
+    if (operandSet) {
+        estimate_arithmetic(estimator, op, &resultLow, &resultHigh, valueLow, valueHigh);
+    }
+    *low = resultLow;
+    *high = resultHigh;
+}
+
+// Mirrors get_text_operand
+void estimate_text_operand(Estimator* estimator, Token token, AbstractVariable* out) {
+    out->known = 1;
+    out->low = out->high = 0;
+    out->text[0] = '\0';
+    if (token.type == TOKEN_STRING) {
+        strcpy(out->text, token.value);
+        out->low = out->high = strlen(token.value);
+        return;
+    }
+    AbstractVariable* variable = token.type == TOKEN_IDENTIFIER ? abstract_use(estimator, token.value) : NULL;
+    if (!variable || variable->isInteger) {
+        estimate_fail(estimator);
+        return;
+    }
+    *out = *variable;
+}
+
+// Mirrors evaluate_text_expression
+void estimate_text_expression(Estimator* estimator, const Token* tokens, int* index, AbstractVariable* out) {
+    estimate_text_operand(estimator, next_token(tokens, index), out);
+
+    Token token = next_token(tokens, index);
+    if (token.type == TOKEN_OPERATOR && (token.value[0] == '+' || token.value[0] == '-')) {
+        AbstractVariable rhs;
+        estimate_text_operand(estimator, next_token(tokens, index), &rhs);
+        if (out->known && rhs.known) {
+            if (token.value[0] == '+') {
+                size_t length = strlen(out->text);
+                size_t added = strlen(rhs.text) < MAX_TEXT_LENGTH - length ? strlen(rhs.text) : MAX_TEXT_LENGTH - length;
+                memcpy(out->text + length, rhs.text, added);  // Truncated to 256 like the interpreter
+                out->text[length + added] = '\0';
+            } else if (rhs.text[0] != '\0') {
+                char* found = strstr(out->text, rhs.text);
+                if (found) {
+                    memmove(found, found + strlen(rhs.text), strlen(found + strlen(rhs.text)) + 1);
+                }
+            }
+            out->low = out->high = strlen(out->text);
+        } else if (token.value[0] == '+') {
+            out->known = 0;
+            out->low = out->low + rhs.low < MAX_TEXT_LENGTH ? out->low + rhs.low : MAX_TEXT_LENGTH;
+            out->high = out->high + rhs.high < MAX_TEXT_LENGTH ? out->high + rhs.high : MAX_TEXT_LENGTH;
+        } else if (!(rhs.known && rhs.text[0] == '\0')) {
+            out->known = 0;
+            out->low = out->low > rhs.high ? out->low - rhs.high : 0;
+        }
+        token = next_token(tokens, index);
+    }
+    if (token.type != TOKEN_END_OF_LINE) {
+        estimate_fail(estimator);
+    }
+}
+
+// Mirrors execute_statement and the handlers it calls
+void estimate_statement(Estimator* estimator, const Token* tokens, int index) {
+    Token token = next_token(tokens, &index);
+    if (token.type == TOKEN_END_OF_FILE || token.type == TOKEN_END_OF_LINE) {
+        return;
+    }
+    estimate_add(estimator, &estimator->cost.statements, 1, 1);
+    estimator->work++;
+
+    if (token.type == TOKEN_KEYWORD && (strcmp(token.value, "int") == 0 || strcmp(token.value, "text") == 0)) {
+        int isInteger = token.value[0] == 'i';
+        AbstractVariable* variable = NULL;
+        while ((token = next_token(tokens, &index)).type != TOKEN_END_OF_LINE && token.type != TOKEN_END_OF_FILE) {
+            if (token.type == TOKEN_IDENTIFIER) {
+                variable = abstract_define(estimator, token.value, isInteger);
+                estimate_text_peak(estimator);
+            } else if (token.type == TOKEN_COMMA) {
+                continue;
+            } else if (token.type == TOKEN_KEYWORD && strcmp(token.value, "is") == 0 && variable) {
+                token = next_token(tokens, &index);
+                if (isInteger && token.type == TOKEN_INTEGER && token.number <= MAX_INTEGER_VALUE) {
+                    abstract_set_int(variable, token.number, token.number);
+                } else if (!isInteger && token.type == TOKEN_STRING) {
+                    AbstractVariable value;
+                    estimate_text_operand(estimator, token, &value);
+                    abstract_set_text(estimator, variable, &value);
+                } else {
+                    estimate_fail(estimator);
+                }
+            } else {
+                estimate_fail(estimator);
+            }
+        }
+    } else if (token.type == TOKEN_IDENTIFIER) {
+        const char* name = token.value;
+        token = next_token(tokens, &index);
+        if (token.type == TOKEN_KEYWORD && strcmp(token.value, "is") == 0) {
+            AbstractVariable* variable = abstract_use(estimator, name);
+            if (variable && variable->isInteger) {
+                long long low, high;
+                estimate_expression(estimator, tokens, &index, &low, &high);
+                if (high > MAX_INTEGER_VALUE) {
+                    estimate_fail(estimator);  // Integer overflow
+                }
+                low = low < 0 ? 0 : low > MAX_INTEGER_VALUE ? MAX_INTEGER_VALUE : low;
+                high = high < 0 ? 0 : high > MAX_INTEGER_VALUE ? MAX_INTEGER_VALUE : high;
+                abstract_set_int(variable, low, high);
+            } else if (variable) {
+                AbstractVariable value;
+                estimate_text_expression(estimator, tokens, &index, &value);
+                abstract_set_text(estimator, variable, &value);
+            }
+        } else if (token.type == TOKEN_STRING) {
+            AbstractVariable* variable = abstract_define(estimator, name, 0);
+            if (variable) {
+                AbstractVariable value;
+                estimate_text_operand(estimator, token, &value);
+                abstract_set_text(estimator, variable, &value);
+            }
+        } else {
+            estimate_fail(estimator);
+        }
+    } else if (token.type == TOKEN_KEYWORD && strcmp(token.value, "write") == 0) {
+        while ((token = next_token(tokens, &index)).type != TOKEN_END_OF_LINE && token.type != TOKEN_END_OF_FILE) {
+            if (token.type == TOKEN_IDENTIFIER) {
+                AbstractVariable* variable = abstract_use(estimator, token.value);
+                if (variable && variable->isInteger) {
+                    estimate_add(estimator, &estimator->cost.outputBytes, decimal_digits(variable->low), decimal_digits(variable->high));
+                } else if (variable) {
+                    estimate_add(estimator, &estimator->cost.outputBytes, variable->low, variable->high);
+                }
+            } else if (token.type == TOKEN_STRING || token.type == TOKEN_INTEGER) {
+                estimate_add(estimator, &estimator->cost.outputBytes, strlen(token.value), strlen(token.value));
+            } else if (token.type == TOKEN_COMMA) {
+                estimate_add(estimator, &estimator->cost.outputBytes, 1, 1);
+            }
+        }
+    } else if (token.type == TOKEN_KEYWORD && strcmp(token.value, "read") == 0) {
+        estimate_add(estimator, &estimator->cost.reads, 1, 1);
+        token = next_token(tokens, &index);  // The prompt, as in read_prompt
+        if (token.type == TOKEN_STRING) {
+            estimate_add(estimator, &estimator->cost.outputBytes, strlen(token.value), strlen(token.value));
+            token = next_token(tokens, &index);
+        } else if (token.type == TOKEN_IDENTIFIER &&
+                   (tokens[index].type == TOKEN_COMMA || tokens[index].type == TOKEN_IDENTIFIER)) {
+            AbstractVariable prompt;
+            estimate_text_operand(estimator, token, &prompt);
+            estimate_add(estimator, &estimator->cost.outputBytes, prompt.low, prompt.high);
+            token = next_token(tokens, &index);
+        }
+        if (token.type == TOKEN_COMMA) {
+            token = next_token(tokens, &index);
+        }
+        AbstractVariable* variable = NULL;
+        if (token.type == TOKEN_IDENTIFIER) {
+            variable = abstract_use(estimator, token.value);
+        } else {
+            estimate_fail(estimator);
+        }
+        if (variable && variable->isInteger) {
+            abstract_set_int(variable, 0, MAX_INTEGER_VALUE);
+        } else if (variable) {
+            AbstractVariable input = {.low = 0, .high = MAX_TEXT_LENGTH};
+            abstract_set_text(estimator, variable, &input);
+        }
+        if (next_token(tokens, &index).type != TOKEN_END_OF_LINE) {
+            estimate_fail(estimator);
+        }
+    } else if (token.type == TOKEN_KEYWORD && strcmp(token.value, "newLine") == 0) {
+        estimate_add(estimator, &estimator->cost.outputBytes, 1, 1);
+        if (next_token(tokens, &index).type != TOKEN_END_OF_LINE) {
+            estimate_fail(estimator);
+        }
+    } else {
+        estimate_fail(estimator);  // A malformed loop or an unrecognized statement
+    }
+}
+
+// Cost of what ran since start, for one range
+EstimateRange estimate_since(const EstimateRange* now, const EstimateRange* start) {
+    EstimateRange range;
+    range.min = now->min - start->min;
+    range.max = now->max == ESTIMATE_UNBOUNDED ? ESTIMATE_UNBOUNDED : now->max - start->max;
+    return range;
+}
+
+// Whether the body of the loop at loopPc only changes name with `name is name + N.` and
+// `name is name - N.`; up and down get the largest increase and decrease per iteration,
+// counting statements in inner loops once per inner iteration
+int estimate_induction(Program* program, int loopPc, const char* name, long long* up, long long* down) {
+    const Token* tokens = program->scan.tokens;
+    long long* factors = NULL;  // Executions per iteration at each inner loop level, -1 when not fixed
+    int depth = 0;
+    int capacity = 0;
+    long long factor = 1;
+    int induction = 1;
+    *up = 0;
+    *down = 0;
+
+    for (int pc = loopPc + 1; pc < program->code[loopPc].jump && induction; pc++) {
+        Instruction* instruction = &program->code[pc];
+        if (instruction->kind == INSTRUCTION_LOOP) {
+            if (depth == capacity) {
+                factors = grow_table(factors, &capacity, sizeof(long long));
+            }
+            factors[depth++] = factor;
+            Token count = tokens[instruction->start];
+            factor = count.type == TOKEN_INTEGER && factor >= 0 ? saturating_multiply(factor, count.number) : -1;
+            continue;
+        }
+        if (instruction->kind == INSTRUCTION_END_LOOP) {
+            factor = factors[--depth];
+            continue;
+        }
+        int index = instruction->start;
+        Token token = next_token(tokens, &index);
+        if (token.type != TOKEN_IDENTIFIER || strcmp(token.value, name) != 0) {
+            // Declarations and reads that name it reset or replace it
+            if (token.type == TOKEN_KEYWORD && strcmp(token.value, "write") != 0) {
+                while ((token = next_token(tokens, &index)).type != TOKEN_END_OF_LINE && token.type != TOKEN_END_OF_FILE) {
+                    if (token.type == TOKEN_IDENTIFIER && strcmp(token.value, name) == 0) {
+                        induction = 0;
+                    }
+                }
+            }
+            continue;
+        }
+        Token is = next_token(tokens, &index);
+        Token self = next_token(tokens, &index);
+        Token op = next_token(tokens, &index);
+        Token step = next_token(tokens, &index);
+        if (factor < 0 || is.type != TOKEN_KEYWORD || strcmp(is.value, "is") != 0 ||
+            self.type != TOKEN_IDENTIFIER || strcmp(self.value, name) != 0 || op.type != TOKEN_OPERATOR ||
+            (op.value[0] != '+' && op.value[0] != '-') || step.type != TOKEN_INTEGER ||
+            next_token(tokens, &index).type != TOKEN_END_OF_LINE) {
+            induction = 0;
+        } else if (op.value[0] == '+') {
+            *up = saturating_add(*up, saturating_multiply(step.number, factor));
+        } else {
+            *down = saturating_add(*down, saturating_multiply(step.number, factor));
+        }
+    }
+    free(factors);
+    return induction;
+}
+
+// Widens the entry state of a loop with the state after its latest iteration. Counters get
+// the range their steps reach in the remaining iterations instead of the full range.
+void estimate_widen(Program* program, EstimateLoop* loop, const AbstractState* state) {
+    AbstractState before = {0};
+    abstract_copy(&before, &loop->entry);
+    abstract_join(&loop->entry, state, 1);
+    long long remaining = loop->high - loop->done;
+
+    for (int i = 0; i < before.count; i++) {
+        const AbstractVariable* previous = &before.variables[i];
+        int slot = abstract_find(state, previous->name);
+        if (!previous->isInteger || previous->uncertain || slot < 0 || !state->variables[slot].isInteger ||
+            state->variables[slot].uncertain || abstract_same_variable(previous, &state->variables[slot])) {
+            continue;
+        }
+        long long up, down;
+        if (!estimate_induction(program, loop->loop, previous->name, &up, &down)) {
+            continue;
+        }
+        const AbstractVariable* after = &state->variables[slot];
+        AbstractVariable* widened = &loop->entry.variables[abstract_find(&loop->entry, previous->name)];
+        long long low = previous->low < after->low ? previous->low : after->low;
+        long long high = previous->high > after->high ? previous->high : after->high;
+        low -= saturating_multiply(down, remaining);
+        high = saturating_add(high, saturating_multiply(up, remaining));
+        widened->low = low < 0 ? 0 : low;
+        widened->high = high > INT_MAX ? INT_MAX : high;  // Past MAX_INTEGER_VALUE is an overflow
+
+        if (loop->inductionCount == loop->inductionCapacity) {
+            loop->inductions = grow_table(loop->inductions, &loop->inductionCapacity, sizeof(EstimateInduction));
+        }
+        EstimateInduction* induction = &loop->inductions[loop->inductionCount++];
+        induction->name = previous->name;
+        induction->exact = down == 0 && loop->low == loop->high;
+        induction->exitLow = saturating_add(after->low, saturating_multiply(up, remaining));
+        induction->exitHigh = saturating_add(after->high, saturating_multiply(up, remaining));
+    }
+    free(before.variables);
+}
+
+// Sets the counters of a widened loop in state to their range from the loop entry: the
+// range already covers every iteration, and another step must not widen it again
+void estimate_pin_inductions(EstimateLoop* loop, AbstractState* state) {
+    for (int i = 0; i < loop->inductionCount; i++) {
+        int slot = abstract_find(state, loop->inductions[i].name);
+        int entry = abstract_find(&loop->entry, loop->inductions[i].name);
+        if (slot >= 0 && entry >= 0 && state->variables[slot].isInteger) {
+            state->variables[slot].low = loop->entry.variables[entry].low;
+            state->variables[slot].high = loop->entry.variables[entry].high;
+        }
+    }
+}
+
+// Estimates the statements, output, reads and text memory of a whole run of program
+void estimate_program(Program* program, Estimate* estimate) {
+    const Token* tokens = program->scan.tokens;
+    Estimator estimator = {0};
+    estimator.certain = 1;
+    EstimateLoop* loops = NULL;
+    int depth = 0;
+    int capacity = 0;
+    int pc = 0;
+
+    while (pc < program->codeCount) {
+        if (depth > 0 && estimator.work > 2 * ESTIMATE_BUDGET) {
+            // Give up on this loop nest: nothing after it has an upper bound
+            Estimate* cost = &estimator.cost;
+            cost->statements.max = cost->outputBytes.max = cost->reads.max = ESTIMATE_UNBOUNDED;
+            cost->peakTextBytes.max = (long long)MAX_VARIABLES * MAX_TEXT_LENGTH;
+            estimate_fail(&estimator);
+            abstract_forget(&estimator.state);
+            pc = program->code[loops[0].loop].jump + 1;
+            depth = 0;
+            continue;
+        }
+        Instruction* instruction = &program->code[pc];
+        if (instruction->kind == INSTRUCTION_STATEMENT || instruction->kind == INSTRUCTION_READ) {
+            estimate_statement(&estimator, tokens, instruction->start);
+            pc++;
+        } else if (instruction->kind == INSTRUCTION_LOOP) {
+            estimate_add(&estimator, &estimator.cost.statements, 1, 1);
+            long long low = 0, high = 0;
+            Token count = tokens[instruction->start];
+            if (count.type == TOKEN_INTEGER) {
+                low = high = count.number;
+            } else {
+                AbstractVariable* variable = abstract_use(&estimator, count.value);
+                if (variable && variable->isInteger) {
+                    low = variable->low;
+                    high = variable->high;
+                } else {
+                    estimate_fail(&estimator);  // Loop count is not an integer variable
+                }
+            }
+            if (high <= 0) {
+                pc = instruction->jump + 1;
+                continue;
+            }
+            if (depth == 0) {
+                estimator.work = 0;
+            }
+            if (depth == capacity) {
+                loops = grow_table(loops, &capacity, sizeof(EstimateLoop));
+                memset(&loops[depth], 0, sizeof(EstimateLoop) * (capacity - depth));
+            }
+            EstimateLoop* loop = &loops[depth++];
+            loop->loop = pc;
+            loop->low = low < 0 ? 0 : low;
+            loop->high = high;
+            loop->done = 0;
+            loop->widened = 0;
+            loop->exitSet = 0;
+            loop->inductionCount = 0;
+            abstract_copy(&loop->entry, &estimator.state);
+            loop->iterationStart = estimator.cost;
+            pc++;
+        } else {
+            EstimateLoop* loop = &loops[depth - 1];
+            Estimate* cost = &estimator.cost;
+            EstimateRange* ranges[3] = {&cost->statements, &cost->outputBytes, &cost->reads};
+            EstimateRange* starts[3] = {&loop->iterationStart.statements, &loop->iterationStart.outputBytes,
+                                        &loop->iterationStart.reads};
+            if (loop->done >= loop->low) {  // An iteration that may not run adds to no minimum
+                for (int r = 0; r < 3; r++) ranges[r]->min = starts[r]->min;
+                cost->peakTextBytes.min = loop->iterationStart.peakTextBytes.min;
+            }
+            loop->done++;
+            estimator.work++;
+
+            AbstractState* state = &estimator.state;
+            int finished = loop->done >= loop->high;
+            int stable;
+            if (loop->widened) {
+                estimate_pin_inductions(loop, state);
+                AbstractState joined = {0};
+                abstract_copy(&joined, &loop->entry);
+                abstract_join(&joined, state, 0);
+                stable = abstract_same(&joined, &loop->entry);
+                free(joined.variables);
+            } else {
+                stable = abstract_same(state, &loop->entry);
+            }
+            if (!finished && stable) {
+                // Every remaining iteration starts from this state again and costs the same
+                long long remaining = loop->high - loop->done;
+                long long remainingMin = loop->low > loop->done ? loop->low - loop->done : 0;
+                for (int r = 0; r < 3; r++) {
+                    EstimateRange iteration = estimate_since(ranges[r], starts[r]);
+                    ranges[r]->max = saturating_add(ranges[r]->max, saturating_multiply(iteration.max, remaining));
+                    if (estimator.certain) {
+                        ranges[r]->min = saturating_add(ranges[r]->min, saturating_multiply(iteration.min, remainingMin));
+                    }
+                }
+                finished = 1;
+                if (loop->widened) {
+                    abstract_copy(state, &loop->entry);
+                }
+            }
+            if (loop->done >= loop->low || finished) {
+                if (loop->exitSet) {
+                    abstract_join(&loop->exit, state, 0);
+                } else {
+                    abstract_copy(&loop->exit, state);
+                    loop->exitSet = 1;
+                }
+            }
+            if (finished) {
+                abstract_copy(state, &loop->exit);
+                for (int i = 0; i < loop->inductionCount; i++) {
+                    int slot = abstract_find(state, loop->inductions[i].name);
+                    if (loop->inductions[i].exact && slot >= 0 && !state->variables[slot].uncertain) {
+                        abstract_set_int(&state->variables[slot], loop->inductions[i].exitLow, loop->inductions[i].exitHigh);
+                    }
+                }
+                depth--;
+                pc++;
+                continue;
+            }
+            if (!loop->widened && (loop->done >= ESTIMATE_ITERATIONS || estimator.work > ESTIMATE_BUDGET)) {
+                loop->widened = 1;
+                estimate_widen(program, loop, state);
+                abstract_copy(state, &loop->entry);
+            } else if (loop->widened) {
+                abstract_join(&loop->entry, state, 1);
+                abstract_copy(state, &loop->entry);
+            } else {
+                abstract_copy(&loop->entry, state);
+            }
+            loop->iterationStart = estimator.cost;
+            pc = loop->loop + 1;
+        }
+    }
+
+    for (int i = 0; i < capacity; i++) {
+        free(loops[i].entry.variables);
+        free(loops[i].exit.variables);
+        free(loops[i].inductions);
+    }
+    free(loops);
+    free(estimator.state.variables);
+    *estimate = estimator.cost;
+}
+
+#ifndef _WIN32
+// Checkpointing (--checkpoint FILE). Every N statements or T seconds the variables, loop
+// counters and program position are written to a memory-mapped state file holding two
+// slots. A checkpoint fills the slot that is not active and then flips activeSlot, so the
+// file always holds one complete state. Only variables changed since that slot was last
+// written are copied. The loop frames of both slots follow the slots, sized for the loop
+// nesting of the program. --resume continues from the active slot.
+#define CHECKPOINT_MAGIC 0x54504B4352415453ULL  // "STARCKPT"
+#define CHECKPOINT_POLL_INTERVAL 4096  // Statements between clock reads when a time limit is set
+
+typedef struct {
+    long long sequence;
+    long long statementCount;
+    int pc;
+    int loopDepth;
+    VariableStore variables;
+} CheckpointSlot;
+
+typedef struct {
+    unsigned long long magic;
+    unsigned long long sourceHash;
+    int activeSlot;  // -1 until the first checkpoint is complete
+    CheckpointSlot slots[2];
+    LoopFrame loopFrames[];  // frameCapacity for slot 0, then as many for slot 1
+} CheckpointFile;
+
+typedef struct {
+    const char* path;
+    CheckpointFile* file;
+    size_t size;
+    int frameCapacity;
+    long long everyStatements;
+    double everySeconds;
+    long long lastStatements;
+    double lastTime;
+    unsigned long long pending[2][VARIABLE_MASK_WORDS];  // Variables each slot is missing
+} Checkpoint;
+
+Checkpoint checkpoint;
+
+double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void checkpoint_write(Context* context) {
+    CheckpointFile* file = checkpoint.file;
+    int slot = file->activeSlot == 0 ? 1 : 0;
+    CheckpointSlot* target = &file->slots[slot];
+
+    for (int word = 0; word < VARIABLE_MASK_WORDS; word++) {
+        checkpoint.pending[0][word] |= context->dirtyVariables[word];
+        checkpoint.pending[1][word] |= context->dirtyVariables[word];
+        context->dirtyVariables[word] = 0;
+
+        unsigned long long bits = checkpoint.pending[slot][word];
+        while (bits) {
+            int i = word * 64 + __builtin_ctzll(bits);
+            copy_variable(&target->variables, &context->variables, i);
+            bits &= bits - 1;
+        }
+        checkpoint.pending[slot][word] = 0;
+    }
+
+    target->variables.count = context->variables.count;
+    target->variables.textCount = context->variables.textCount;
+    target->pc = context->pc;
+    target->loopDepth = context->loopDepth;
+    memcpy(&file->loopFrames[slot * checkpoint.frameCapacity], context->loopStack,
+           sizeof(LoopFrame) * context->loopDepth);
+    target->statementCount = context->statementCount;
+    target->sequence = file->activeSlot < 0 ? 1 : file->slots[!slot].sequence + 1;
+
+    flush_output();  // Output before the checkpoint is not repeated after a resume
+    __atomic_store_n(&file->activeSlot, slot, __ATOMIC_RELEASE);
+
+    checkpoint.lastStatements = context->statementCount;
+    if (checkpoint.everySeconds > 0) {
+        checkpoint.lastTime = monotonic_seconds();
+    }
+}
+
+void checkpoint_poll(Context* context) {
+    long long since = context->statementCount - checkpoint.lastStatements;
+    if ((checkpoint.everyStatements > 0 && since >= checkpoint.everyStatements) ||
+        (checkpoint.everySeconds > 0 && monotonic_seconds() - checkpoint.lastTime >= checkpoint.everySeconds)) {
+        checkpoint_write(context);
+    }
+
+    long long interval = checkpoint.everyStatements > 0 ? checkpoint.everyStatements - (context->statementCount - checkpoint.lastStatements) : CHECKPOINT_POLL_INTERVAL;
+    if (checkpoint.everySeconds > 0 && interval > CHECKPOINT_POLL_INTERVAL) {
+        interval = CHECKPOINT_POLL_INTERVAL;
+    }
+    checkpointPollAt = context->statementCount + (interval > 0 ? interval : 1);
+}
+
+// Maps the state file; with resume the active slot is loaded into context.
+// Returns 0 if resume was requested but the file holds no usable state.
+int checkpoint_open(Program* program, Context* context, int resume) {
+    int fd = open(checkpoint.path, O_RDWR | O_CREAT, 0644);
+    struct stat fileStat;
+    if (fd < 0 || fstat(fd, &fileStat) != 0) {
+        fprintf(stderr, "Error: Could not open checkpoint file '%s'\n", checkpoint.path);
+        exit(1);
+    }
+    checkpoint.frameCapacity = program->loopNesting;
+    checkpoint.size = sizeof(CheckpointFile) + sizeof(LoopFrame) * 2 * checkpoint.frameCapacity;
+    int existing = fileStat.st_size == (off_t)checkpoint.size;
+    if (!existing && ftruncate(fd, checkpoint.size) != 0) {
+        fprintf(stderr, "Error: Could not size checkpoint file '%s'\n", checkpoint.path);
+        exit(1);
+    }
+    checkpoint.file = mmap(NULL, checkpoint.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (checkpoint.file == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map checkpoint file '%s'\n", checkpoint.path);
+        exit(1);
+    }
+
+    CheckpointFile* file = checkpoint.file;
+    unsigned long long sourceHash = hash_tokens(&program->scan);
+    int loaded = 0;
+
+    if (resume && existing && file->magic == CHECKPOINT_MAGIC && file->sourceHash == sourceHash &&
+        file->activeSlot >= 0 && file->activeSlot <= 1) {
+        CheckpointSlot* slot = &file->slots[file->activeSlot];
+        copy_variables(&context->variables, &slot->variables);
+        context->pc = slot->pc;
+        context->loopDepth = slot->loopDepth;
+        reserve_loop_frames(context, slot->loopDepth);
+        memcpy(context->loopStack, &file->loopFrames[file->activeSlot * checkpoint.frameCapacity],
+               sizeof(LoopFrame) * slot->loopDepth);
+        context->statementCount = slot->statementCount;
+
+        // The other slot is one checkpoint behind, so it has to catch up on everything
+        for (int i = 0; i < context->variables.count; i++) {
+            checkpoint.pending[!file->activeSlot][i / 64] |= 1ULL << (i % 64);
+        }
+        loaded = 1;
+    } else {
+        if (resume && existing && file->magic == CHECKPOINT_MAGIC && file->sourceHash != sourceHash) {
+            fprintf(stderr, "Error: Checkpoint '%s' belongs to a different version of the script\n", checkpoint.path);
+            exit(1);
+        }
+        file->activeSlot = -1;
+        file->sourceHash = sourceHash;
+        __atomic_store_n(&file->magic, CHECKPOINT_MAGIC, __ATOMIC_RELEASE);
+    }
+
+    checkpoint.lastStatements = context->statementCount;
+    checkpoint.lastTime = monotonic_seconds();
+    checkpoint_poll(context);
+    return loaded || !resume;
+}
+
+// The job ran to completion, so there is nothing left to resume
+void checkpoint_finish(void) {
+    munmap(checkpoint.file, checkpoint.size);
+    unlink(checkpoint.path);
+    checkpointPollAt = -1;
+}
+
+// Watch mode (--watch): keeps the compiled program and the Context after every top-level
+// statement. When the file changes, statements before the first edited one are kept, only
+// the rest of the file is compiled again, and execution resumes from the snapshot taken
+// before the edit. Each run happens in a child process so a failing edit cannot take the
+// watcher down; the snapshots live in a shared mapping the child writes into.
+typedef struct {
+    int validCount;  // snapshots[0 .. validCount - 1] are usable
+    Context snapshots[];
+} SnapshotStore;
+
+SnapshotStore* map_snapshot_store(int capacity) {
+    size_t size = sizeof(SnapshotStore) + sizeof(Context) * (size_t)capacity;
+    SnapshotStore* store = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (store == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map %d snapshots\n", capacity);
+        exit(1);
+    }
+    return store;
+}
+
+void watch(const char* inputFilePath) {
+    Program program = {0};
+    SnapshotStore* store = NULL;
+    int storeCapacity = 0;
+    struct stat lastStat = {0};
+
+    for (;;) {
+        struct stat current;
+        if (stat(inputFilePath, &current) != 0 ||
+            (program.source && current.st_mtim.tv_sec == lastStat.st_mtim.tv_sec &&
+             current.st_mtim.tv_nsec == lastStat.st_mtim.tv_nsec && current.st_size == lastStat.st_size)) {
+            usleep(200000);
+            continue;
+        }
+        lastStat = current;
+
+        char* source = load_source(inputFilePath);
+        if (!source) {
+            continue;
+        }
+        TokenStream scan;
+        scan_source(source, &scan);
+        if (report_diagnostics(&scan) > 0) {
+            fprintf(stderr, "[watch] lexical errors, waiting for changes\n");
+            free_token_stream(&scan);
+            free(source);
+            continue;
+        }
+
+        // Statements that end before the first changed byte are kept as they are; their
+        // tokens are the same in both scans
+        int first = 0;
+        if (program.source) {
+            if (same_tokens(&scan, &program.scan)) {
+                free_token_stream(&scan);
+                free(source);
+                continue;  // Only comments or layout changed
+            }
+            int changed = 0;
+            while (source[changed] != '\0' && source[changed] == program.source[changed]) changed++;
+            while (first < program.statementCount &&
+                   program.scan.tokens[program.statements[first].end].offset <= changed) first++;
+            if (first > store->validCount - 1) {
+                first = store->validCount - 1;  // The last run stopped earlier than that
+            }
+        }
+        free(program.source);
+        free_token_stream(&program.scan);
+        program.source = source;
+        program.scan = scan;
+        truncate_program(&program, first);
+        compile_program(&program, first ? program.statements[first - 1].end : 0);
+
+        if (program.statementCount + 1 > storeCapacity) {
+            int capacity = storeCapacity ? storeCapacity : 64;
+            while (capacity < program.statementCount + 1) capacity *= 2;
+            SnapshotStore* grown = map_snapshot_store(capacity);
+            if (store) {
+                grown->validCount = store->validCount;
+                memcpy(grown->snapshots, store->snapshots, sizeof(Context) * store->validCount);
+                munmap(store, sizeof(SnapshotStore) + sizeof(Context) * (size_t)storeCapacity);
+            }
+            store = grown;
+            storeCapacity = capacity;
+        }
+        if (first == 0) {
+            memset(&store->snapshots[0], 0, sizeof(Context));
+            store->snapshots[0].fileName = inputFilePath;
+        }
+        store->validCount = first + 1;
+
+        if (first < program.statementCount) {
+            fprintf(stderr, "[watch] running %s from line %d (statement %d of %d)\n", inputFilePath,
+                    statement_line(&program, first), first + 1, program.statementCount);
+        }
+        fflush(stdout);
+        fflush(stderr);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            Context context;
+            memset(&context, 0, sizeof(context));
+            copy_context(&context, &store->snapshots[first]);
+            run_program(&program, &context, first, store->snapshots, &store->validCount);
+            flush_output();
+            exit(0);
+        }
+        int status = 0;
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "[watch] stopped at statement %d, waiting for changes\n", store->validCount);
+        } else {
+            fprintf(stderr, "[watch] done, waiting for changes\n");
+        }
+    }
+}
+
+int load_program(Program* program, const char* inputFilePath);
+
+// Cooperative scheduling (--fuel N). Every script named on the command line becomes an
+// instance with its own Context, and all instances run on this thread. An instance runs
+// until it has used N more fuel, one unit per statement and per loop back-edge, then
+// execute_program returns at the instruction boundary and the next instance is picked; a
+// paused instance is just its Context, which holds pc and the loop counters. Picking is
+// stride scheduling: an instance with --priority P gets P slices for every slice of a
+// priority 1 instance, and instances of equal priority take turns. --limit N stops an
+// instance for good once it has used N fuel; one whose static estimate needs more
+// statements than that is rejected before it runs. A runtime error ends only its
+// instance. Instances of the same file share one Program.
+#define MAX_INSTANCES 256
+#define SCHEDULER_STRIDE 720720  // Divisible by every priority up to 16, so shares are exact
+
+typedef struct {
+    const char* path;
+    int priority;
+    long long limit;  // Fuel the instance may use, 0 for no limit
+} ScriptSpec;
+
+typedef struct {
+    ScriptSpec spec;
+    Program* program;
+    Context context;
+    long long pass;  // Stride scheduling position, the lowest runs next
+    int finished;
+    long long slices;
+    double readyTime;  // When the instance last became runnable
+    double waitSeconds;
+    double maxWaitSeconds;
+    double runSeconds;
+    double doneSeconds;  // Since the scheduler started
+} Instance;
+
+// Runs an instance until its fuel reaches end, returns 0 if it stopped on a runtime error
+int run_slice(Program* program, Context* context, long long end) {
+    jmp_buf trap;
+    runtimeErrorTrap = &trap;
+    sliceEnd = end;
+    int completed = setjmp(trap) == 0;
+    if (completed) {
+        execute_program(program, context, program->codeCount);
+    }
+    sliceEnd = LLONG_MAX;
+    runtimeErrorTrap = NULL;
+    return completed;
+}
+
+// Returns the number of instances that ended with an error
+int run_scheduled(const ScriptSpec* specs, int count, long long fuel) {
+    Instance* instances = allocate(sizeof(Instance) * count);
+    memset(instances, 0, sizeof(Instance) * count);
+
+    for (int i = 0; i < count; i++) {
+        Instance* instance = &instances[i];
+        instance->spec = specs[i];
+        for (int j = 0; j < i && !instance->program; j++) {
+            if (strcmp(specs[j].path, specs[i].path) == 0) {
+                instance->program = instances[j].program;
+            }
+        }
+        if (!instance->program) {
+            instance->program = allocate(sizeof(Program));
+            memset(instance->program, 0, sizeof(Program));
+            if (!load_program(instance->program, specs[i].path)) {
+                fprintf(stderr, "Error: Could not open input file '%s'.\n", specs[i].path);
+                exit(1);
+            }
+        }
+        instance->context.fileName = specs[i].path;
+    }
+
+    int running = count;
+    for (int i = 0; i < count; i++) {
+        Instance* instance = &instances[i];
+        if (instance->spec.limit <= 0) {
+            continue;
+        }
+        Estimate estimate;
+        estimate_program(instance->program, &estimate);
+        if (estimate.statements.min > instance->spec.limit) {
+            fprintf(stderr, "Error: %s needs at least %lld statements, more than its limit of %lld\n",
+                    instance->spec.path, estimate.statements.min, instance->spec.limit);
+            instance->context.errorCount++;
+            strcpy(instance->context.lastErrorMessage, "Statement limit too low");
+            instance->finished = 1;
+            running--;
+        }
+    }
+
+    double start = monotonic_seconds();
+    for (int i = 0; i < count; i++) {
+        instances[i].readyTime = start;
+    }
+
+    while (running > 0) {
+        Instance* next = NULL;
+        for (int i = 0; i < count; i++) {
+            if (!instances[i].finished && (!next || instances[i].pass < next->pass)) {
+                next = &instances[i];
+            }
+        }
+        Context* context = &next->context;
+        Program* program = next->program;
+
+        double now = monotonic_seconds();
+        double wait = now - next->readyTime;
+        next->waitSeconds += wait;
+        if (wait > next->maxWaitSeconds) {
+            next->maxWaitSeconds = wait;
+        }
+
+        long long used = context_fuel(context);
+        long long slice = fuel;
+        if (next->spec.limit > 0 && next->spec.limit - used < slice) {
+            slice = next->spec.limit - used;
+        }
+        int failed = !run_slice(program, context, used + slice);
+
+        double end = monotonic_seconds();
+        next->runSeconds += end - now;
+        next->slices++;
+        next->pass += SCHEDULER_STRIDE / next->spec.priority;
+        next->readyTime = end;
+
+        if (failed || context->pc >= program->codeCount) {
+            next->finished = 1;  // A runtime error only ends its own instance
+        } else if (next->spec.limit > 0 && context_fuel(context) >= next->spec.limit) {
+            fprintf(stderr, "Error: %s stopped after its limit of %lld fuel\n", next->spec.path, next->spec.limit);
+            context->errorCount++;
+            strcpy(context->lastErrorMessage, "Fuel limit reached");
+            next->finished = 1;
+        }
+        if (next->finished) {
+            next->doneSeconds = end - start;
+            running--;
+        }
+    }
+    flush_output();
+
+    int failures = 0;
+    for (int i = 0; i < count; i++) {
+        Instance* instance = &instances[i];
+        fprintf(stderr, "[schedule] %s: %lld statements, %lld fuel in %lld slices, run %.6fs, wait %.6fs (max %.6fs), done at %.6fs\n",
+                instance->spec.path, instance->context.statementCount, context_fuel(&instance->context), instance->slices, instance->runSeconds,
+                instance->waitSeconds, instance->maxWaitSeconds, instance->doneSeconds);
+        if (instance->context.errorCount > 0) {
+            failures++;
+            fprintf(stderr, "Total errors: %d\n", instance->context.errorCount);
+            fprintf(stderr, "Last error: %s\n", instance->context.lastErrorMessage);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        int shared = 0;
+        for (int j = i + 1; j < count; j++) {
+            shared |= instances[j].program == instances[i].program;
+        }
+        if (!shared) {
+            free_program(instances[i].program);
+            free(instances[i].program);
+        }
+        free(instances[i].context.loopStack);
+    }
+    free(instances);
+    return failures;
+}
+#endif
+
+#ifdef __linux__
+// Server mode (--serve SOCKET). Clients connect to a Unix socket and every connection is a
+// session running the script on its own Context; the compiled program is shared by all of
+// them. Session output is collected while it runs and sent when it yields. A read with no
+// complete input line sends the prompt and returns from execute_program with pc still at
+// the READ instruction, so the session is parked at no cost until epoll reports input. A
+// session that uses up SESSION_FUEL, counted like --fuel with loop back-edges included, goes
+// to the back of the run queue, so no loop holds a thread, not even one with an empty body.
+// --threads N threads serve all sessions, and a runtime error only ends its session, after
+// the error line is sent to the client.
+#define SESSION_FUEL 100000  // Statements and loop back-edges per slice, see context_fuel
+#define SESSION_INPUT_SIZE 1024
+#define SESSION_OUTPUT_RESERVE 65536  // Most output a session buffer is sized for up front
+#define SERVER_EVENTS 64
+
+typedef enum {
+    SESSION_RUNNABLE,  // In the run queue
+    SESSION_INPUT,     // Waiting in a read for EPOLLIN
+    SESSION_OUTPUT     // Waiting for EPOLLOUT to send the rest of its output
+} SessionState;
+
+struct Session {
+    int fd;
+    SessionState state;
+    int finished;      // Closed once its output is sent
+    int waitingInput;  // The last slice stopped at a read
+    int promptShown;   // The prompt of that read was sent
+    int inputEof;
+    int inputLength;
+    char input[SESSION_INPUT_SIZE];
+    OutputBuffer output;
+    size_t outputSent;
+    Session* nextReady;
+    Context context;
+};
+
+typedef struct {
+    Program program;
+    const char* scriptPath;
+    size_t outputReserve;  // Estimated output of one run, up to SESSION_OUTPUT_RESERVE
+    int listenFd;
+    int epollFd;
+    int wakeFd;  // eventfd, written when work is queued while threads sleep in epoll_wait
+    int sleeping;
+    pthread_mutex_t lock;  // Guards the run queue
+    Session* readyHead;
+    Session* readyTail;
+} Server;
+
+Server server;
+
+void session_make_ready(Session* session) {
+    session->state = SESSION_RUNNABLE;
+    session->nextReady = NULL;
+    pthread_mutex_lock(&server.lock);
+    if (server.readyTail) {
+        server.readyTail->nextReady = session;
+    } else {
+        server.readyHead = session;
+    }
+    server.readyTail = session;
+    pthread_mutex_unlock(&server.lock);
+    if (__atomic_load_n(&server.sleeping, __ATOMIC_SEQ_CST) > 0) {
+        uint64_t one = 1;
+        ssize_t ignored = write(server.wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+Session* session_next_ready(void) {
+    pthread_mutex_lock(&server.lock);
+    Session* session = server.readyHead;
+    if (session) {
+        server.readyHead = session->nextReady;
+        if (!server.readyHead) {
+            server.readyTail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&server.lock);
+    return session;
+}
+
+// Sessions are registered with EPOLLONESHOT, so only one thread handles a session at a time
+void session_arm(Session* session, SessionState state) {
+    session->state = state;
+    struct epoll_event event = {0};
+    event.events = (state == SESSION_INPUT ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT;
+    event.data.ptr = session;
+    epoll_ctl(server.epollFd, EPOLL_CTL_MOD, session->fd, &event);
+}
+
+void session_close(Session* session) {
+    epoll_ctl(server.epollFd, EPOLL_CTL_DEL, session->fd, NULL);
+    close(session->fd);
+    free(session->output.data);
+    free(session->context.loopStack);
+    free(session);
+}
+
+// A read can go ahead once a whole line, a line as long as read takes, or end of input is there
+int session_line_ready(Session* session) {
+    return session->inputEof || session->inputLength >= MAX_TEXT_LENGTH ||
+           memchr(session->input, '\n', session->inputLength) != NULL;
+}
+
+// Called at every READ instruction of a session. Without a line to read, the prompt is sent
+// once and the session yields.
+int session_input_ready(Program* program, Instruction* instruction, Context* context) {
+    Session* session = currentSession;
+    if (session_line_ready(session)) {
+        readPromptShown = session->promptShown;
+        session->promptShown = 0;
+        return 1;
+    }
+    if (!session->promptShown) {
+        int index = instruction->start + 1;
+        read_prompt(program->scan.tokens, &index, context, 1);
+        session->promptShown = 1;
+    }
+    session->waitingInput = 1;
+    return 0;
+}
+
+int session_read_line(char* buffer, int size) {
+    Session* session = currentSession;
+    int length = 0;
+    while (length < size - 1 && length < session->inputLength) {
+        buffer[length] = session->input[length];
+        if (buffer[length++] == '\n') break;
+    }
+    session->inputLength -= length;
+    memmove(session->input, session->input + length, session->inputLength);
+    buffer[length] = '\0';
+    return length > 0;
+}
+
+// Sends what the session has written; returns 0 when the client can take no more right now
+int session_send(Session* session) {
+    OutputBuffer* output = &session->output;
+    while (session->outputSent < output->length) {
+        ssize_t sent = send(session->fd, output->data + session->outputSent,
+                            output->length - session->outputSent, MSG_NOSIGNAL);
+        if (sent > 0) {
+            session->outputSent += sent;
+        } else if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else {
+            session->finished = 1;  // The client is gone, nothing more to send
+            break;
+        }
+    }
+    output->length = 0;
+    session->outputSent = 0;
+    return 1;
+}
+
+// Decides what a session waits for next, once its output is sent
+void session_continue(Session* session) {
+    if (session->finished) {
+        session_close(session);
+    } else if (!session->waitingInput) {
+        session_make_ready(session);  // Out of fuel
+    } else if (session_line_ready(session)) {
+        session_make_ready(session);
+    } else {
+        session_arm(session, SESSION_INPUT);
+    }
+}
+
+// Runs a session for one slice on the calling thread
+void session_run(Session* session) {
+    Program* program = &server.program;
+    Context* context = &session->context;
+    jmp_buf trap;
+
+    session->waitingInput = 0;
+    currentSession = session;
+    outputCapture = &session->output;
+    runtimeErrorTrap = &trap;
+    if (setjmp(trap) == 0) {
+        sliceEnd = context_fuel(context) + SESSION_FUEL;
+        execute_program(program, context, program->codeCount);
+        if (context->pc >= program->codeCount) {
+            session->finished = 1;
+        }
+    } else {
+        char line[300];
+        int length = snprintf(line, sizeof(line), "Error: %s\n",
+                              context->lastErrorMessage[0] ? context->lastErrorMessage : "Runtime error");
+        write_output(line, length);
+        session->finished = 1;
+    }
+    sliceEnd = LLONG_MAX;
+    runtimeErrorTrap = NULL;
+    outputCapture = NULL;
+    currentSession = NULL;
+
+    if (session_send(session)) {
+        session_continue(session);
+    } else {
+        session_arm(session, SESSION_OUTPUT);
+    }
+}
+
+void server_accept(void) {
+    for (;;) {
+        int fd = accept(server.listenFd, NULL, NULL);
+        if (fd < 0) {
+            return;  // EAGAIN, or another thread took the connection
+        }
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        Session* session = calloc(1, sizeof(Session));
+        if (session == NULL) {
+            close(fd);
+            continue;
+        }
+        session->fd = fd;
+        session->context.fileName = server.scriptPath;
+        reserve_output(&session->output, server.outputReserve);
+        struct epoll_event event = {0};
+        event.events = EPOLLONESHOT;  // Not watched until the session waits for something
+        event.data.ptr = session;
+        if (epoll_ctl(server.epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close(fd);
+            free(session);
+            continue;
+        }
+        session_make_ready(session);
+    }
+}
+
+// Input for a session parked in a read
+void session_receive(Session* session) {
+    while (session->inputLength < SESSION_INPUT_SIZE) {
+        ssize_t got = read(session->fd, session->input + session->inputLength,
+                           SESSION_INPUT_SIZE - session->inputLength);
+        if (got > 0) {
+            session->inputLength += got;
+        } else if (got < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                session->inputEof = 1;
+            }
+            break;
+        }
+    }
+    session_continue(session);
+}
+
+void* server_thread(void* arg) {
+    (void)arg;
+    stats_attach_thread();
+    struct epoll_event events[SERVER_EVENTS];
+
+    for (;;) {
+        int timeout = 0;
+        pthread_mutex_lock(&server.lock);
+        if (!server.readyHead) {
+            timeout = -1;
+            __atomic_fetch_add(&server.sleeping, 1, __ATOMIC_SEQ_CST);
+        }
+        pthread_mutex_unlock(&server.lock);
+
+        int count = epoll_wait(server.epollFd, events, SERVER_EVENTS, timeout);
+        if (timeout < 0) {
+            __atomic_fetch_sub(&server.sleeping, 1, __ATOMIC_SEQ_CST);
+        }
+        for (int i = 0; i < count; i++) {
+            void* source = events[i].data.ptr;
+            if (source == &server.listenFd) {
+                server_accept();
+            } else if (source == &server.wakeFd) {
+                uint64_t value;
+                ssize_t ignored = read(server.wakeFd, &value, sizeof(value));
+                (void)ignored;
+            } else {
+                Session* session = source;
+                if (session->state == SESSION_RUNNABLE) {
+                    // EPOLLHUP is reported even while nothing is armed. The session is in the
+                    // run queue, so it is left there and finds the client gone when it sends.
+                } else if (session->state == SESSION_INPUT) {
+                    session_receive(session);
+                } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    session_close(session);
+                } else if (session_send(session)) {
+                    session_continue(session);
+                } else {
+                    session_arm(session, SESSION_OUTPUT);
+                }
+            }
+        }
+
+        Session* session = session_next_ready();
+        if (session) {
+            session_run(session);
+        }
+    }
+    return NULL;
+}
+
+void serve(const char* socketPath, const char* inputFilePath, int threads) {
+    if (!load_program(&server.program, inputFilePath)) {
+        fprintf(stderr, "Error: Could not open input file.\n");
+        exit(1);
+    }
+    server.scriptPath = inputFilePath;
+    Estimate estimate;
+    estimate_program(&server.program, &estimate);
+    server.outputReserve = estimate.outputBytes.max < SESSION_OUTPUT_RESERVE ? estimate.outputBytes.max : SESSION_OUTPUT_RESERVE;
+
+    struct sockaddr_un address = {0};
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long\n", socketPath);
+        exit(1);
+    }
+    strcpy(address.sun_path, socketPath);
+    unlink(socketPath);
+    server.listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server.listenFd < 0 || bind(server.listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(server.listenFd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error: Could not listen on '%s'\n", socketPath);
+        exit(1);
+    }
+
+    server.epollFd = epoll_create1(EPOLL_CLOEXEC);
+    server.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&server.lock, NULL);
+    struct epoll_event listenEvent = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = &server.listenFd};
+    struct epoll_event wakeEvent = {.events = EPOLLIN, .data.ptr = &server.wakeFd};
+    if (server.epollFd < 0 || server.wakeFd < 0 ||
+        epoll_ctl(server.epollFd, EPOLL_CTL_ADD, server.listenFd, &listenEvent) != 0 ||
+        epoll_ctl(server.epollFd, EPOLL_CTL_ADD, server.wakeFd, &wakeEvent) != 0) {
+        fprintf(stderr, "Error: Could not set up the event loop\n");
+        exit(1);
+    }
+    fprintf(stderr, "[serve] %s on %s with %d thread%s\n", inputFilePath, socketPath, threads, threads == 1 ? "" : "s");
+
+    for (int t = 1; t < threads; t++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, server_thread, NULL) != 0) {
+            fprintf(stderr, "Error: Could not start a server thread\n");
+            exit(1);
+        }
+    }
+    server_thread(NULL);
+}
+#endif
+
+// Loads, scans and compiles a STAR file; lexical errors stop the interpreter.
+// Returns 0 if the file cannot be opened.
+int load_program(Program* program, const char* inputFilePath) {
+    char* source = load_source(inputFilePath);
+    if (!source) {
+        return 0;
+    }
+    program->source = source;
+    scan_source(source, &program->scan);
+    if (report_diagnostics(&program->scan) > 0) {
+        fprintf(stderr, "Total errors: %d\n", program->scan.diagnosticCount);
+        exit(1);
+    }
+    compile_program(program, 0);
+    return 1;
+}
+
+// Batch mode (--batch RECORDS). Every line of the records file is one run of the script,
+// and its tab-separated fields are the input lines its reads take in order. Runs are
+// executed BATCH_LANES records at a time by a data-parallel copy of the executor: each int
+// variable holds one value per record in a vector, expressions are evaluated lane-wise
+// with the clamp to zero and the overflow check applied as masks, and control flow is
+// shared, which holds because loop counts are literals or uniform across the lanes. A lane
+// whose record overflows, divides by zero or needs a different loop count is switched off
+// and that record is run again on the scalar interpreter; scripts using anything the
+// vector executor does not cover (text variables above all) run every record that way.
+// Output is kept per lane and written in record order. A runtime error ends only its record.
+#define BATCH_LANES 8
+
+typedef int LaneVector __attribute__((vector_size(BATCH_LANES * sizeof(int))));
+
+typedef struct {
+    int* slots;  // Per token: the variable slot of an identifier, -1 for other tokens
+    int slotCount;
+    const char* names[MAX_VARIABLES];
+} BatchPlan;
+
+typedef struct {
+    LaneVector values[MAX_VARIABLES];
+    LaneVector failed;  // -1 in lanes that are switched off
+    int active;
+    const char* input[BATCH_LANES];  // Rest of each lane's record
+    OutputBuffer output[BATCH_LANES];
+    OutputBuffer warnings[BATCH_LANES];
+} BatchLanes;
+
+// Takes the next field of the record as an input line
+int batch_read_line(char* buffer, int size) {
+    int length = 0;
+    while (length < size - 1 && *batchInput != '\0' && *batchInput != '\t') {
+        buffer[length++] = *batchInput++;
+    }
+    if (*batchInput == '\t' && length < size - 1) {
+        buffer[length++] = '\n';
+        batchInput++;
+    } else if (*batchInput == '\0' && length == 0) {
+        return 0;
+    }
+    buffer[length] = '\0';
+    return 1;
+}
+
+int batch_slot(BatchPlan* plan, const char* name) {
+    for (int i = 0; i < plan->slotCount; i++) {
+        if (strcmp(plan->names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// An identifier token naming a declared int variable
+int batch_use(BatchPlan* plan, const Token* tokens, int index) {
+    if (tokens[index].type != TOKEN_IDENTIFIER) {
+        return 0;
+    }
+    plan->slots[index] = batch_slot(plan, tokens[index].value);
+    return plan->slots[index] >= 0;
+}
+
+// Checks an expression the way eval_expression_helper reads it, returns the index past it
+// or -1. Parentheses have to balance before the closing '.'.
+int batch_check_expression(BatchPlan* plan, const Token* tokens, int index, int depth) {
+    int operandSet = 0;
+    for (;;) {
+        Token token = tokens[index];
+        if (token.type == TOKEN_INTEGER || token.type == TOKEN_IDENTIFIER) {
+            if (token.type == TOKEN_IDENTIFIER && !batch_use(plan, tokens, index)) {
+                return -1;
+            }
+            operandSet = 1;
+            index++;
+        } else if (token.type == TOKEN_LEFT_PAREN) {
+            index = batch_check_expression(plan, tokens, index + 1, depth + 1);
+            if (index < 0) {
+                return -1;
+            }
+            operandSet = 1;
+        } else if (token.type == TOKEN_OPERATOR && operandSet) {
+            operandSet = 0;
+            index++;
+        } else if (token.type == TOKEN_RIGHT_PAREN && depth > 0) {
+            return index + 1;
+        } else if (token.type == TOKEN_END_OF_LINE && depth == 0) {
+            return index + 1;
+        } else {
+            return -1;
+        }
+    }
+}
+
+// Checks one statement instruction; declarations add slots
+int batch_check_statement(BatchPlan* plan, const Token* tokens, int index, int inLoop) {
+    Token token = tokens[index++];
+    if (token.type == TOKEN_END_OF_LINE) {
+        return 1;
+    }
+    if (token.type == TOKEN_KEYWORD && strcmp(token.value, "int") == 0) {
+        if (inLoop) {
+            return 0;  // Whether it is declared after the loop depends on the count
+        }
+        for (;;) {
+            if (tokens[index].type != TOKEN_IDENTIFIER) {
+                return 0;
+            }
+            if (batch_slot(plan, tokens[index].value) < 0) {
+                if (plan->slotCount == MAX_VARIABLES) {
+                    return 0;
+                }
+                plan->names[plan->slotCount++] = tokens[index].value;
+            }
+            batch_use(plan, tokens, index++);
+            if (tokens[index].type == TOKEN_KEYWORD && strcmp(tokens[index].value, "is") == 0) {
+                if (tokens[index + 1].type != TOKEN_INTEGER) {
+                    return 0;
+                }
+                index += 2;
+            }
+            if (tokens[index].type == TOKEN_END_OF_LINE) {
+                return 1;
+            }
+            if (tokens[index++].type != TOKEN_COMMA) {
+                return 0;
+            }
+        }
+    }
+    if (token.type == TOKEN_IDENTIFIER) {
+        return batch_use(plan, tokens, index - 1) && tokens[index].type == TOKEN_KEYWORD &&
+               strcmp(tokens[index].value, "is") == 0 && batch_check_expression(plan, tokens, index + 1, 0) >= 0;
+    }
+    if (token.type == TOKEN_KEYWORD && strcmp(token.value, "write") == 0) {
+        for (; tokens[index].type != TOKEN_END_OF_LINE; index++) {
+            if (tokens[index].type == TOKEN_END_OF_FILE ||
+                (tokens[index].type == TOKEN_IDENTIFIER && !batch_use(plan, tokens, index))) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (token.type == TOKEN_KEYWORD && strcmp(token.value, "newLine") == 0) {
+        return tokens[index].type == TOKEN_END_OF_LINE;
+    }
+    if (token.type == TOKEN_KEYWORD && strcmp(token.value, "read") == 0) {
+        if (tokens[index].type == TOKEN_STRING) {
+            index++;
+        }
+        if (tokens[index].type == TOKEN_COMMA) {
+            index++;
+        }
+        return batch_use(plan, tokens, index) && tokens[index + 1].type == TOKEN_END_OF_LINE;
+    }
+    return 0;
+}
+
+// Returns 0 when the program needs the scalar interpreter
+int plan_batch(Program* program, BatchPlan* plan) {
+    const Token* tokens = program->scan.tokens;
+    plan->slots = allocate(sizeof(int) * program->scan.tokenCount);
+    for (int i = 0; i < program->scan.tokenCount; i++) {
+        plan->slots[i] = -1;
+    }
+    plan->slotCount = 0;
+
+    int depth = 0;
+    for (int pc = 0; pc < program->codeCount; pc++) {
+        Instruction* instruction = &program->code[pc];
+        if (instruction->kind == INSTRUCTION_TRAP) {
+            return 0;
+        } else if (instruction->kind == INSTRUCTION_LOOP) {
+            if (tokens[instruction->start].type == TOKEN_IDENTIFIER && !batch_use(plan, tokens, instruction->start)) {
+                return 0;
+            }
+            depth++;
+        } else if (instruction->kind == INSTRUCTION_END_LOOP) {
+            depth--;
+        } else if (!batch_check_statement(plan, tokens, instruction->start, depth > 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Switches off the lanes set in mask. Vectors are passed by pointer throughout, so the code
+// does not depend on the vector calling convention of the target.
+void batch_fail(BatchLanes* lanes, const LaneVector* mask) {
+    LaneVector failing = *mask & ~lanes->failed;
+    for (int lane = 0; lane < BATCH_LANES; lane++) {
+        lanes->active -= failing[lane] != 0;
+    }
+    lanes->failed |= failing;
 }
 
-void process_line(const char* line, FILE* outputFile, int* is_comment_open, int* open_curly_brackets) {
+void batch_fail_lane(BatchLanes* lanes, int lane) {
+    LaneVector mask = {0};
+    mask[lane] = -1;
+    batch_fail(lanes, &mask);
+}
+
+void batch_write(BatchLanes* lanes, const char* data, size_t length) {
+    for (int lane = 0; lane < BATCH_LANES; lane++) {
+        if (!lanes->failed[lane]) {
+            STAT_ADD(bytesWritten, length);
+            append_output(&lanes->output[lane], data, length);
+        }
+    }
+}
 
+void batch_apply(LaneVector* result, char operator, const LaneVector* value, BatchLanes* lanes) {
+    if (operator == '+') {
+        *result += *value;
+    } else if (operator == '-') {
+        *result -= *value;
+    } else if (operator == '*') {
+        *result *= *value;
+    } else if (operator == '/') {
+        LaneVector zero = *value == 0;
+        batch_fail(lanes, &zero);
+        LaneVector unused = zero | lanes->failed;  // Divided by 1 so no lane can trap
+        *result /= (*value & ~unused) | (unused & 1);
+    }
+}
 
-    int i = 0;
-    int len = strlen(line);
+// eval_expression_helper on every lane at once
+void batch_expression(BatchPlan* plan, const Token* tokens, int* index, BatchLanes* lanes, LaneVector* result) {
+    LaneVector value = {0};
+    int operandSet = 0;
+    char operator = '+';
+    *result = (LaneVector){0};
 
-    if (*is_comment_open) { // using flag for comments
-        char* comment_end = strstr(line, "*/");
-        if (comment_end) {
-            *is_comment_open = 0;  // Comment closed
-            i = comment_end - line + 2;  // Continue processing
+    for (;;) {
+        Token token = tokens[(*index)++];
+        if (token.type == TOKEN_INTEGER) {
+            value = (LaneVector){0} + token.number;
+            operandSet = 1;
+        } else if (token.type == TOKEN_IDENTIFIER) {
+            value = lanes->values[plan->slots[*index - 1]];
+            operandSet = 1;
+        } else if (token.type == TOKEN_LEFT_PAREN) {
+            batch_expression(plan, tokens, index, lanes, &value);
+            operandSet = 1;
+        } else if (token.type == TOKEN_OPERATOR) {
+            batch_apply(result, operator, &value, lanes);
+            operator = token.value[0];
+            operandSet = 0;
         } else {
-            return;  // Comment is still open
+            break;  // ')' or '.'
         }
     }
+    if (operandSet) {
+        batch_apply(result, operator, &value, lanes);
+    }
+}
 
-    while (i < len) {
-        while (isspace(line[i])) i++; // Skip whitespace
-        if (line[i] == '\0') continue;  // If at the end of the line
+// check_integer on every lane: negative values become zero, lanes above the maximum fail
+void batch_check_integer(LaneVector* value, BatchLanes* lanes) {
+    *value &= ~(*value < 0);
+    LaneVector overflow = *value > MAX_INTEGER_VALUE;
+    batch_fail(lanes, &overflow);
+}
 
-        // Handle potential negative integers
-        if (line[i] == '-' && isdigit(line[i + 1])) {
-            fprintf(outputFile, "Error: Negative integer.\n");
-            i++;
-            while (isdigit(line[i])) i++; // Skip the rest of the integer
+void batch_read(BatchPlan* plan, const Token* tokens, int index, BatchLanes* lanes) {
+    if (tokens[index].type == TOKEN_STRING) {
+        batch_write(lanes, tokens[index].value, strlen(tokens[index].value));
+        index++;
+    }
+    if (tokens[index].type == TOKEN_COMMA) {
+        index++;
+    }
+    const char* name = tokens[index].value;
+    LaneVector* target = &lanes->values[plan->slots[index]];
+
+    for (int lane = 0; lane < BATCH_LANES; lane++) {
+        if (lanes->failed[lane]) {
             continue;
         }
-
-        // Handle operator tokens
-        if (is_operator(line[i])) {
-            i++;
+        const char* field = lanes->input[lane];
+        size_t length = strcspn(field, "\t");
+        if (length >= MAX_TEXT_LENGTH) {
+            batch_fail_lane(lanes, lane);  // read would split it over two fields
             continue;
         }
+        char input[MAX_TEXT_LENGTH + 1];
+        memcpy(input, field, length);
+        input[length] = '\0';
+        lanes->input[lane] = field + length + (field[length] == '\t');
 
-        // Handle various other token types
-        switch (line[i]) {
-            case '.':  // End-of-line token
-                i++;
-                break;
-            case ',': // Comma token
-                i++;
-                break;
-            case '{': // Left curly bracket token
-                (*open_curly_brackets)++;
-                i++;
-                break;
-            case '}': // Right curly bracket token
-                if (*open_curly_brackets > 0) {
-                    (*open_curly_brackets)--;
-                } else {
-                    fprintf(outputFile, "Error: Unmatched right curly bracket.\n");
+        int value;
+        if (!parse_integer_input(input, &value)) {
+            char warning[MAX_TEXT_LENGTH + MAX_IDENTIFIER_LENGTH + 64];
+            int warningLength = snprintf(warning, sizeof(warning), "Warning: '%s' is not a valid integer, '%s' is set to 0\n", input, name);
+            append_output(&lanes->warnings[lane], warning, warningLength);
+        }
+        (*target)[lane] = value;
+    }
+}
+
+void batch_statement(BatchPlan* plan, const Token* tokens, int index, BatchLanes* lanes) {
+    Token token = tokens[index++];
+    if (token.type == TOKEN_END_OF_LINE) {
+        return;
+    }
+
+    if (token.type == TOKEN_IDENTIFIER) {
+        STAT_ADD(statements[STATEMENT_ASSIGNMENT], lanes->active);
+        int slot = plan->slots[index - 1];
+        index++;  // is
+        LaneVector value;
+        batch_expression(plan, tokens, &index, lanes, &value);
+        batch_check_integer(&value, lanes);
+        lanes->values[slot] = value;
+    } else if (strcmp(token.value, "int") == 0) {
+        STAT_ADD(statements[STATEMENT_DECLARATION], lanes->active);
+        for (; tokens[index].type != TOKEN_END_OF_LINE; index++) {
+            if (tokens[index].type == TOKEN_IDENTIFIER) {
+                int value = tokens[index + 1].type == TOKEN_KEYWORD ? tokens[index + 2].number : 0;
+                lanes->values[plan->slots[index]] = (LaneVector){0} + value;
+            }
+        }
+    } else if (strcmp(token.value, "write") == 0) {
+        STAT_ADD(statements[STATEMENT_WRITE], lanes->active);
+        for (; tokens[index].type != TOKEN_END_OF_LINE; index++) {
+            token = tokens[index];
+            if (token.type == TOKEN_IDENTIFIER) {
+                LaneVector values = lanes->values[plan->slots[index]];
+                for (int lane = 0; lane < BATCH_LANES; lane++) {
+                    if (!lanes->failed[lane]) {
+                        char digits[MAX_INTEGER_LENGTH + 1];
+                        int length = format_integer(digits, values[lane]);
+                        STAT_ADD(bytesWritten, length);
+                        append_output(&lanes->output[lane], digits, length);
+                    }
                 }
-                i++;
+            } else if (token.type == TOKEN_STRING || token.type == TOKEN_INTEGER) {
+                batch_write(lanes, token.value, strlen(token.value));
+            } else if (token.type == TOKEN_COMMA) {
+                batch_write(lanes, " ", 1);
+            }
+        }
+    } else {
+        STAT_ADD(statements[STATEMENT_NEWLINE], lanes->active);
+        batch_write(lanes, "\n", 1);
+    }
+}
+
+// execute_program for all lanes at once; stops early when every lane is switched off
+void batch_execute(Program* program, BatchPlan* plan, BatchLanes* lanes) {
+    const Token* tokens = program->scan.tokens;
+    LoopFrame* loopStack = allocate(sizeof(LoopFrame) * (program->loopNesting + 1));
+    int loopDepth = 0;
+    int pc = 0;
+
+    while (pc < program->codeCount && lanes->active > 0) {
+        Instruction* instruction = &program->code[pc];
+        int index = instruction->start;
+
+        switch (instruction->kind) {
+            case INSTRUCTION_STATEMENT:
+                batch_statement(plan, tokens, index, lanes);
+                pc++;
                 break;
-            case '(': // Left parenthesis token
-            case ')': // Right parenthesis token
-                i++;
+            case INSTRUCTION_READ:
+                STAT_ADD(statements[STATEMENT_READ], lanes->active);
+                batch_read(plan, tokens, index + 1, lanes);
+                pc++;
                 break;
-            default:
-                // Handle identifiers and keywords
-                if (isalpha(line[i])) {
-                    int start = i;
-                    int length = 0;
-                    while (isalnum(line[i]) || line[i] == '_') {
-                        length++;
-                        if (length > MAX_IDENTIFIER_LENGTH) {
-                            fprintf(outputFile, "Error: Identifier too long.\n");
-                            while (isalnum(line[i]) || line[i] == '_') {  // Skip the long identifier
-                                i++;
-                            }
+            case INSTRUCTION_LOOP: {
+                STAT_ADD(statements[STATEMENT_LOOP], lanes->active);
+                int count = tokens[index].number;
+                if (tokens[index].type == TOKEN_IDENTIFIER) {
+                    // Lanes that need another count than the first active lane leave the batch
+                    LaneVector counts = lanes->values[plan->slots[index]];
+                    for (int lane = 0; lane < BATCH_LANES; lane++) {
+                        if (!lanes->failed[lane]) {
+                            count = counts[lane];
                             break;
                         }
-                        i++;
-                    }
-                    if (length <= MAX_IDENTIFIER_LENGTH) {
-                        handle_identifier(outputFile, line + start, length);
                     }
-                    continue;
+                    LaneVector diverging = counts != count;
+                    batch_fail(lanes, &diverging);
                 }
-
-                // Handle integer tokens
-                if (isdigit(line[i])) {
-                    int start = i;
-                    int length = 0;
-                    while (isdigit(line[i])) {
-                        length++;
-                        if (length > MAX_INTEGER_LENGTH) {
-                            fprintf(outputFile, "Error: Integer too long.\n");
-                            while (isdigit(line[i])) i++;  // Skip the long integer
-                            break;
-                        }
-                        i++;
-                    }
-                    if (length <= MAX_INTEGER_LENGTH) {
-                        handle_integer(outputFile, line + start, length);
-                    }
-                    continue;
+                if (count <= 0) {
+                    pc = instruction->jump + 1;
+                    break;
                 }
+                loopStack[loopDepth].loop = pc;
+                loopStack[loopDepth++].remaining = count;
+                pc++;
+                break;
+            }
+            case INSTRUCTION_END_LOOP:
+                if (--loopStack[loopDepth - 1].remaining > 0) {
+                    pc = loopStack[loopDepth - 1].loop + 1;
+                } else {
+                    loopDepth--;
+                    pc++;
+                }
+                break;
+            case INSTRUCTION_TRAP:  // Not reached, batch_plan turns down programs with probes
+                pc++;
+                break;
+        }
+    }
+    free(loopStack);
+}
 
-                // Handle string tokens, check for unclosed or invalid strings
-                if (line[i] == '"') {
-                    int start = i;
-                    int length = 1;
-                    i++;
-                    int string_too_long = 0;
-
-                    while (line[i] != '"' && i < len) {
-                        length++;
-                        if (length > MAX_STRING_LENGTH) {
-                            string_too_long = 1;
-                            break;
-                        }
-                        i++;
-                    }
+// Runs one record on the scalar interpreter, returns 0 if it stopped on a runtime error
+int batch_run_scalar(Program* program, const char* record, const char* inputFilePath) {
+    static Context context;
+    LoopFrame* loopStack = context.loopStack;  // Kept from record to record
+    int loopCapacity = context.loopCapacity;
+    memset(&context, 0, sizeof(context));
+    context.loopStack = loopStack;
+    context.loopCapacity = loopCapacity;
+    context.fileName = inputFilePath;
+    jmp_buf trap;
 
-                    if (string_too_long) {
-                        fprintf(outputFile, "Error: String too long.\n");
-                        while (line[i] != '\0' && line[i] != '"') i++; // Skip until end of the string or line
-                        if (line[i] == '"') i++; // Skip the closing quote if present
-                        continue;
-                    }
+    batchInput = record;
+    runtimeErrorTrap = &trap;
+    int completed = setjmp(trap) == 0;
+    if (completed) {
+        execute_program(program, &context, program->codeCount);
+    }
+    runtimeErrorTrap = NULL;
+    batchInput = NULL;
 
-                    if (line[i] == '"') {
-                        length++;  // Include the closing quote
+    if (completed && context.errorCount > 0) {
+        fprintf(stderr, "Total errors: %d\n", context.errorCount);
+        fprintf(stderr, "Last error: %s\n", context.lastErrorMessage);
+    }
+    return completed;
+}
 
-                        // Check if the string contains a double quote inside it
-                        int isInvalidString = 0;
+// Returns the number of records that stopped on a runtime error
+int run_batch(const char* recordsPath, const char* inputFilePath) {
+    Program program = {0};
+    if (!load_program(&program, inputFilePath)) {
+        fprintf(stderr, "Error: Could not open input file.\n");
+        exit(1);
+    }
+    char* data = load_source(recordsPath);
+    if (!data) {
+        fprintf(stderr, "Error: Could not open records file '%s'\n", recordsPath);
+        exit(1);
+    }
 
-                        handle_string(outputFile, line + start, length); // Handle the valid string
+    const char** records = NULL;
+    int recordCount = 0;
+    int recordCapacity = 0;
+    for (char* line = data; *line != '\0';) {
+        char* end = line + strcspn(line, "\n");
+        char* next = *end ? end + 1 : end;
+        if (end > line && end[-1] == '\r') end--;
+        *end = '\0';
+        if (recordCount == recordCapacity) {
+            records = grow_table(records, &recordCapacity, sizeof(const char*));
+        }
+        records[recordCount++] = line;
+        line = next;
+    }
 
-                        for (int j = i + 1; j < strlen(line); j++) {
-                            if (line[j] == '"') {
-                                isInvalidString = 1;
-                                break;
-                            }
-                            i = j + 2; // Move past the string
-                        }
+    BatchPlan plan = {0};
+    int vector = plan_batch(&program, &plan);
+    BatchLanes* lanes = allocate(sizeof(BatchLanes));
+    memset(lanes, 0, sizeof(BatchLanes));
+    int failures = 0;
 
-                        if (isInvalidString) {
-                            fprintf(outputFile, "Error: String contains double quotes.\n");
-                            continue;
-                        }
+    for (int first = 0; first < recordCount; first += BATCH_LANES) {
+        int count = recordCount - first < BATCH_LANES ? recordCount - first : BATCH_LANES;
+        if (vector) {
+            memset(lanes->values, 0, sizeof(LaneVector) * plan.slotCount);
+            for (int lane = 0; lane < BATCH_LANES; lane++) {
+                lanes->failed[lane] = lane < count ? 0 : -1;
+                lanes->input[lane] = lane < count ? records[first + lane] : "";
+                lanes->output[lane].length = 0;
+                lanes->warnings[lane].length = 0;
+            }
+            lanes->active = count;
+            batch_execute(&program, &plan, lanes);
+        }
 
-                    } else {
-                        fprintf(outputFile, "Error: Unclosed string.\n"); // If the string isn't closed
-                    }
-                    continue;
+        for (int lane = 0; lane < count; lane++) {
+            if (vector && !lanes->failed[lane]) {
+                emit_output(lanes->output[lane].data, lanes->output[lane].length);
+                if (lanes->warnings[lane].length > 0) {
+                    flush_output();
+                    fwrite(lanes->warnings[lane].data, 1, lanes->warnings[lane].length, stderr);
                 }
-
-                fprintf(outputFile, "Error: Unrecognized token.\n"); // If none of the conditions were met
-                i++;
-                break;
+            } else {
+                failures += !batch_run_scalar(&program, records[first + lane], inputFilePath);
+            }
         }
     }
+    flush_output();
+
+    for (int lane = 0; lane < BATCH_LANES; lane++) {
+        free(lanes->output[lane].data);
+        free(lanes->warnings[lane].data);
+    }
+    free(lanes);
+    free(plan.slots);
+    free(records);
+    free(data);
+    free_program(&program);
+    return failures;
 }
+#ifndef _WIN32
+// Streaming mode (--stream). For very large generated scripts the file is not loaded and
+// compiled as a whole. A lexer thread reads it in blocks and cuts it into chunks of whole
+// lines that end a top-level statement, so loops and blocks are never split, and scans each
+// chunk; a compiler thread compiles the chunks; the main thread executes them in order as
+// they arrive. The stages are connected by bounded queues, so execution starts with the
+// first chunk and memory is bounded by the queue depth rather than by the file size.
+// Lexical errors are reported when the chunk holding them is reached.
+#define STREAM_CHUNK_BYTES (256 * 1024)  // Chunks are cut at the first statement end after this
+#define STREAM_READ_BYTES (1024 * 1024)
+#define STREAM_QUEUE_DEPTH 4
 
-int handleCurlyBrackets(const char *line, int *index, Stack *stack) {
-    while (line[*index] != '\0') {
-        if (line[*index] == '{') {
-            push(stack, '{');
-        } else if (line[*index] == '}') {
-            if (isStackEmpty(stack)) {
-                return 0; // Mismatched closing bracket
-            }
-            pop(stack);
-        }
-        (*index)++;
+typedef struct {
+    Program* items[STREAM_QUEUE_DEPTH];
+    int head;
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+} ChunkQueue;
+
+typedef struct {
+    FILE* file;
+    ChunkQueue scanned;   // Lexer to compiler
+    ChunkQueue compiled;  // Compiler to executor
+    pthread_t lexer;
+    pthread_t compiler;
+} Stream;
+
+void chunk_queue_init(ChunkQueue* queue) {
+    queue->head = 0;
+    queue->count = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+}
+
+// NULL marks the end of the stream
+void chunk_queue_push(ChunkQueue* queue, Program* chunk) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == STREAM_QUEUE_DEPTH) {
+        pthread_cond_wait(&queue->notFull, &queue->lock);
     }
-    return isStackEmpty(stack); // 1 if matched, 0 if unmatched
+    queue->items[(queue->head + queue->count++) % STREAM_QUEUE_DEPTH] = chunk;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
 }
 
-void handle_loop(const char *line, int *index, Context *context) {
-    Token token = getNextToken(line, index);
-    if (token.type != TOKEN_INTEGER) {
-        fprintf(stderr, "Error: Expected integer for loop count\n");
-        exit(1);
+Program* chunk_queue_pop(ChunkQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
     }
+    Program* chunk = queue->items[queue->head];
+    queue->head = (queue->head + 1) % STREAM_QUEUE_DEPTH;
+    queue->count--;
+    pthread_cond_signal(&queue->notFull);
+    pthread_mutex_unlock(&queue->lock);
+    return chunk;
+}
 
-    context->loopCount = atoi(token.value);  // Burada loopCount değişkenini kullanıyoruz
-    int bodyStart = *index;
-    int openBrackets = 0;
-    int isCommentOpen = 0;
-    int bodyEnd = bodyStart;
+// Scans length bytes of source that start on line firstLine into a new chunk
+Program* scan_chunk(const char* source, size_t length, int firstLine, int firstOffset) {
+    Program* chunk = allocate(sizeof(Program));
+    memset(chunk, 0, sizeof(Program));
+    chunk->source = allocate(length + 1);
+    memcpy(chunk->source, source, length);
+    chunk->source[length] = '\0';
+    scan_source(chunk->source, &chunk->scan);
+    for (int i = 0; i < chunk->scan.tokenCount; i++) {
+        chunk->scan.tokens[i].line += firstLine - 1;
+        chunk->scan.tokens[i].offset += firstOffset;
+    }
+    for (int i = 0; i < chunk->scan.diagnosticCount; i++) {
+        chunk->scan.diagnostics[i].line += firstLine - 1;
+    }
+    return chunk;
+}
 
-    while (line[bodyEnd] != '\0') {
-        if (line[bodyEnd] == '/' && line[bodyEnd + 1] == '*') {
-            isCommentOpen = 1;
-            bodyEnd += 2;
-            continue;
-        }
-        if (line[bodyEnd] == '*' && line[bodyEnd + 1] == '/') {
-            isCommentOpen = 0;
-            bodyEnd += 2;
-            continue;
+// Reads the file and cuts it into chunks. The cut follows the scanner's rules for comments
+// and strings, and only falls on a newline where no bracket or comment is open and the last
+// token was a '.' or a '}', which is where a top-level statement ends.
+void* stream_lexer(void* arg) {
+    Stream* stream = arg;
+    stats_attach_thread();
+    size_t capacity = 2 * STREAM_READ_BYTES;
+    char* buffer = allocate(capacity + 1);
+    size_t length = 0;
+    size_t scanned = 0;    // Bytes the cutter has looked at
+    size_t cut = 0;        // End of the last complete statement seen
+    int lines = 1;         // Line at scanned
+    int cutLines = 1;      // Line at cut
+    int chunkLine = 1;     // First line of the buffered text
+    int chunkOffset = 0;   // Its position in the file
+    int inComment = 0;
+    int inString = 0;
+    int brackets = 0;
+    char last = '\0';
+    int eof = 0;
+
+    for (;;) {
+        if (!eof && scanned + 1 >= length) {
+            if (length + STREAM_READ_BYTES > capacity) {
+                capacity = 2 * (length + STREAM_READ_BYTES);  // A statement longer than a chunk
+                buffer = realloc(buffer, capacity + 1);
+                if (buffer == NULL) {
+                    fprintf(stderr, "Memory allocation error\n");
+                    exit(1);
+                }
+            }
+            size_t n = fread(buffer + length, 1, STREAM_READ_BYTES, stream->file);
+            length += n;
+            eof = n == 0;
+            buffer[length] = '\0';
         }
 
-        if (!isCommentOpen) {
-            if (line[bodyEnd] == '{') {
-                openBrackets++;
-            } else if (line[bodyEnd] == '}') {
-                openBrackets--;
-                if (openBrackets == 0) {
-                    break;
+        // Two-character sequences are only decided once their second byte has been read
+        while (scanned < length && (eof || scanned + 1 < length) && cut < STREAM_CHUNK_BYTES) {
+            char c = buffer[scanned];
+            if (c == '\n') {
+                inString = 0;  // Strings end on the line they start
+                lines++;
+                if (!inComment && brackets == 0 && (last == '.' || last == '}')) {
+                    cut = scanned + 1;
+                    cutLines = lines;
+                }
+            } else if (inComment) {
+                if (c == '*' && buffer[scanned + 1] == '/') {
+                    inComment = 0;
+                    scanned++;
                 }
+            } else if (inString) {
+                inString = c != '"';
+            } else if (c == '/' && buffer[scanned + 1] == '*') {
+                inComment = 1;
+                scanned++;
+            } else if (!isspace((unsigned char)c)) {
+                inString = c == '"';
+                brackets += c == '{';
+                brackets -= c == '}' && brackets > 0;
+                last = c;
             }
+            scanned++;
         }
-        bodyEnd++;
+
+        size_t end = cut >= STREAM_CHUNK_BYTES ? cut : eof && scanned == length ? length : 0;
+        if (end == 0) {
+            if (eof) break;
+            continue;
+        }
+        chunk_queue_push(&stream->scanned, scan_chunk(buffer, end, chunkLine, chunkOffset));
+        memmove(buffer, buffer + end, length - end + 1);
+        length -= end;
+        scanned -= end;
+        chunkLine = end == cut ? cutLines : lines;
+        chunkOffset += end;
+        cut = 0;
     }
+    free(buffer);
+    chunk_queue_push(&stream->scanned, NULL);
+    return NULL;
+}
+
+void* stream_compiler(void* arg) {
+    Stream* stream = arg;
+    stats_attach_thread();
+    Program* chunk;
+    do {
+        chunk = chunk_queue_pop(&stream->scanned);
+        if (chunk && chunk->scan.diagnosticCount == 0) {
+            compile_program(chunk, 0);
+        }
+        chunk_queue_push(&stream->compiled, chunk);
+    } while (chunk);
+    return NULL;
+}
 
-    if (openBrackets != 0) {
-        fprintf(stderr, "Error: Mismatched curly brackets in loop body\n");
+void run_stream(const char* inputFilePath) {
+    Stream stream;
+    stream.file = fopen(inputFilePath, "rb");
+    if (!stream.file) {
+        fprintf(stderr, "Error: Could not open input file.\n");
+        return;
+    }
+    chunk_queue_init(&stream.scanned);
+    chunk_queue_init(&stream.compiled);
+    if (pthread_create(&stream.lexer, NULL, stream_lexer, &stream) != 0 ||
+        pthread_create(&stream.compiler, NULL, stream_compiler, &stream) != 0) {
+        fprintf(stderr, "Error: Could not start the streaming threads\n");
         exit(1);
     }
 
-    char loopBody[1024];
-    strncpy(loopBody, line + bodyStart, bodyEnd - bodyStart);
-    loopBody[bodyEnd - bodyStart] = '\0';
-
-    for (int i = 0; i < context->loopCount; i++) {
-        int bodyIndex = 0;
-        while (bodyIndex < strlen(loopBody)) {
-            char lineBuffer[1024];
-            int lineEnd = 0;
-            while (loopBody[bodyIndex + lineEnd] != '\n' && loopBody[bodyIndex + lineEnd] != '\0') {
-                lineEnd++;
-            }
-            strncpy(lineBuffer, loopBody + bodyIndex, lineEnd);
-            lineBuffer[lineEnd] = '\0';
-            execute_line(lineBuffer, context);
-            bodyIndex += lineEnd + 1;
+    Context context = {0};
+    context.fileName = inputFilePath;
+    Program* chunk;
+    while ((chunk = chunk_queue_pop(&stream.compiled)) != NULL) {
+        if (report_diagnostics(&chunk->scan) > 0) {
+            flush_output();
+            fprintf(stderr, "Total errors: %d\n", chunk->scan.diagnosticCount);
+            exit(1);
         }
+        run_program(chunk, &context, 0, NULL, NULL);
+        free_program(chunk);
+        free(chunk);
+    }
+    pthread_join(stream.lexer, NULL);
+    pthread_join(stream.compiler, NULL);
+    fclose(stream.file);
+
+    if (context.errorCount > 0) {
+        fprintf(stderr, "Total errors: %d\n", context.errorCount);
+        fprintf(stderr, "Last error: %s\n", context.lastErrorMessage);
     }
 }
+#endif
 
-// Çok satırlı yorumlar için kontrol
-void process_multiline_comments_and_brackets(const char* line, int* index, int* isCommentOpen, int* openBrackets) {
-    while (line[*index] != '\0') {
-        if (line[*index] == '/' && line[*index + 1] == '*') {
-            *isCommentOpen = 1;
-            *index += 2;
-            continue;
+// Editor mode (--lex-edits). The script is lexed once into a LexDocument; then every edit
+// read from stdin as "OFFSET REMOVED LENGTH" followed by LENGTH bytes of inserted text is
+// applied with lex_edit. The diagnostics and "Total errors: N" are printed to stdout after
+// the initial text and after every edit.
+void write_lex_diagnostics(const LexDocument* document) {
+    const Diagnostic* diagnostics;
+    int count = lex_diagnostics(document, &diagnostics);
+    for (int i = 0; i < count; i++) {
+        printf("Error: %s (line %d, column %d).\n", diagnostics[i].message, diagnostics[i].line, diagnostics[i].column);
+    }
+    printf("Total errors: %d\n", count);
+    fflush(stdout);
+}
+
+void run_lex_edits(const char* inputFilePath) {
+    char* source = load_source(inputFilePath);
+    if (!source) {
+        fprintf(stderr, "Error: Could not open input file.\n");
+        return;
+    }
+    LexDocument* document = lex_open(source);
+    free(source);
+    write_lex_diagnostics(document);
+
+    long long offset, removed, length;
+    while (scanf("%lld %lld %lld", &offset, &removed, &length) == 3 && length >= 0 && getchar() == '\n') {
+        char* inserted = allocate(length + 1);
+        if ((long long)fread(inserted, 1, length, stdin) != length) {
+            free(inserted);
+            break;
         }
-        if (line[*index] == '*' && line[*index + 1] == '/') {
-            *isCommentOpen = 0;
-            *index += 2;
-            continue;
+        if (!lex_edit(document, offset, removed, inserted, length)) {
+            fprintf(stderr, "Error: Invalid edit at offset %lld\n", offset);
         }
+        free(inserted);
+        write_lex_diagnostics(document);
+    }
+    lex_close(document);
+}
 
-        if (!*isCommentOpen) {
-            if (line[*index] == '{') {
-                (*openBrackets)++;
-            } else if (line[*index] == '}') {
-                (*openBrackets)--;
-                if (*openBrackets == 0) {
-                    break;
-                }
-            }
-        }
-        (*index)++;
+void write_estimate_range(const char* name, const EstimateRange* range, const char* separator) {
+    printf("  \"%s\": {\"min\": %lld, \"max\": ", name, range->min);
+    if (range->max == ESTIMATE_UNBOUNDED) {
+        printf("null");
+    } else {
+        printf("%lld", range->max);
     }
+    printf("}%s\n", separator);
 }
 
-void lexicalAnalyzer(const char* inputFilePath, const char* outputFilePath) {
-    FILE* inputFile = fopen(inputFilePath, "r");
-    if (!inputFile) {
+// Prints the estimate of a script as JSON, without running it
+void run_estimate(const char* inputFilePath) {
+    Program program = {0};
+    if (!load_program(&program, inputFilePath)) {
         fprintf(stderr, "Error: Could not open input file.\n");
         return;
     }
+    Estimate estimate;
+    estimate_program(&program, &estimate);
+    free_program(&program);
 
-    FILE* outputFile = fopen(outputFilePath, "w");
-    if (!outputFile) {
-        fclose(inputFile);
-        fprintf(stderr, "Error: Could not open output file.\n");
-        return;
+    int exact = !estimate.mayFail;
+    const EstimateRange* ranges[] = {&estimate.statements, &estimate.outputBytes, &estimate.reads, &estimate.peakTextBytes};
+    for (int r = 0; r < 4; r++) {
+        exact &= ranges[r]->min == ranges[r]->max;
     }
+    printf("{\n");
+    write_estimate_range("statements", &estimate.statements, ",");
+    write_estimate_range("output_bytes", &estimate.outputBytes, ",");
+    write_estimate_range("reads", &estimate.reads, ",");
+    write_estimate_range("peak_text_bytes", &estimate.peakTextBytes, ",");
+    printf("  \"may_fail\": %s,\n  \"exact\": %s\n}\n", estimate.mayFail ? "true" : "false", exact ? "true" : "false");
+}
 
-    int is_comment_open = 0;  // Flag for comments
-    int open_curly_brackets = 0;  // Flag for curly brackets
-    char line[1024];
-    while (fgets(line, sizeof(line), inputFile)) {
-        if (!strip_comments(line, &is_comment_open)) {  // If the comment is not closed, do not continue
-            continue;  // If the comment is not closed, check the next line
+// Creates the ring file of traceOptions and attaches the probes of traceOptions to program
+void trace_start(Program* program) {
+    if (traceOptions.path) {
+#ifndef _WIN32
+        int fd = open(traceOptions.path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        traceFileSize = sizeof(TraceFile) + sizeof(TraceEvent) * (size_t)traceOptions.events;
+        if (fd < 0 || ftruncate(fd, traceFileSize) != 0) {
+            fprintf(stderr, "Error: Could not create trace file '%s'\n", traceOptions.path);
+            exit(1);
+        }
+        traceFile = mmap(NULL, traceFileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (traceFile == MAP_FAILED) {
+            fprintf(stderr, "Error: Could not map trace file '%s'\n", traceOptions.path);
+            exit(1);
+        }
+        traceFile->sourceHash = hash_tokens(&program->scan);
+        traceFile->capacity = traceOptions.events;
+        traceFile->written = 0;
+        traceFile->magic = TRACE_MAGIC;
+#else
+        fprintf(stderr, "Error: --trace-file is not supported on this platform\n");
+        exit(1);
+#endif
+    }
+    for (int i = 0; i < traceOptions.lineCount; i++) {
+        if (attach_line(program, traceOptions.lines[i], traceOptions.flags[i]) == 0) {
+            fprintf(stderr, "Warning: No statement starts on line %d\n", traceOptions.lines[i]);
         }
+    }
+}
+
+void trace_stop(void) {
+    if (traceFile) {
+        fprintf(stderr, "[trace] %lld events written to %s\n", traceFile->written, traceOptions.path);
+#ifndef _WIN32
+        munmap(traceFile, traceFileSize);
+#endif
+        traceFile = NULL;
+    }
+}
 
-        // If comment is closed, commit current line
-        if (!is_comment_open) {
-            process_line(line, outputFile, &is_comment_open, &open_curly_brackets);
+// The breakpoint hook of the command line: the position and every variable, on stderr
+void write_breakpoint(Program* program, Context* context, int pc) {
+    Instruction* instruction = &program->code[pc];
+    int first = program->probes[instruction->probe].kind == INSTRUCTION_LOOP ? instruction->start - 1 : instruction->start;
+    fprintf(stderr, "[break] %s:%d after %lld statements\n", context->fileName, program->scan.tokens[first].line,
+            context->statementCount);
+    for (int slot = 0; slot < context->variables.count; slot++) {
+        if (context->variables.isInteger[slot]) {
+            fprintf(stderr, "  %s = %d\n", context->variables.names[slot], context->variables.ints[slot]);
+        } else {
+            fprintf(stderr, "  %s = \"%s\"\n", context->variables.names[slot], variable_text(context, slot));
         }
     }
+}
 
-    // If there is still an open comment at the end of the file, print the error message
-    if (is_comment_open) {
-        fprintf(outputFile, "Error: Unclosed comment.\n");
+// Prints the events of a trace file as text, oldest first (--trace-decode FILE)
+void run_trace_decode(const char* tracePath, const char* inputFilePath) {
+    Program program = {0};
+    if (!load_program(&program, inputFilePath)) {
+        fprintf(stderr, "Error: Could not open input file.\n");
+        exit(1);
+    }
+    FILE* file = fopen(tracePath, "rb");
+    TraceFile header;
+    if (file == NULL || fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC ||
+        header.capacity <= 0 || header.written < 0) {
+        fprintf(stderr, "Error: '%s' is not a trace file\n", tracePath);
+        exit(1);
+    }
+    if (header.sourceHash != hash_tokens(&program.scan)) {
+        fprintf(stderr, "Error: Trace '%s' was recorded from a different script\n", tracePath);
+        exit(1);
     }
 
-    fclose(inputFile);
-    fclose(outputFile);
+    const Token* tokens = program.scan.tokens;
+    long long first = header.written > header.capacity ? header.written - header.capacity : 0;
+    printf("[trace] %lld events, %lld overwritten\n", header.written - first, first);
+    for (long long e = first; e < header.written; e++) {
+        TraceEvent event;
+        fseek(file, (long)(sizeof(TraceFile) + sizeof(TraceEvent) * (e % header.capacity)), SEEK_SET);
+        if (fread(&event, sizeof(event), 1, file) != 1 || event.token < 0 || event.token >= program.scan.tokenCount) {
+            fprintf(stderr, "Error: Trace '%s' is damaged\n", tracePath);
+            exit(1);
+        }
+        const Token* token = &tokens[event.token];
+        printf("%lld line %d: ", event.statement, token->line);
+        switch (event.kind) {
+            case TRACE_STATEMENT: {
+                int length = strcspn(program.source + token->offset, "\n");
+                printf("%.*s\n", length < 60 ? length : 60, program.source + token->offset);
+                break;
+            }
+            case TRACE_INT_WRITE:
+                printf("%s = %lld\n", token->value, event.value);
+                break;
+            case TRACE_TEXT_WRITE:
+                printf("%s = text of %lld characters\n", token->value, event.value);
+                break;
+            case TRACE_LOOP_ENTER:
+                printf("loop of %lld iterations\n", event.value);
+                break;
+            case TRACE_LOOP_EXIT:
+                printf("loop done\n");
+                break;
+            case TRACE_OUTPUT:
+                printf("wrote %lld bytes\n", event.value);
+                break;
+            default:
+                printf("breakpoint\n");
+                break;
+        }
+    }
+    fclose(file);
+    free_program(&program);
 }
 
-// Main interpreter function, reads and executes the code
-void interpreter(const char* inputFilePath) {
-    FILE* inputFile = fopen(inputFilePath, "r");
-    if (!inputFile) {
+void interpreter(const char* inputFilePath, int resume) {
+    Program program = {0};
+    if (!load_program(&program, inputFilePath)) {
         fprintf(stderr, "Error: Could not open input file.\n");
         return;
     }
 
     Context context = {0};
     context.fileName = inputFilePath;
+    if (tape.path) {
+        tape_open(hash_tokens(&program.scan));
+    }
+    trace_start(&program);
 
-    char line[1024];
-    int is_comment_open = 0;
-    int open_curly_brackets = 0;
-
-    while (fgets(line, sizeof(line), inputFile)) {
-        context.currentLine++;
-        if (!strip_comments(line, &is_comment_open)) {
-            continue;
-        }
-        if (!is_comment_open) {
-            execute_line(line, &context);
+#ifndef _WIN32
+    if (checkpoint.path) {
+        if (!checkpoint_open(&program, &context, resume)) {
+            fprintf(stderr, "Error: No checkpoint to resume from in '%s'\n", checkpoint.path);
+            exit(1);
         }
+        execute_program(&program, &context, program.codeCount);
+        checkpoint_finish();
+    } else
+#endif
+    {
+        run_program(&program, &context, 0, NULL, NULL);
+    }
+    free_program(&program);
+    flush_output();
+    trace_stop();
+    int tapeMatches = tape_finish();
+    if (!tapeMatches) {
+        context.errorCount++;
+        strcpy(context.lastErrorMessage, "Output differs from the recording");
     }
-
-    fclose(inputFile);
 
     if (context.errorCount > 0) {
         fprintf(stderr, "Total errors: %d\n", context.errorCount);
         fprintf(stderr, "Last error: %s\n", context.lastErrorMessage);
     }
+    if (!tapeMatches) {
+        exit(1);
+    }
 }
 
-int main() {
-    interpreter("code.sta");
+int main(int argc, char* argv[]) {
+    const char* inputFilePath = "code.sta";
+    int asyncIo = 0;
+    int watchMode = 0;
+    int resume = 0;
+    const char* checkpointPath = NULL;
+    long long checkpointStatements = 0;
+    double checkpointSeconds = 0;
+    int threads = 1;
+    long long fuel = 0;
+    ScriptSpec scripts[MAX_INSTANCES];
+    int scriptCount = 0;
+    int priority = 1;
+    long long limit = 0;
+    const char* servePath = NULL;
+    const char* batchPath = NULL;
+    int streamMode = 0;
+    int lexEdits = 0;
+    int estimateMode = 0;
+    const char* recordPath = NULL;
+    const char* replayPath = NULL;
+    const char* traceDecodePath = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            atexit(stats_report);
+        } else if (strcmp(argv[i], "--async-io") == 0) {
+            asyncIo = 1;
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            watchMode = 1;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            streamMode = 1;
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpointPath = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-statements") == 0 && i + 1 < argc) {
+            checkpointStatements = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--checkpoint-seconds") == 0 && i + 1 < argc) {
+            checkpointSeconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            resume = 1;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            recordPath = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replayPath = argv[++i];
+        } else if ((strcmp(argv[i], "--trace") == 0 || strcmp(argv[i], "--break") == 0) && i + 1 < argc) {
+            if (traceOptions.lineCount == MAX_PROBE_LINES) {
+                fprintf(stderr, "Error: At most %d --trace and --break lines\n", MAX_PROBE_LINES);
+                return 1;
+            }
+            traceOptions.flags[traceOptions.lineCount] = argv[i][2] == 't' ? PROBE_TRACE : PROBE_BREAK;
+            traceOptions.lines[traceOptions.lineCount++] = parse_integer(argv[++i]);
+        } else if (strcmp(argv[i], "--trace-file") == 0 && i + 1 < argc) {
+            traceOptions.path = argv[++i];
+        } else if (strcmp(argv[i], "--trace-events") == 0 && i + 1 < argc) {
+            traceOptions.events = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--trace-decode") == 0 && i + 1 < argc) {
+            traceDecodePath = argv[++i];
+        } else if (strcmp(argv[i], "--estimate") == 0) {
+            estimateMode = 1;
+        } else if (strcmp(argv[i], "--lex-edits") == 0) {
+            lexEdits = 1;
+        } else if (strcmp(argv[i], "--lex-report") == 0 && i + 1 < argc) {
+            lexicalReportPath = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = parse_integer(argv[++i]);
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batchPath = argv[++i];
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            servePath = argv[++i];
+        } else if (strcmp(argv[i], "--fuel") == 0 && i + 1 < argc) {
+            fuel = atoll(argv[++i]);
+        } else if (strcmp(argv[i], "--priority") == 0 && i + 1 < argc) {
+            priority = parse_integer(argv[++i]);
+        } else if (strcmp(argv[i], "--limit") == 0 && i + 1 < argc) {
+            limit = atoll(argv[++i]);
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            fprintf(stderr, "Error: Unknown option '%s'\n", argv[i]);
+            return 1;
+        } else {
+            inputFilePath = argv[i];
+            if (scriptCount < MAX_INSTANCES) {
+                scripts[scriptCount].path = argv[i];
+                scripts[scriptCount].priority = priority;
+                scripts[scriptCount].limit = limit;
+                scriptCount++;
+            }
+        }
+    }
+
+    if (lexEdits) {
+        run_lex_edits(inputFilePath);
+        return 0;
+    }
+    if (estimateMode) {
+        run_estimate(inputFilePath);
+        return 0;
+    }
+    if (traceDecodePath) {
+        run_trace_decode(traceDecodePath, inputFilePath);
+        return 0;
+    }
+    if (traceOptions.lineCount > 0 || traceOptions.path) {
+        if (watchMode || batchPath || servePath || fuel != 0 || streamMode) {
+            fprintf(stderr, "Error: --trace and --break cannot be combined with --watch, --batch, --serve, --fuel or --stream\n");
+            return 1;
+        }
+        int traced = 0;
+        for (int i = 0; i < traceOptions.lineCount; i++) {
+            traced |= traceOptions.flags[i] == PROBE_TRACE;
+        }
+        if (traced && !traceOptions.path) {
+            fprintf(stderr, "Error: --trace needs --trace-file FILE\n");
+            return 1;
+        }
+        if (traceOptions.events < 0) {
+            fprintf(stderr, "Error: --trace-events needs a positive number\n");
+            return 1;
+        }
+        if (traceOptions.events == 0) {
+            traceOptions.events = TRACE_DEFAULT_EVENTS;
+        }
+        breakpointHook = write_breakpoint;
+    }
+    if (recordPath || replayPath) {
+        if ((recordPath && replayPath) || watchMode || checkpointPath || batchPath || servePath || fuel != 0 || streamMode) {
+            fprintf(stderr, "Error: --record and --replay cannot be combined with each other, --watch, --checkpoint, --batch, --serve, --fuel or --stream\n");
+            return 1;
+        }
+        tape.path = recordPath ? recordPath : replayPath;
+        tape.replaying = replayPath != NULL;
+    }
+
+#ifndef _WIN32
+    if ((resume || checkpointStatements > 0 || checkpointSeconds > 0) && !checkpointPath) {
+        fprintf(stderr, "Error: --resume and the checkpoint intervals need --checkpoint FILE\n");
+        return 1;
+    }
+    if (checkpointPath) {
+        checkpoint.path = checkpointPath;
+        checkpoint.everyStatements = checkpointStatements;
+        checkpoint.everySeconds = checkpointSeconds;
+        if (checkpointStatements <= 0 && checkpointSeconds <= 0) {
+            checkpoint.everyStatements = 1000000;
+        }
+    }
+    if (streamMode && (watchMode || checkpointPath || batchPath || servePath || fuel != 0)) {
+        fprintf(stderr, "Error: --stream cannot be combined with --watch, --checkpoint, --batch, --serve or --fuel\n");
+        return 1;
+    }
+    if (batchPath) {
+        if (watchMode || checkpointPath || fuel != 0 || servePath || threads != 1) {
+            fprintf(stderr, "Error: --batch cannot be combined with --watch, --checkpoint, --fuel, --serve or --threads\n");
+            return 1;
+        }
+        if (asyncIo) {
+            async_io_start();
+        }
+        return run_batch(batchPath, inputFilePath) > 0;
+    }
+    if (servePath) {
+#ifdef __linux__
+        if (asyncIo || watchMode || checkpointPath || fuel != 0) {
+            fprintf(stderr, "Error: --serve cannot be combined with --async-io, --watch, --checkpoint or --fuel\n");
+            return 1;
+        }
+        if (threads == 0) {
+            threads = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        serve(servePath, inputFilePath, threads < 1 ? 1 : threads > MAX_WORKER_THREADS ? MAX_WORKER_THREADS : threads);
+        return 0;
+#else
+        fprintf(stderr, "Error: --serve is only supported on Linux\n");
+        return 1;
+#endif
+    }
+    if (fuel > 0 || priority != 1 || limit != 0) {
+        if (fuel <= 0 || priority < 1 || priority > 16 || limit < 0 || scriptCount == 0) {
+            fprintf(stderr, "Error: Scheduling needs --fuel N > 0, priorities from 1 to 16 and script files\n");
+            return 1;
+        }
+        if (watchMode || checkpointPath || threads != 1) {
+            fprintf(stderr, "Error: --fuel cannot be combined with --watch, --checkpoint or --threads\n");
+            return 1;
+        }
+        if (asyncIo) {
+            async_io_start();
+        }
+        return run_scheduled(scripts, scriptCount, fuel) > 0;
+    }
+    if (watchMode) {
+        if (asyncIo || checkpointPath) {
+            fprintf(stderr, "Error: --watch cannot be combined with --async-io or --checkpoint\n");
+            return 1;
+        }
+        watch(inputFilePath);
+        return 0;
+    }
+    if (asyncIo) {
+        async_io_start();
+    }
+    if (threads == 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    parallelThreads = threads < 1 ? 1 : threads > MAX_WORKER_THREADS ? MAX_WORKER_THREADS : threads;
+    if (streamMode) {
+        run_stream(inputFilePath);
+        return 0;
+    }
+#else
+    if (asyncIo || watchMode || checkpointPath || resume || threads != 1 || fuel != 0 || streamMode) {
+        fprintf(stderr, "Error: --async-io, --watch, --threads, --fuel, --stream and checkpoints are not supported on this platform\n");
+        return 1;
+    }
+#endif
+
+    interpreter(inputFilePath, resume);
     return 0;
 }